@@ -0,0 +1,292 @@
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aggregate.h"
+#include "database.h"
+
+void publish_message(topic *, message_info *, char *, uint64_t);  // server.c
+
+static const char *functions[] = {"min", "max", "avg", "sum", "count"};
+
+
+/*
+ * Function parsing a duration ("<n>ms", "<n>s", "<n>m" or "<n>h") at the start of "text", setting "end"
+ * after it; returns the duration in ms, 0 if invalid.
+ */
+static uint32_t parse_duration(char *text, char **end) {
+    if (*text < '0' || *text > '9') {
+        return 0;
+    }
+
+    unsigned long n = strtoul(text, end, 10), unit;
+    if (!strncmp(*end, "ms", 2)) {
+        unit = 1;
+        *end += 2;
+    } else if (**end == 's' || **end == 'm' || **end == 'h') {
+        unit = **end == 's' ? 1000 : **end == 'm' ? 60000 : 3600000;
+        (*end)++;
+    } else {
+        return 0;
+    }
+
+    return n && n <= UINT32_MAX / unit ? n * unit : 0;
+}
+
+/*
+ * Function parsing the title of a derived topic, "<base>@<function>:<window>[/<step>]", filling in the
+ * base topic's title and the aggregate's parameters; returns 0 if the title is not one of a derived topic.
+ */
+static int parse_aggregate(char *title, char *base, aggregate *a) {
+    char *at = strrchr(title, '@');
+    if (!at || at == title) {
+        return 0;
+    }
+
+    char *colon = strchr(at, ':');
+    if (!colon) {
+        return 0;
+    }
+    size_t len = colon - at - 1;
+    int function = -1;
+    for (size_t i = 0; i < sizeof(functions) / sizeof(functions[0]); i++) {
+        if (strlen(functions[i]) == len && !strncmp(at + 1, functions[i], len)) {
+            function = i;
+        }
+    }
+
+    char *end;
+    uint32_t window = parse_duration(colon + 1, &end), step = window;
+    if (*end == '/') {
+        step = parse_duration(end + 1, &end);
+    }
+    if (function < 0 || !window || *end || step < AGGREGATE_MIN_STEP || window % step ||
+        window / step > AGGREGATE_MAX_BUCKETS) {
+        return 0;
+    }
+
+    memcpy(base, title, at - title);
+    base[at - title] = '\0';
+    a->function = function;
+    a->window = window;
+    a->step = step;
+    a->buckets = window / step;
+
+    return 1;
+}
+
+/*
+ * Function decoding the value of a numeric message (as printed by the subscriber); returns 0 for other
+ * types.
+ */
+static int decode_value(uint8_t type, char *payload, double *value) {
+    uint8_t sign, power;
+    uint16_t short_real;
+    uint32_t n;
+
+    switch (type) {
+        case 0:
+            memcpy(&sign, payload, sizeof(sign));
+            memcpy(&n, payload + sizeof(sign), sizeof(n));
+            *value = sign ? -(double)ntohl(n) : ntohl(n);
+            return 1;
+        case 1:
+            memcpy(&short_real, payload, sizeof(short_real));
+            *value = ntohs(short_real) / 100.0;
+            return 1;
+        case 2:
+            memcpy(&sign, payload, sizeof(sign));
+            memcpy(&n, payload + sizeof(sign), sizeof(n));
+            memcpy(&power, payload + sizeof(sign) + sizeof(n), sizeof(power));
+            *value = ntohl(n);
+            for (uint8_t i = 0; i < power; i++) {
+                *value /= 10;
+            }
+            if (sign) {
+                *value = -*value;
+            }
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Function encoding a value as the payload of a FLOAT message, with at most 4 decimals; returns the
+ * length of the payload.
+ */
+static int encode_float(double value, char *payload) {
+    uint8_t sign = value < 0, power = 4;
+    if (sign) {
+        value = -value;
+    }
+
+    double scaled = value * 10000;
+    while (power && scaled + 0.5 > UINT32_MAX) {
+        scaled /= 10;
+        power--;
+    }
+    uint32_t n = scaled + 0.5 > UINT32_MAX ? UINT32_MAX : (uint32_t)(scaled + 0.5);
+    while (power && n % 10 == 0) {  // no trailing zeros
+        n /= 10;
+        power--;
+    }
+
+    n = htonl(n);
+    memcpy(payload, &sign, sizeof(sign));
+    memcpy(payload + sizeof(sign), &n, sizeof(n));
+    memcpy(payload + sizeof(sign) + sizeof(n), &power, sizeof(power));
+    return 2 * sizeof(uint8_t) + sizeof(uint32_t);
+}
+
+/*
+ * Function encoding a count as the payload of an INT message; returns the length of the payload.
+ */
+static int encode_count(uint64_t count, char *payload) {
+    uint8_t sign = 0;
+    uint32_t n = htonl(count > UINT32_MAX ? UINT32_MAX : (uint32_t)count);
+
+    memcpy(payload, &sign, sizeof(sign));
+    memcpy(payload + sizeof(sign), &n, sizeof(n));
+    return sizeof(uint8_t) + sizeof(uint32_t);
+}
+
+/*
+ * Function called at the end of each step of a window: the function is computed over the buckets of the
+ * window and published on the derived topic (from address 0.0.0.0:0), then the oldest bucket is emptied
+ * for the next step. Once the window holds no messages, nothing is published and the timer stops until
+ * the next message of the base topic.
+ */
+static void close_window(void *data) {
+    aggregate *a = (aggregate *)data;
+    aggregate_bucket total = {0, 0, 0, 0};
+
+    for (uint32_t i = 0; i < a->buckets; i++) {
+        aggregate_bucket *b = &a->ring[i];
+        if (!b->count) {
+            continue;
+        }
+        if (!total.count || b->min < total.min) {
+            total.min = b->min;
+        }
+        if (!total.count || b->max > total.max) {
+            total.max = b->max;
+        }
+        total.count += b->count;
+        total.sum += b->sum;
+    }
+
+    a->current = (a->current + 1) % a->buckets;
+    memset(&a->ring[a->current], 0, sizeof(aggregate_bucket));
+    if (!total.count) {
+        return;
+    }
+    timer_start(&a->close, a->step);
+
+    char payload[2 * sizeof(uint8_t) + sizeof(uint32_t)];
+    message_info info;
+    memset(&info, 0, sizeof(info));
+    memcpy(info.ip, "0.0.0.0", sizeof("0.0.0.0"));
+    info.topic_len = strlen(a->topic->title);
+
+    switch (a->function) {
+        case AGGREGATE_MIN:
+            info.data_len = encode_float(total.min, payload);
+            break;
+        case AGGREGATE_MAX:
+            info.data_len = encode_float(total.max, payload);
+            break;
+        case AGGREGATE_AVG:
+            info.data_len = encode_float(total.sum / total.count, payload);
+            break;
+        case AGGREGATE_SUM:
+            info.data_len = encode_float(total.sum, payload);
+            break;
+        case AGGREGATE_COUNT:
+            info.data_len = encode_count(total.count, payload);
+            break;
+    }
+    info.data_type = a->function == AGGREGATE_COUNT ? 0 : 2;
+
+    a->published++;
+    publish_message(a->topic, &info, payload, now_ns());
+}
+
+/*
+ * Function making a newly added topic a derived one if its title names an aggregate, adding its base
+ * topic if needed (itself derived or not).
+ */
+void aggregate_attach(topic *t) {
+    aggregate spec;
+    memset(&spec, 0, sizeof(spec));
+    char base_title[sizeof(t->title)];
+    if (!parse_aggregate(t->title, base_title, &spec)) {
+        return;
+    }
+
+    topic *base = find_topic(base_title);
+    if (!base) {
+        base = add_topic(base_title);
+    }
+
+    aggregate *a = (aggregate *)calloc(1, sizeof(aggregate));
+    DIE(a == NULL, "bad alloc");
+    *a = spec;
+    a->ring = (aggregate_bucket *)calloc(a->buckets, sizeof(aggregate_bucket));
+    DIE(a->ring == NULL, "bad alloc");
+    a->base = base;
+    a->topic = t;
+    timer_init(&a->close, close_window, a);
+
+    a->next = base->aggregates;
+    base->aggregates = a;
+    t->aggregate = a;
+}
+
+/*
+ * Function adding a message of a topic to the current bucket of the windows of its derived topics;
+ * messages which are not numeric are ignored. A window starts with the first message it holds.
+ */
+void aggregate_feed(topic *t, uint8_t type, char *payload) {
+    double value;
+    if (!decode_value(type, payload, &value)) {
+        return;
+    }
+
+    for (aggregate *a = t->aggregates; a != NULL; a = a->next) {
+        aggregate_bucket *b = &a->ring[a->current];
+        if (!b->count || value < b->min) {
+            b->min = value;
+        }
+        if (!b->count || value > b->max) {
+            b->max = value;
+        }
+        b->count++;
+        b->sum += value;
+
+        if (!timer_pending(&a->close)) {
+            timer_start(&a->close, a->step);
+        }
+    }
+}
+
+/*
+ * Function deallocating the window of a derived topic, removing it from the list of its base topic.
+ */
+void aggregate_free(topic *t) {
+    aggregate *a = t->aggregate;
+    if (!a) {
+        return;
+    }
+
+    aggregate **p = &a->base->aggregates;
+    while (*p != a) {
+        p = &(*p)->next;
+    }
+    *p = a->next;
+
+    timer_cancel(&a->close);
+    free(a->ring);
+    free(a);
+    t->aggregate = NULL;
+}
@@ -0,0 +1,52 @@
+#ifndef _AGGREGATE_H
+#define _AGGREGATE_H 1
+
+#include <stdint.h>
+
+#include "common.h"
+#include "timer.h"
+
+#define AGGREGATE_MAX_BUCKETS 1024  // steps a sliding window spans at most
+#define AGGREGATE_MIN_STEP 10  // ms, shortest window (or step of a sliding window)
+
+/*
+ * Functions computed over the numeric messages (INT, SHORT_REAL, FLOAT) of a window.
+ */
+enum {
+    AGGREGATE_MIN,
+    AGGREGATE_MAX,
+    AGGREGATE_AVG,
+    AGGREGATE_SUM,
+    AGGREGATE_COUNT,
+};
+
+/*
+ * Partial result over the messages of one step of a window.
+ */
+typedef struct {
+    uint64_t count;
+    double sum, min, max;
+} aggregate_bucket;
+
+/*
+ * Derived topic "<base>@<function>:<window>[/<step>]", whose messages are the function computed over the
+ * base topic's messages in a window of "window" ms, published every "step" ms (tumbling windows if the
+ * step is the window, sliding ones otherwise). The window is kept incrementally as a ring of one bucket
+ * per step, shared by all the subscribers of the derived topic.
+ */
+typedef struct aggregate {
+    topic *base, *topic;
+    uint8_t function;  // AGGREGATE_*
+    uint32_t window, step;  // ms
+    uint32_t buckets, current;  // steps in the window, bucket the messages are added to
+    aggregate_bucket *ring;
+    timer close;  // pending while the window holds messages, fires at the end of each step
+    uint64_t published;  // results published
+    struct aggregate *next;  // next derived topic of the same base topic
+} aggregate;
+
+void aggregate_attach(topic *);
+void aggregate_feed(topic *, uint8_t, char *);
+void aggregate_free(topic *);
+
+#endif
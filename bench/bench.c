@@ -0,0 +1,221 @@
+#define _GNU_SOURCE
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define MAX_REPS 100
+
+long bench_max_scale = 1000000;
+uint64_t bench_bytes_sent;
+
+static int warmup = 1, reps = 5;
+static const char *filter;  // only the cases whose name contains it are run
+static int perf_fd = -1;  // cache miss counter of this thread, -1 if unavailable
+static long allocs;  // allocations made since the start of the program
+
+
+/*
+ * Allocation wrappers (linked with --wrap), counting the allocations of the benchmarked code.
+ */
+void *__real_malloc(size_t);
+void *__real_calloc(size_t, size_t);
+void *__real_realloc(void *, size_t);
+
+void *__wrap_malloc(size_t size) {
+    allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    allocs++;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+    allocs++;
+    return __real_realloc(p, size);
+}
+
+/*
+ * Mock sockets (linked with --wrap): every byte is accepted right away, so that only the server's own
+ * work is measured.
+ */
+ssize_t __wrap_send(int sockfd, const void *buf, size_t len, int flags) {
+    bench_bytes_sent += len;
+    return len;
+}
+
+ssize_t __wrap_sendmsg(int sockfd, const struct msghdr *msg, int flags) {
+    size_t len = 0;
+    for (size_t i = 0; i < msg->msg_iovlen; i++) {
+        len += msg->msg_iov[i].iov_len;
+    }
+
+    bench_bytes_sent += len;
+    return len;
+}
+
+/*
+ * Function returning the current value of the monotonic clock, in nanoseconds.
+ */
+static uint64_t clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Function opening the hardware cache miss counter of the calling thread (user space only).
+ */
+static void open_perf_counter(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    perf_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/*
+ * Function parsing the harness options and printing the header of the results:
+ * -w <warmup repetitions> -r <repetitions> -m <max scale> -f <case name filter>.
+ */
+void bench_init(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "w:r:m:f:")) != -1) {
+        switch (opt) {
+            case 'w':
+                warmup = atoi(optarg);
+                break;
+            case 'r':
+                reps = atoi(optarg);
+                break;
+            case 'm':
+                bench_max_scale = atol(optarg);
+                break;
+            case 'f':
+                filter = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-w <warmup repetitions>] [-r <repetitions>] [-m <max scale>]"
+                                " [-f <case name filter>]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (warmup < 0 || reps < 1 || reps > MAX_REPS || bench_max_scale < 1) {
+        fprintf(stderr, "Invalid options.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    open_perf_counter();
+    if (perf_fd < 0) {
+        fprintf(stderr, "perf_event_open unavailable, cache misses are not counted.\n");
+    }
+
+    printf("%-28s %10s %12s %12s %10s %14s\n", "case", "scale", "ns/op", "min ns/op", "allocs/op",
+           "cache-miss/op");
+}
+
+/*
+ * Function checking whether a case was selected by the name filter.
+ */
+int bench_selected(const char *name) {
+    return !filter || strstr(name, filter);
+}
+
+/*
+ * Function checking whether a group of cases (the cases whose names start with "prefix") may hold cases
+ * selected by the name filter, so that the setup of the others is skipped.
+ */
+int bench_group(const char *prefix) {
+    return !filter || strstr(prefix, filter) || !strncmp(filter, prefix, strlen(prefix));
+}
+
+/*
+ * Function comparing two doubles, for sorting.
+ */
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Function running a case at a given scale, with "ops" operations per repetition, and printing its results.
+ */
+void bench_run(bench_case *bc, long scale, void *ctx, long ops) {
+    double ns[MAX_REPS];
+    long total_allocs = 0;
+    long long total_misses = 0;
+
+    if (!bench_selected(bc->name)) {
+        return;
+    }
+
+    for (int i = -warmup; i < reps; i++) {
+        if (bc->setup) {
+            bc->setup(ctx, ops);
+        }
+
+        if (perf_fd >= 0) {
+            ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        long allocs_before = allocs;
+        uint64_t start = clock_ns();
+
+        bc->run(ctx, ops);
+
+        uint64_t elapsed = clock_ns() - start;
+        long run_allocs = allocs - allocs_before;
+        long long misses = 0;
+        if (perf_fd >= 0) {
+            ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(perf_fd, &misses, sizeof(misses)) != sizeof(misses)) {
+                misses = 0;
+            }
+        }
+
+        if (bc->teardown) {
+            bc->teardown(ctx, ops);
+        }
+
+        if (i >= 0) {  // warmup repetitions are not counted
+            ns[i] = (double)elapsed / ops;
+            total_allocs += run_allocs;
+            total_misses += misses;
+        }
+    }
+
+    qsort(ns, reps, sizeof(double), compare_doubles);
+    printf("%-28s %10ld %12.1f %12.1f %10.2f ", bc->name, scale, ns[reps / 2], ns[0],
+           (double)total_allocs / reps / ops);
+    if (perf_fd >= 0) {
+        printf("%14.2f\n", (double)total_misses / reps / ops);
+    } else {
+        printf("%14s\n", "-");
+    }
+}
+
+/*
+ * Function releasing the harness' resources.
+ */
+void bench_close(void) {
+    if (perf_fd >= 0) {
+        close(perf_fd);
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef _BENCH_H
+#define _BENCH_H 1
+
+#include <stdint.h>
+
+/*
+ * Micro-benchmark harness: each case runs a number of operations per repetition, after untimed warmup
+ * repetitions, and reports the median time per operation, the allocations per operation and, where
+ * perf_event_open is available, the cache misses per operation. Sockets are mocked (send() and sendmsg()
+ * accept everything) and allocations are counted, by wrapping the corresponding functions at link time.
+ */
+
+/*
+ * Benchmark case; "setup" and "teardown" (optional) run untimed around each repetition, "run" performs
+ * the "ops" timed operations.
+ */
+typedef struct {
+    const char *name;
+    void (*setup)(void *, long);
+    void (*run)(void *, long);
+    void (*teardown)(void *, long);
+} bench_case;
+
+extern long bench_max_scale;  // largest scale of the scaling curves (-m)
+extern uint64_t bench_bytes_sent;  // bytes accepted by the mock sockets
+
+void bench_init(int, char **);
+int bench_selected(const char *);
+int bench_group(const char *);
+void bench_run(bench_case *, long, void *, long);
+void bench_close(void);
+
+#endif
@@ -0,0 +1,568 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../common.h"
+#include "../connection.h"
+#include "../database.h"
+#include "../fanout.h"
+#include "../list.h"
+#include "../multicast.h"
+#include "../ratelimit.h"
+#include "../shard.h"
+#include "../shmring.h"
+#include "bench.h"
+
+#define FIRST_FD 1000  // descriptors of the mock subscriber sockets start here
+#define LIST_CELLS 1000000  // cells spread over the lists of a list benchmark
+#define SHARD_SUBSCRIBERS 10000  // subscribers of the topic of the shard benchmark, spread over the workers
+
+// routing functions of the server (server.c, linked without its main())
+void register_subscription(int, char *, uint8_t, uint32_t);
+void register_unsubscription(int, char *);
+void send_messages(udp_packet, struct sockaddr_in);
+void get_stored_messages(subscriber *);
+
+static struct sockaddr_in source;  // address the benchmark's datagrams come from
+
+
+/*
+ * Function returning a pseudo-random number (xorshift), the same sequence at every run.
+ */
+static uint64_t next_random(void) {
+    static uint64_t x = 88172645463325252ull;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+
+    return x;
+}
+
+/*
+ * Function filling in an INT datagram on a given topic.
+ */
+static void make_packet(udp_packet *p, const char *title, uint32_t value) {
+    memset(p, 0, sizeof(udp_packet));
+    strncpy(p->topic, title, sizeof(p->topic));
+    p->data_type = 0;
+    value = htonl(value);
+    memcpy(p->payload + 1, &value, sizeof(value));
+}
+
+/*
+ * Function registering a subscriber connected through the mock socket "fd".
+ */
+static subscriber *connect_subscriber(int fd) {
+    char id[11];
+    snprintf(id, sizeof(id), "b%d", fd);
+
+    subscriber *s = add_offline_subscriber(id);
+    strcpy(s->ip, "127.0.0.1");
+    s->port = fd;
+    s->socket = fd;
+    s->connected = 1;
+    s->session = 1;  // as after a login
+    open_connection(fd)->sub = s;
+
+    return s;
+}
+
+/*
+ * Function dropping the database and the connections between two scales.
+ */
+static void reset_server(void) {
+    free_connections();
+    free_database();
+    init_database();
+}
+
+
+/*
+ * insert_in_list() / remove_from_list(): each operation works on a different list of "length" cells,
+ * on the last cell (the lists are walked to their end).
+ */
+typedef struct {
+    long length;
+    list *lists;
+    int *values;
+} list_ctx;
+
+static int equal_pointer(void *a, void *b) {
+    return a == b;
+}
+
+/*
+ * Function removing the cells after the first "length" of each list.
+ */
+static void truncate_lists(void *p, long ops) {
+    list_ctx *ctx = (list_ctx *)p;
+    for (long i = 0; i < ops; i++) {
+        list q = ctx->lists[i];
+        for (long j = 1; j < ctx->length; j++) {
+            q = q->next;
+        }
+        free_list(&q->next, free);
+    }
+}
+
+static void run_insert(void *p, long ops) {
+    list_ctx *ctx = (list_ctx *)p;
+    for (long i = 0; i < ops; i++) {
+        insert_in_list(&ctx->lists[i], malloc(sizeof(int)));
+    }
+}
+
+static void setup_remove(void *p, long ops) {
+    list_ctx *ctx = (list_ctx *)p;
+    for (long i = 0; i < ops; i++) {
+        ctx->values[i] = 0;
+    }
+    run_insert(p, ops);
+}
+
+static void run_remove(void *p, long ops) {
+    list_ctx *ctx = (list_ctx *)p;
+    for (long i = 0; i < ops; i++) {
+        list q = ctx->lists[i];
+        for (long j = 0; j < ctx->length; j++) {  // (finding the cell is part of the work measured)
+            q = q->next;
+        }
+        remove_from_list(&ctx->lists[i], q->info, equal_pointer);
+    }
+}
+
+static void bench_lists(void) {
+    bench_case insert = { "list/insert_in_list", NULL, run_insert, truncate_lists };
+    bench_case remove = { "list/remove_from_list", setup_remove, run_remove, NULL };
+
+    if (!bench_group("list/")) {
+        return;
+    }
+
+    for (long length = 10; length <= 100000 && length <= bench_max_scale; length *= 10) {
+        long ops = LIST_CELLS / length < 10000 ? LIST_CELLS / length : 10000;
+        list_ctx ctx = { length, (list *)calloc(ops, sizeof(list)), (int *)calloc(ops, sizeof(int)) };
+        DIE(!ctx.lists || !ctx.values, "bad alloc");
+        for (long i = 0; i < ops; i++) {
+            for (long j = 0; j < length; j++) {
+                push_in_list(&ctx.lists[i], malloc(sizeof(int)));
+            }
+        }
+
+        bench_run(&insert, length, &ctx, ops);
+        bench_run(&remove, length, &ctx, ops);
+
+        for (long i = 0; i < ops; i++) {
+            free_list(&ctx.lists[i], free);
+        }
+        free(ctx.lists);
+        free(ctx.values);
+    }
+}
+
+
+/*
+ * Routing with a growing number of topics, each with one subscriber: subscribing another subscriber to
+ * random topics, unsubscribing it, and publishing on random topics.
+ */
+typedef struct {
+    long topics;
+    int fd;  // socket of the subscriber (un)subscribing
+    char (*titles)[51];  // titles of the topics operated on
+    udp_packet *packets;
+} topics_ctx;
+
+/*
+ * Function picking distinct topics from a random one on (the stride is prime to the number of topics,
+ * a power of 10).
+ */
+static void pick_topics(void *p, long ops) {
+    topics_ctx *ctx = (topics_ctx *)p;
+    uint64_t first = next_random();
+    for (long i = 0; i < ops; i++) {
+        snprintf(ctx->titles[i], sizeof(ctx->titles[i]), "topic/%lu", (first + i * 7919) % ctx->topics);
+    }
+}
+
+static void run_subscribe(void *p, long ops) {
+    topics_ctx *ctx = (topics_ctx *)p;
+    for (long i = 0; i < ops; i++) {
+        register_subscription(ctx->fd, ctx->titles[i], 0, 0);
+        fanout_publish();  // as after each request handled by the event loop
+    }
+}
+
+static void run_unsubscribe(void *p, long ops) {
+    topics_ctx *ctx = (topics_ctx *)p;
+    for (long i = 0; i < ops; i++) {
+        register_unsubscription(ctx->fd, ctx->titles[i]);
+        fanout_publish();
+    }
+}
+
+static void setup_unsubscribe(void *p, long ops) {
+    pick_topics(p, ops);
+    run_subscribe(p, ops);
+}
+
+static void run_publish(void *p, long ops) {
+    topics_ctx *ctx = (topics_ctx *)p;
+    for (long i = 0; i < ops; i++) {
+        send_messages(ctx->packets[i], source);
+    }
+}
+
+static void bench_topics(void) {
+    bench_case subscribe = { "topics/register_subscription", pick_topics, run_subscribe, run_unsubscribe };
+    bench_case unsubscribe = { "topics/register_unsubscript.", setup_unsubscribe, run_unsubscribe, NULL };
+    bench_case publish = { "topics/send_messages", NULL, run_publish, NULL };
+
+    if (!bench_group("topics/")) {
+        return;
+    }
+
+    for (long n = 10; n <= 1000000 && n <= bench_max_scale; n *= 10) {
+        long ops = n < 10000 ? n : 10000;
+        topics_ctx ctx = { n, FIRST_FD + 1, calloc(ops, 51), calloc(ops, sizeof(udp_packet)) };
+        DIE(!ctx.titles || !ctx.packets, "bad alloc");
+
+        subscriber *s = connect_subscriber(FIRST_FD);
+        connect_subscriber(FIRST_FD + 1);
+        for (long i = 0; i < n; i++) {
+            char title[51];
+            snprintf(title, sizeof(title), "topic/%ld", i);
+            add_subscription(add_topic(title), s, 0, 0, 0);
+        }
+        fanout_publish();
+        pick_topics(&ctx, ops);
+        for (long i = 0; i < ops; i++) {
+            make_packet(&ctx.packets[i], ctx.titles[i], i);
+        }
+
+        bench_run(&subscribe, n, &ctx, ops);
+        bench_run(&unsubscribe, n, &ctx, ops);
+        bench_run(&publish, n, &ctx, ops);
+
+        free(ctx.titles);
+        free(ctx.packets);
+        reset_server();
+    }
+}
+
+
+/*
+ * Fan-out with a growing number of subscribers of a single topic: publishing on it (one operation
+ * delivers the message to all of them), and subscribing / unsubscribing subscribers.
+ */
+typedef struct {
+    long subs;
+    udp_packet packet;
+    int *fds;  // sockets of the subscribers operated on
+} fanout_ctx;
+
+static void run_fanout(void *p, long ops) {
+    fanout_ctx *ctx = (fanout_ctx *)p;
+    for (long i = 0; i < ops; i++) {
+        send_messages(ctx->packet, source);
+    }
+}
+
+static void run_fanout_subscribe(void *p, long ops) {
+    fanout_ctx *ctx = (fanout_ctx *)p;
+    for (long i = 0; i < ops; i++) {
+        register_subscription(ctx->fds[i], "fanout", 0, 0);
+        fanout_publish();
+    }
+}
+
+static void run_fanout_unsubscribe(void *p, long ops) {
+    fanout_ctx *ctx = (fanout_ctx *)p;
+    for (long i = 0; i < ops; i++) {
+        register_unsubscription(ctx->fds[i], "fanout");
+        fanout_publish();
+    }
+}
+
+/*
+ * Function picking distinct random subscribers of the topic to unsubscribe.
+ */
+static void pick_subscribers(void *p, long ops) {
+    fanout_ctx *ctx = (fanout_ctx *)p;
+    for (long i = 0; i < ops; i++) {
+        int fd;
+        do {
+            fd = FIRST_FD + next_random() % ctx->subs;
+            for (long j = 0; j < i; j++) {
+                if (ctx->fds[j] == fd) {
+                    fd = -1;
+                    break;
+                }
+            }
+        } while (fd < 0);
+        ctx->fds[i] = fd;
+    }
+}
+
+static void bench_fanout(void) {
+    bench_case publish = { "fanout/send_messages", NULL, run_fanout, NULL };
+    bench_case subscribe = { "fanout/register_subscription", NULL, run_fanout_subscribe, run_fanout_unsubscribe };
+    bench_case unsubscribe = { "fanout/register_unsubscript.", pick_subscribers, run_fanout_unsubscribe,
+                               run_fanout_subscribe };
+
+    if (!bench_group("fanout/")) {
+        return;
+    }
+
+    for (long n = 1; n <= 100000 && n <= bench_max_scale; n *= 10) {
+        long ops = 100000 / n < 10000 ? (100000 / n > 10 ? 100000 / n : 10) : 10000;
+        long changes = n < 100 ? n : 100;
+        fanout_ctx ctx = { .subs = n, .fds = (int *)calloc(changes, sizeof(int)) };
+        DIE(ctx.fds == NULL, "bad alloc");
+
+        topic *t = add_topic("fanout");
+        for (long i = 0; i < n; i++) {
+            add_subscription(t, connect_subscriber(FIRST_FD + i), 0, 0, 0);
+        }
+        fanout_publish();
+        make_packet(&ctx.packet, "fanout", 42);
+
+        bench_run(&publish, n, &ctx, ops);
+
+        // new subscribers join the topic
+        for (long i = 0; i < changes; i++) {
+            ctx.fds[i] = FIRST_FD + n + i;
+            connect_subscriber(ctx.fds[i]);
+        }
+        bench_run(&subscribe, n, &ctx, changes);
+
+        bench_run(&unsubscribe, n, &ctx, changes);
+
+        free(ctx.fds);
+        reset_server();
+    }
+}
+
+
+/*
+ * Fan-out of a multicast topic with a growing number of subscribers receiving it through the group: the
+ * message is sent once to the group, and going through the subscribers only checks that each of them
+ * joined it (reading its subscription and subscriber).
+ */
+static void bench_multicast(void) {
+    bench_case publish = { "mcast/send_messages", NULL, run_fanout, NULL };
+
+    if (!bench_group("mcast/")) {
+        return;
+    }
+    DIE(!multicast_init("239.255.0.1:5000"), "bad multicast group");
+    mcast_threshold = 1;
+
+    for (long n = 1; n <= 100000 && n <= bench_max_scale; n *= 10) {
+        long ops = 100000 / n < 10000 ? (100000 / n > 10 ? 100000 / n : 10) : 10000;
+        fanout_ctx ctx = { .subs = n };
+
+        topic *t = add_topic("mcast");
+        for (long i = 0; i < n; i++) {
+            add_subscription(t, connect_subscriber(FIRST_FD + i), MULTICAST_FLAG, 0, 0);
+        }
+        fanout_publish();
+        make_packet(&ctx.packet, "mcast", 42);
+        send_messages(ctx.packet, source);  // counts the subscribers able to receive the topic by multicast
+        send_messages(ctx.packet, source);  // moves it to the group, telling them
+
+        bench_run(&publish, n, &ctx, ops);
+
+        reset_server();
+    }
+    multicast_close();
+}
+
+
+/*
+ * Store-and-forward with a growing number of messages stored for a disconnected subscriber: storing
+ * one more message, and sending all of them at reconnection.
+ */
+typedef struct {
+    long stored;
+    subscriber *sub;
+    udp_packet packet;
+} sf_ctx;
+
+static void store_messages(sf_ctx *ctx, long count) {
+    for (long i = 0; i < count; i++) {
+        stored_message *m = (stored_message *)calloc(1, sizeof(stored_message));
+        DIE(m == NULL, "bad alloc");
+        m->hdr.topic_len = 2;
+        m->hdr.data_len = 5;
+        m->priority = DEFAULT_PRIORITY;
+        memcpy(m->topic, "sf", 2);
+        push_in_list(&ctx->sub->stored_messages, m);
+    }
+}
+
+static void run_store(void *p, long ops) {
+    sf_ctx *ctx = (sf_ctx *)p;
+    for (long i = 0; i < ops; i++) {
+        send_messages(ctx->packet, source);
+    }
+}
+
+static void drop_stored(void *p, long ops) {
+    sf_ctx *ctx = (sf_ctx *)p;
+    free_list(&ctx->sub->stored_messages, free);
+    store_messages(ctx, ctx->stored);
+}
+
+static void setup_reconnect(void *p, long ops) {
+    sf_ctx *ctx = (sf_ctx *)p;
+    free_list(&ctx->sub->stored_messages, free);
+    store_messages(ctx, ops);
+
+    ctx->sub->socket = FIRST_FD;
+    ctx->sub->connected = 1;
+    open_connection(FIRST_FD)->sub = ctx->sub;
+    fanout_refresh(ctx->sub);
+    fanout_publish();
+}
+
+static void run_reconnect(void *p, long ops) {
+    get_stored_messages(((sf_ctx *)p)->sub);
+}
+
+static void teardown_reconnect(void *p, long ops) {
+    sf_ctx *ctx = (sf_ctx *)p;
+    close_connection(FIRST_FD);
+    ctx->sub->socket = -1;
+    ctx->sub->connected = 0;
+    fanout_refresh(ctx->sub);
+    fanout_publish();
+}
+
+static void bench_store_forward(void) {
+    bench_case store = { "sf/store", NULL, run_store, drop_stored };
+    bench_case reconnect = { "sf/get_stored_messages", setup_reconnect, run_reconnect, teardown_reconnect };
+
+    if (!bench_group("sf/")) {
+        return;
+    }
+
+    for (long n = 10; n <= 100000 && n <= bench_max_scale; n *= 10) {
+        sf_ctx ctx = { .stored = n, .sub = connect_subscriber(FIRST_FD) };
+        add_subscription(add_topic("sf"), ctx.sub, SF_MASK, 0, 0);
+        make_packet(&ctx.packet, "sf", 42);
+        teardown_reconnect(&ctx, 0);
+        store_messages(&ctx, n);
+
+        bench_run(&store, n, &ctx, 100);
+        bench_run(&reconnect, n, &ctx, n);
+
+        reset_server();
+    }
+}
+
+
+/*
+ * Shard mode with a growing number of workers: the supervisor writing a datagram to the ring of every
+ * worker, and a worker publishing it to its share of SHARD_SUBSCRIBERS subscribers of the topic. With a
+ * core for each worker and one for the supervisor, the datagrams per second are bounded by the slower
+ * of the two: the supervisor's cost grows with the workers while a worker's shrinks.
+ */
+typedef struct {
+    long workers;
+    shm_ring *rings;
+    udp_packet packet;
+    int len;  // bytes of the datagram
+} shard_ctx;
+
+static void run_shard_feed(void *p, long ops) {
+    shard_ctx *ctx = (shard_ctx *)p;
+    shard_frame frame = { source, ctx->len };
+    struct iovec iov[2] = { { &frame, sizeof(frame) }, { &ctx->packet, ctx->len } };
+
+    for (long i = 0; i < ops; i++) {  // as feed() in shard.c
+        for (long j = 0; j < ctx->workers; j++) {
+            shm_ring *r = &ctx->rings[j];
+            uint64_t used = shm_ring_used(r);
+            if (used != UINT64_MAX && r->size - used >= sizeof(frame) + ctx->len) {
+                shm_ring_writev(r, iov, 2);
+            }
+        }
+    }
+}
+
+/*
+ * Function consuming the datagrams written to the rings, as the workers would.
+ */
+static void drain_rings(void *p, long ops) {
+    shard_ctx *ctx = (shard_ctx *)p;
+    for (long j = 0; j < ctx->workers; j++) {
+        shm_ring_release(&ctx->rings[j], ctx->rings[j].written);
+    }
+}
+
+static void bench_shards(void) {
+    bench_case feed = { "shard/feed", drain_rings, run_shard_feed, NULL };
+    bench_case publish = { "shard/send_messages", NULL, run_fanout, NULL };
+
+    if (!bench_group("shard/")) {
+        return;
+    }
+
+    for (long n = 1; n <= MAX_WORKERS && n <= bench_max_scale; n *= 2) {
+        long subs = SHARD_SUBSCRIBERS / n;
+        shard_ctx ctx = { .workers = n, .rings = (shm_ring *)calloc(n, sizeof(shm_ring)) };
+        DIE(ctx.rings == NULL, "bad alloc");
+        for (long j = 0; j < n; j++) {
+            DIE(shm_ring_create(&ctx.rings[j], SHARD_RING) < 0, "shm_ring_create");
+        }
+        make_packet(&ctx.packet, "shard", 42);
+        ctx.len = offsetof(udp_packet, payload) + 5;  // an INT datagram
+
+        bench_run(&feed, n, &ctx, 1000);
+
+        for (long j = 0; j < n; j++) {
+            shm_ring_close(&ctx.rings[j]);
+        }
+        free(ctx.rings);
+
+        // a worker holds the subscribers of its shard only
+        fanout_ctx worker = { .subs = subs };
+        topic *t = add_topic("shard");
+        for (long i = 0; i < subs; i++) {
+            add_subscription(t, connect_subscriber(FIRST_FD + i), 0, 0, 0);
+        }
+        fanout_publish();
+        make_packet(&worker.packet, "shard", 42);
+
+        bench_run(&publish, n, &worker, 100);
+
+        reset_server();
+    }
+}
+
+
+int main(int argc, char *argv[]) {
+    bench_init(argc, argv);
+
+    init_database();
+    ratelimit_init(MAX_SOURCES);
+    set_overload_watermarks(SOFT_WATERMARK, HARD_WATERMARK);
+    source.sin_family = AF_INET;
+    source.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    source.sin_port = htons(4242);
+
+    bench_lists();
+    bench_topics();
+    bench_fanout();
+    bench_multicast();
+    bench_store_forward();
+    bench_shards();
+
+    free_connections();
+    free_database();
+    bench_close();
+
+    return 0;
+}
@@ -0,0 +1,213 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio_ext.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "common.h"
+
+// the server's thread appends the records to a ring, the writer thread moves them to the file; a record
+// never wraps around the end of the ring (the space left is skipped, marked with a filler record if
+// there is room for its header), and the server's thread drops datagrams rather than wait for space
+static char *ring;
+static _Alignas(64) _Atomic uint64_t head;  // bytes appended by the server's thread
+static _Alignas(64) _Atomic uint64_t tail;  // bytes consumed by the writer thread
+static _Atomic int stopping;
+static _Atomic uint64_t recorded;  // records written to the file
+static uint64_t dropped;  // datagrams not captured for lack of room in the ring
+
+static FILE *file, *index_file;
+static pthread_t writer;
+
+
+/*
+ * Function appending a record to the capture file, and an index entry every CAPTURE_INDEX_EVERY records.
+ */
+static void write_record(capture_record *rec, const char *data) {
+    static uint64_t offset = sizeof(capture_header), count;
+
+    if (count++ % CAPTURE_INDEX_EVERY == 0) {
+        capture_index entry = { rec->ns, offset };
+        if (fwrite(&entry, sizeof(entry), 1, index_file) != 1) {
+            perror("capture index write failed");
+        }
+    }
+
+    if (fwrite(rec, sizeof(*rec), 1, file) != 1 || fwrite(data, rec->len, 1, file) != 1) {
+        perror("capture write failed");
+    }
+    offset += sizeof(*rec) + rec->len;
+    atomic_fetch_add_explicit(&recorded, 1, memory_order_relaxed);
+}
+
+/*
+ * Function run by the writer thread: moving the records from the ring to the file until the capture is
+ * closed, flushing the file whenever the ring is empty.
+ */
+static void *run_writer(void *arg) {
+    struct timespec pause = { 0, 1000000 };  // wait for new records 1ms at a time, no wakeups needed
+
+    while (1) {
+        uint64_t t = atomic_load_explicit(&tail, memory_order_relaxed);
+        uint64_t h = atomic_load_explicit(&head, memory_order_acquire);
+        if (t == h) {
+            fflush(file);
+            fflush(index_file);
+            if (atomic_load_explicit(&stopping, memory_order_acquire) &&
+                atomic_load_explicit(&head, memory_order_acquire) == t) {
+                break;
+            }
+            nanosleep(&pause, NULL);
+            continue;
+        }
+
+        while (t < h) {
+            size_t pos = t % CAPTURE_RING, room = CAPTURE_RING - pos;
+            capture_record rec;
+            if (room < sizeof(rec)) {
+                t += room;
+                continue;
+            }
+            memcpy(&rec, ring + pos, sizeof(rec));
+            if (rec.len == CAPTURE_PAD) {
+                t += room;
+                continue;
+            }
+
+            write_record(&rec, ring + pos + sizeof(rec));
+            t += sizeof(rec) + rec.len;
+        }
+        atomic_store_explicit(&tail, t, memory_order_release);
+    }
+
+    return NULL;
+}
+
+/*
+ * Function starting the capture of the received datagrams to a file (and its index, "<path>.idx"),
+ * replacing any previous capture; returns 0 on failure.
+ */
+int capture_open(char *path) {
+    char index_path[4096];
+    if (snprintf(index_path, sizeof(index_path), "%s.idx", path) >= (int)sizeof(index_path)) {
+        return 0;
+    }
+
+    file = fopen(path, "w");
+    index_file = fopen(index_path, "w");
+    if (!file || !index_file) {
+        perror("cannot open capture");
+        return 0;
+    }
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+
+    capture_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+    hdr.index_every = CAPTURE_INDEX_EVERY;
+    if (fwrite(&hdr, sizeof(hdr), 1, file) != 1) {
+        perror("capture write failed");
+        return 0;
+    }
+
+    ring = (char *)malloc(CAPTURE_RING);
+    DIE(ring == NULL, "bad alloc");
+
+    int rc = pthread_create(&writer, NULL, run_writer, NULL);
+    DIE(rc != 0, "pthread_create");
+
+    return 1;
+}
+
+/*
+ * Function checking whether the received datagrams are captured.
+ */
+int capture_enabled(void) {
+    return ring != NULL;
+}
+
+/*
+ * Function capturing a received datagram of "len" bytes: the record is copied to the ring, or dropped if
+ * the writer thread is behind; nothing here blocks.
+ */
+void capture_datagram(struct sockaddr_in *source, void *data, int len) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    if (len < 0 || len >= CAPTURE_PAD) {
+        return;
+    }
+    capture_record rec = { (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec, source->sin_addr.s_addr,
+                           source->sin_port, len };
+
+    size_t need = sizeof(rec) + len;
+    uint64_t h = atomic_load_explicit(&head, memory_order_relaxed);
+    uint64_t t = atomic_load_explicit(&tail, memory_order_acquire);
+    size_t pos = h % CAPTURE_RING, room = CAPTURE_RING - pos;
+    size_t skip = room < need ? room : 0;  // the record goes at the beginning of the ring
+    if (CAPTURE_RING - (h - t) < skip + need) {
+        dropped++;
+        return;
+    }
+
+    if (skip) {
+        if (skip >= sizeof(rec)) {
+            capture_record pad = { 0, 0, 0, CAPTURE_PAD };
+            memcpy(ring + pos, &pad, sizeof(pad));
+        }
+        pos = 0;
+    }
+    memcpy(ring + pos, &rec, sizeof(rec));
+    memcpy(ring + pos + sizeof(rec), data, len);
+
+    atomic_store_explicit(&head, h + skip + need, memory_order_release);
+}
+
+/*
+ * Function printing the capture counters.
+ */
+void capture_stats(FILE *f) {
+    if (capture_enabled()) {
+        fprintf(f, "Capture: %lu datagrams recorded, %lu dropped.\n",
+                atomic_load_explicit(&recorded, memory_order_relaxed), dropped);
+    }
+}
+
+/*
+ * Function stopping the capture, once the writer thread wrote all the records captured.
+ */
+void capture_close(void) {
+    if (!capture_enabled()) {
+        return;
+    }
+
+    atomic_store_explicit(&stopping, 1, memory_order_release);
+    pthread_join(writer, NULL);
+
+    fclose(file);
+    fclose(index_file);
+    free(ring);
+    ring = NULL;
+}
+
+/*
+ * Function dropping the capture a forked process inherited, without the writer thread: the child
+ * captures nothing, and the records its parent had not written yet are left to the parent.
+ */
+void capture_abandon(void) {
+    if (!capture_enabled()) {
+        return;
+    }
+
+    // the buffered records are discarded, not written twice
+    __fpurge(file);
+    __fpurge(index_file);
+    fclose(file);
+    fclose(index_file);
+    free(ring);
+    ring = NULL;
+}
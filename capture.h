@@ -0,0 +1,46 @@
+#ifndef _CAPTURE_H
+#define _CAPTURE_H 1
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define CAPTURE_MAGIC "UDPCAP1"  // first bytes of a capture file (with the terminator)
+#define CAPTURE_RING (8 << 20)  // bytes of datagrams waiting for the writer thread
+#define CAPTURE_INDEX_EVERY 1024  // records between two index entries
+#define CAPTURE_PAD UINT16_MAX  // length of the filler record ending the ring before it wraps
+
+/*
+ * Capture of the datagrams received by the server, for replaying them later (see replay.c). A capture
+ * file starts with a capture_header, followed by the records: a capture_record and the "len" bytes of the
+ * datagram. Every CAPTURE_INDEX_EVERY records, an index entry (time and offset of the record) is appended
+ * to "<capture file>.idx", so that a replay can start anywhere without reading the records before. All
+ * fields are in host byte order, except for the source address and port (network order, as received).
+ */
+#pragma pack(1)
+typedef struct {
+    char magic[8];
+    uint32_t index_every;  // records between two index entries
+} capture_header;
+
+typedef struct {
+    uint64_t ns;  // moment the datagram was received (CLOCK_REALTIME, ns)
+    uint32_t addr;  // source address and port
+    uint16_t port;
+    uint16_t len;  // bytes of datagram following
+} capture_record;
+
+typedef struct {
+    uint64_t ns;  // moment of the indexed record
+    uint64_t offset;  // offset of the record in the capture file
+} capture_index;
+#pragma pack()
+
+int capture_open(char *);
+int capture_enabled(void);
+void capture_datagram(struct sockaddr_in *, void *, int);
+void capture_stats(FILE *);
+void capture_close(void);
+void capture_abandon(void);
+
+#endif
@@ -7,10 +7,21 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "common.h"
 
+/*
+ * Function returning the current value of the monotonic clock, in nanoseconds.
+ */
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
 /*
  * Function used to receive a specified amount of bytes (corresponding to a known message structure)
  * from a TCP connection, at a given memory location; returns number of received bytes.
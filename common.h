@@ -1,6 +1,7 @@
 #ifndef _COMMON_H
 #define _COMMON_H 1
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -23,38 +24,99 @@
   } while (0)
 
 
-#pragma pack(1)
+/*
+ * In-memory structures of the server: naturally aligned, with the fields read for every message delivered
+ * (hot) ahead of those only read at login, subscription or in the logs (cold), so that delivering a
+ * message touches a single cache line of each. The structures exchanged with the clients are the packed
+ * wire structures further below, converted by the functions of wire.h.
+ */
 
 /*
  * Structure representing a subscriber entity within the server's system.
  */
 typedef struct {
-  char id[11], ip[16];
-  uint16_t port;
+  // hot
   int socket, connected;  // server socket the user connected to
                           // connected = 1 - user is active, 0 - user disconnected
+  uint32_t session;  // number of logins of the user
   list stored_messages;  // messages from topics the user is subscribed to with store-and-forward
                          // enabled, received while they were disconnected
+  list stored_tail;  // last cell of stored_messages, messages are appended in constant time
+  struct subscription **subscriptions;  // subscriptions of the user, moved between the fan-out tables of
+  uint32_t sub_count, sub_size;         // their topics when it connects or disconnects
+  // cold
+  char id[11], ip[16];
+  uint16_t port;
 } subscriber;
 
 
 /*
  * Structure pairing a subscriber to a topic and its store-and-forward option.
  */
-typedef struct {
-  uint8_t sf;
+typedef struct subscription {
+  // hot
   subscriber *sub;
+  struct sampler *sampler;  // throttling state, allocated for an interval
+  uint32_t mcast_session;  // session of the subscriber in which it was told the topic is multicast
+  uint8_t sf;  // store-and-forward (SF_MASK) and multicast (MULTICAST_FLAG) options
+  uint8_t priority;  // priority class requested at subscribe time + 1, 0 - use the topic's class
+  uint8_t table;  // fan-out table of the topic holding the subscription (FANOUT_*)
+  // cold
+  uint32_t slot;  // position in that table
+  uint32_t index;  // position in the subscriber's subscriptions
+  uint32_t interval;  // minimum ms between two messages sent, 0 - all of them
+  struct topic *topic;
 } subscription;
 
 /*
  * Structure keeping titles and subscription lists for a topic. 
  */
-typedef struct {
+typedef struct topic {
+  // hot
+  struct fanout *fanout;  // subscribers the messages go to, allocated with the first subscription
+  struct mcast_topic *mcast;  // multicast state, allocated when the topic is first multicast
+  struct rate_bucket *quota;  // publish quota state, allocated when topic quotas are enabled
+  struct history *history;  // last messages published, allocated with the first one when history is enabled
+  struct aggregate *aggregates;  // windows of the topics derived from this one
+  uint32_t mcast_count;  // connected subscribers able to receive the topic by multicast, at the last message
+  uint8_t priority;  // priority class of the messages on the topic, 0 - highest
   char title[51];
+  // cold
   list subs;
+  struct aggregate *aggregate;  // window the messages are computed over, for a derived topic ("<base>@...")
 } topic;
 
 
+/*
+ * Meta information about a message published to the TCP clients (sent as a content_header).
+ */
+typedef struct {
+  int data_len;  // length of message content
+  int topic_len;  // length of topic title
+  uint16_t port;  // ip and port of UDP client sending the message
+  uint8_t data_type;  // type of message received, or of control frame (CONTROL_FLAG set)
+  char ip[16];
+} message_info;
+
+
+/*
+ * Structure representing the meta data and content of a message stored for a disconnected TCP client
+ * with store-and-forward enabled for a specific topic.
+ */
+typedef struct {
+  message_info hdr;
+  uint8_t priority;  // priority class of the subscription the message was stored for
+  char topic[50];
+  char payload[1500];
+} stored_message;
+
+
+/*
+ * Wire structures, exchanged with the clients: packed, multi-byte fields in little-endian order (see
+ * wire.h), except for the content of the UDP messages, in network order.
+ */
+#pragma pack(push, 1)
+
 /*
  * The given structure of a message received from the UDP clients.
  */
@@ -66,10 +128,34 @@ typedef struct {
 
 
 /*
- * Message structure for initial login of a TCP client.
+ * Header of a batch of messages sent by a TCP publisher, followed by "count" records taking "len" bytes.
+ */
+typedef struct {
+  uint32_t len;
+  uint16_t count;
+} publish_batch;
+
+#define MAX_BATCH_LEN (1 << 20)  // largest batch accepted from a publisher
+
+/*
+ * Header of a record of a publisher's batch, followed by "topic_len" bytes of topic title and "data_len"
+ * bytes of payload (encoded as in a udp_packet).
+ */
+typedef struct {
+  uint8_t topic_len;  // 0 - same topic as the previous record of the batch
+  uint8_t data_type;
+  uint16_t data_len;
+} publish_record;
+
+
+/*
+ * Message structure for initial login of a TCP client; a client applying a subscription profile stored
+ * on the server sends the rest of the structure too, otherwise only the id.
  */
 typedef struct {
   char id[11];
+  uint8_t sf;  // options added to the profile's subscriptions (MULTICAST_FLAG)
+  char profile[51];  // name of the profile
 } connect_packet;
 
 
@@ -77,10 +163,21 @@ typedef struct {
  * Message structure for a subscription request from a TCP client.
  */
 typedef struct {
-  uint8_t sf;
+  uint8_t sf;  // bit 0 - store-and-forward option, bit 1 - the client can receive the topic by multicast,
+               // bits 4-5 - requested priority class + 1 (0 - topic's class)
   char topic[51];
+  uint32_t interval;  // minimum ms between two messages of the topic, the latest one being sent (sampled);
+                      // optional, requests of older clients end with the topic (0 - all messages)
 } subscribe_packet;
 
+#define SF_MASK 0x01
+#define MULTICAST_FLAG 0x02
+#define PRIORITY_SHIFT 4
+#define PRIORITY_MASK 0x03
+
+#define NUM_PRIORITIES 3  // priority classes: 0 - highest (e.g. alarms), NUM_PRIORITIES - 1 - lowest (bulk)
+#define DEFAULT_PRIORITY 1  // class of topics not configured otherwise
+
 
 /*
  * Message structure for a unsubscribe-type request from a TCP client.
@@ -90,12 +187,52 @@ typedef struct {
 } unsubscribe_packet;
 
 
+/*
+ * Message structure for a request for the last messages of a topic kept by the server: the last "value"
+ * messages (HISTORY_LAST), or those from sequence number "value" on (HISTORY_SINCE). The server answers
+ * with a CONTROL_HISTORY frame, followed by the messages.
+ */
+typedef struct {
+  char topic[51];
+  uint8_t mode;
+  uint32_t value;
+} history_packet;
+
+#define HISTORY_LAST 0
+#define HISTORY_SINCE 1
+
+
+/*
+ * Bulk subscribe and unsubscribe requests carry a list of entries (at most MAX_BULK_LEN bytes), each a
+ * bulk_entry followed by "topic_len" bytes of topic title (not terminated); the sf byte is encoded as in
+ * subscribe_packet, and ignored when unsubscribing. The server answers with a single CONTROL_ACK frame.
+ */
+typedef struct {
+  uint8_t sf;
+  uint8_t topic_len;
+} bulk_entry;
+
+#define MAX_BULK_LEN (1 << 20)
+
+
+/*
+ * Message structure for a request to repair the messages of a multicast topic with sequence numbers from
+ * "first" to "last", which the client did not receive.
+ */
+typedef struct {
+  char topic[51];
+  uint32_t first, last;
+} nack_packet;
+
+
 /*
  * Structure of meta information about incoming data coming from the TCP clients.
  */ 
 typedef struct {
-  uint8_t type;  // 0 - subscriber connected, 1 - subscribe, 2 - unsubscribe
-  int len;  // number of bytes in the actual message, meaning the number of relevant bytes stored in the
+  uint8_t type;  // 0 - subscriber connected, 1 - subscribe, 2 - unsubscribe, 3 - multicast repair (nack),
+                 // 4 - heartbeat (answer to a heartbeat frame, no content), 5 - bulk subscribe,
+                 // 6 - bulk unsubscribe, 7 - history
+  int32_t len;  // number of bytes in the actual message, meaning the number of relevant bytes stored in the
             // above described structures
 } request_header;
 
@@ -104,28 +241,59 @@ typedef struct {
  * Structure containing meta information about incoming messages sent from the server to TCP clients.
  */
 typedef struct {
-  int data_len;  // length of message content
-  int topic_len;  // length of topic title
+  int32_t data_len;  // length of message content
+  int32_t topic_len;  // length of topic title
   char ip[16];  // ip and port of UDP client sending the message
   uint16_t port;
-  uint8_t data_type;  // type of message received
+  uint8_t data_type;  // type of message received, or of control frame (CONTROL_FLAG set)
 } content_header;
 
 
 /*
- * Structure representing the meta data and content of a message stored for a disconnected TCP client
- * with store-and-forward enabled for a specific topic.
+ * Control frames sent by the server to TCP clients, with the same header as messages: the topic they
+ * concern, followed by a body of "data_len" bytes.
  */
+#define CONTROL_FLAG 0x80
+
+enum {
+  CONTROL_MULTICAST = CONTROL_FLAG,  // topic now published to a multicast group (body: multicast_announce)
+  CONTROL_UNICAST,  // topic back to unicast (body: uint32_t sequence number of the last multicast message)
+  CONTROL_REPAIR,  // repaired multicast message (body: uint32_t sequence number, then the message frame)
+                   // or lost messages (body: uint32_t first and last lost sequence numbers)
+  CONTROL_HEARTBEAT,  // sent to the group of a quiet topic, under the sequence number of its last message
+                      // (no body), so that the loss of the last messages is noticed; also sent over the
+                      // connection (no topic, no body) every heartbeat interval, answered by a heartbeat
+                      // request
+  CONTROL_ACK,  // answer to a bulk request or to a login applying a profile (topic: the profile's name,
+                // body: bulk_ack)
+  CONTROL_HISTORY,  // answer to a history request (body: history_reply), followed by the messages
+};
+
 typedef struct {
-  content_header hdr;
-  char topic[50];
-  char payload[1500];
-} stored_message;
+  uint8_t type;  // type of the request answered
+  uint32_t count;  // number of subscriptions made or removed
+} bulk_ack;
+
+typedef struct {
+  uint32_t first;  // sequence number of the first message following the frame
+  uint32_t count;  // number of messages following the frame, numbered from "first" on
+  uint32_t next;  // sequence number the topic's next message gets, 0 - no history kept for the topic
+} history_reply;
+
+typedef struct {
+  char group[16];  // multicast group and port the topic's messages are sent to
+  uint16_t port;
+  uint32_t seq;  // sequence number of the first message the client receives by multicast
+} multicast_announce;
+
+// multicast datagrams hold a sequence number (network order, counted per topic), then the message frame
+// (or a heartbeat control frame)
 
 
-#pragma pack(1)
+#pragma pack(pop)
 
 int recv_all(int, void *, size_t);
 int send_all(int, void *, size_t);
+uint64_t now_ns(void);
 
 #endif
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "connection.h"
+
+static connection **connections;  // open connections, indexed by socket
+static int capacity;
+
+
+/*
+ * Function growing the connection table to fit a given descriptor.
+ */
+static void reserve_slot(int fd) {
+    if (fd >= capacity) {
+        int new_capacity = capacity ? capacity : 64;
+        while (new_capacity <= fd) {
+            new_capacity <<= 1;
+        }
+
+        connections = (connection **)realloc(connections, new_capacity * sizeof(connection *));
+        DIE(connections == NULL, "bad alloc");
+        memset(connections + capacity, 0, (new_capacity - capacity) * sizeof(connection *));
+        capacity = new_capacity;
+    }
+}
+
+/*
+ * Function allocating the state of a newly accepted connection.
+ */
+connection *open_connection(int sockfd) {
+    reserve_slot(sockfd);
+
+    connection *c = (connection *)calloc(1, sizeof(connection));
+    DIE(c == NULL, "bad alloc");
+    c->socket = sockfd;
+    c->sub = NULL;
+    c->ring = NULL;
+    outq_init(&c->out);
+    timer_init(&c->idle, NULL, c);  // started by the server, if enabled
+    timer_init(&c->heartbeat, NULL, c);
+    connections[sockfd] = c;
+
+    return c;
+}
+
+/*
+ * Function returning the state of the connection with a given socket, NULL if there is none.
+ */
+connection *get_connection(int sockfd) {
+    if (sockfd < 0 || sockfd >= capacity) {
+        return NULL;
+    }
+
+    return connections[sockfd];
+}
+
+/*
+ * Function creating the shared memory ring of a local subscriber's connection, with a data area of
+ * "size" bytes; messages are written to it from then on. Returns -1 on failure.
+ */
+int open_ring(connection *c, size_t size) {
+    shm_ring *r = (shm_ring *)malloc(sizeof(shm_ring));
+    DIE(r == NULL, "bad alloc");
+
+    if (shm_ring_create(r, size) < 0) {
+        free(r);
+        return -1;
+    }
+
+    reserve_slot(r->space_fd);
+    connections[r->space_fd] = c;
+    c->ring = r;
+    c->out.ring = r;
+
+    return 0;
+}
+
+/*
+ * Function deallocating the state of a closed connection, dropping any messages it still had to send.
+ */
+void close_connection(int sockfd) {
+    connection *c = get_connection(sockfd);
+    if (!c || c->socket != sockfd) {  // not a socket (the eventfd of a ring)
+        return;
+    }
+
+    outq_clear(&c->out);
+    timer_cancel(&c->idle);
+    timer_cancel(&c->heartbeat);
+    if (c->ring) {
+        connections[c->ring->space_fd] = NULL;
+        shm_ring_close(c->ring);
+        free(c->ring);
+    }
+    free(c);
+    connections[sockfd] = NULL;
+}
+
+/*
+ * Function deallocating the connection table.
+ */
+void free_connections(void) {
+    for (int i = 0; i < capacity; i++) {
+        close_connection(i);
+    }
+
+    free(connections);
+    connections = NULL;
+    capacity = 0;
+}
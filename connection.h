@@ -0,0 +1,30 @@
+#ifndef _CONNECTION_H
+#define _CONNECTION_H 1
+
+#include "common.h"
+#include "outq.h"
+#include "shmring.h"
+#include "timer.h"
+
+/*
+ * State kept by the server for each open connection, indexed by its socket; the connection of a local
+ * subscriber (over a Unix domain socket) delivers messages through a shared memory ring, and is also
+ * indexed by the eventfd signalling free space in the ring. The fields read to send a message come first,
+ * sharing a cache line.
+ */
+typedef struct connection {
+    int socket;
+    outq out;  // messages waiting to be sent through the connection
+    subscriber *sub;  // subscriber using the connection
+    shm_ring *ring;  // ring of a local subscriber, NULL for TCP connections
+    timer idle;  // closes the connection once nothing was received on it for a while
+    timer heartbeat;  // next heartbeat sent to the subscriber
+} connection;
+
+connection *open_connection(int);
+connection *get_connection(int);
+int open_ring(connection *, size_t);
+void close_connection(int);
+void free_connections(void);
+
+#endif
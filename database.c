@@ -0,0 +1,353 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aggregate.h"
+#include "database.h"
+#include "fanout.h"
+#include "history.h"
+#include "multicast.h"
+#include "outq.h"
+#include "rcu.h"
+#include "sampler.h"
+
+list subscribers;
+list topics;
+hashmap subscriber_index;
+hashmap topic_index;
+
+static hashmap topic_priorities;  // priority classes (+ 1) configured for topics, by title
+static hashmap profiles;  // subscription profiles, by name
+
+
+/*
+ * Function initialising the (empty) subscriber and topic lists and their indexes.
+ */
+void init_database(void) {
+    subscribers = NULL;
+    topics = NULL;
+    hashmap_init(&subscriber_index, 0);
+    hashmap_init(&topic_index, 0);
+    hashmap_init(&topic_priorities, 0);
+    hashmap_init(&profiles, 0);
+}
+
+/*
+ * Function returning a pointer to the registered subscriber with the given id, NULL if not found.
+ */
+subscriber *find_subscriber(char *id) {
+    return (subscriber *)hashmap_get(&subscriber_index, id);
+}
+
+/*
+ * Function setting the id of a subscriber structure and adding it to the subscriber index.
+ */
+void index_subscriber(subscriber *s, char *id) {
+    memcpy(s->id, id, strlen(id) + 1);
+    hashmap_put(&subscriber_index, s->id, s);
+}
+
+/*
+ * Function allocating and registering a subscriber known only by its id (not connected to any socket),
+ * used when restoring the server's state.
+ */
+subscriber *add_offline_subscriber(char *id) {
+    subscriber *s = (subscriber *)calloc(1, sizeof(subscriber));
+    DIE(s == NULL, "bad alloc");
+    s->socket = -1;
+    s->connected = 0;
+    s->stored_messages = NULL;
+    index_subscriber(s, id);
+    push_in_list(&subscribers, s);
+
+    return s;
+}
+
+/*
+ * Function returning a pointer to the topic with the given title, NULL if not found.
+ */
+topic *find_topic(char *title) {
+    return (topic *)hashmap_get(&topic_index, title);
+}
+
+/*
+ * Function allocating and registering a new topic with a given title and no subscriptions.
+ */
+topic *add_topic(char *title) {
+    topic *new_topic = (topic *)calloc(1, sizeof(topic));
+    DIE(new_topic == NULL, "bad alloc");
+    memcpy(new_topic->title, title, strlen(title) + 1);
+    new_topic->subs = NULL;
+
+    uintptr_t priority = (uintptr_t)hashmap_get(&topic_priorities, title);
+    new_topic->priority = priority ? priority - 1 : DEFAULT_PRIORITY;
+
+    push_in_list(&topics, new_topic);
+    hashmap_put(&topic_index, new_topic->title, new_topic);
+    aggregate_attach(new_topic);  // a derived topic also adds its base topic
+
+    return new_topic;
+}
+
+/*
+ * Function setting the priority class of the messages published on a topic (configured at startup).
+ */
+void set_topic_priority(char *title, int priority) {
+    char *key = strdup(title);
+    DIE(key == NULL, "bad alloc");
+    hashmap_put(&topic_priorities, key, (void *)(uintptr_t)(priority + 1));
+
+    topic *t = find_topic(title);
+    if (t) {
+        t->priority = priority;
+        for (list p = t->subs; p != NULL; p = p->next) {
+            fanout_update((subscription *)p->info);
+        }
+    }
+}
+
+/*
+ * Function returning the subscription profile with the given name, NULL if not found.
+ */
+profile *find_profile(char *name) {
+    return (profile *)hashmap_get(&profiles, name);
+}
+
+/*
+ * Function adding a subscription (title, sf byte and interval, as in subscribe_packet) to a profile,
+ * creating the profile if needed.
+ */
+void add_profile_entry(char *name, char *title, uint8_t sf, uint32_t interval) {
+    profile *p = find_profile(name);
+    if (!p) {
+        p = (profile *)calloc(1, sizeof(profile));
+        DIE(p == NULL, "bad alloc");
+        memcpy(p->name, name, strlen(name) + 1);
+        hashmap_put(&profiles, p->name, p);
+    }
+
+    if (p->count == p->size) {
+        p->size = p->size ? 2 * p->size : 16;
+        p->entries = (profile_entry *)realloc(p->entries, p->size * sizeof(profile_entry));
+        DIE(p->entries == NULL, "bad alloc");
+    }
+    p->entries[p->count].sf = sf;
+    p->entries[p->count].interval = interval;
+    memcpy(p->entries[p->count].topic, title, strlen(title) + 1);
+    p->count++;
+}
+
+/*
+ * Function loading subscription profiles from a file with one subscription per line:
+ * <profile> <topic> <sf> [<priority class> [<min interval (ms)>]] (empty lines and lines starting with '#' are skipped).
+ * Returns 0 if the file cannot be read or holds an invalid line.
+ */
+int load_profiles(char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror("cannot open profiles");
+        return 0;
+    }
+
+    char line[256], name[51], title[51];
+    int sf, priority, interval, line_no = 0;
+    while (fgets(line, sizeof(line), f)) {
+        line_no++;
+        char *start = line + strspn(line, " \t");
+        if (*start == '#' || *start == '\n' || *start == '\0') {
+            continue;
+        }
+
+        priority = -1;
+        interval = 0;
+        int n = sscanf(start, "%50s %50s %d %d %d", name, title, &sf, &priority, &interval);
+        if (n < 3 || (sf != 0 && sf != 1) || (n >= 4 && (priority < -1 || priority >= NUM_PRIORITIES)) ||
+            interval < 0) {
+            fprintf(stderr, "Invalid profile entry at line %d of %s.\n", line_no, path);
+            fclose(f);
+            return 0;
+        }
+        add_profile_entry(name, title, sf | (priority + 1) << PRIORITY_SHIFT, interval);
+    }
+
+    fclose(f);
+    return 1;
+}
+
+/*
+ * Function returning the subscription of a subscriber to a topic, NULL if there is none; only the
+ * subscriber's own subscriptions are looked through, not the topic's (which may be many more).
+ */
+subscription *find_subscription(subscriber *s, topic *t) {
+    for (uint32_t i = 0; i < s->sub_count; i++) {
+        if (s->subscriptions[i]->topic == t) {
+            return s->subscriptions[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Function adding a new subscription of a subscriber to a topic, with its store-and-forward option,
+ * requested priority class (+ 1, 0 - topic's class) and minimum interval between messages (ms, 0 - none);
+ * the caller makes sure the subscriber is not already subscribed.
+ */
+subscription *add_subscription(topic *t, subscriber *s, uint8_t sf, uint8_t priority, uint32_t interval) {
+    subscription *new = (subscription *)calloc(1, sizeof(subscription));
+    DIE(new == NULL, "bad alloc");
+    new->sub = s;
+    new->sf = sf;
+    new->priority = priority;
+    new->topic = t;
+    sampler_set(new, interval);
+    push_in_list(&t->subs, new);
+    fanout_attach(new);
+
+    return new;
+}
+
+/*
+ * Function changing the store-and-forward option, requested priority class and minimum interval between
+ * messages of a subscription.
+ */
+void update_subscription(subscription *sub, uint8_t sf, uint8_t priority, uint32_t interval) {
+    sub->sf = sf;
+    sub->priority = priority;
+    sampler_set(sub, interval);
+    fanout_update(sub);
+}
+
+/*
+ * Function deallocating a subscription.
+ */
+static void free_subscription(void *p) {
+    sampler_free((subscription *)p);
+    free(p);
+}
+
+/*
+ * Function comparing two subscriptions by identity.
+ */
+static int same_subscription(void *a, void *b) {
+    return a == b;
+}
+
+/*
+ * Function removing a subscription from its topic and deallocating it (once no longer read).
+ */
+void remove_subscription(subscription *sub) {
+    fanout_detach(sub);
+    sampler_free(sub);
+    unlink_from_list(&sub->topic->subs, sub, same_subscription);
+    rcu_retire(sub, free);  // the fan-out table last published may still point to it
+}
+
+/*
+ * Function removing all the subscriptions of a subscriber (one that is about to be deallocated).
+ */
+void remove_subscriptions(subscriber *s) {
+    while (s->sub_count) {
+        remove_subscription(s->subscriptions[s->sub_count - 1]);
+    }
+}
+
+/*
+ * Function returning the priority class in which the messages of a topic are sent to a subscriber.
+ */
+int subscription_priority(topic *t, subscription *sub) {
+    return sub->priority ? sub->priority - 1 : t->priority;
+}
+
+/*
+ * Function appending a message to those stored for a disconnected subscriber, in constant time.
+ */
+void store_message(subscriber *s, stored_message *m) {
+    list new = (list)calloc(1, sizeof(struct cell));
+    DIE(new == NULL, "bad alloc");
+    new->info = m;
+    new->next = NULL;
+
+    if (s->stored_tail) {
+        s->stored_tail->next = new;
+    } else {
+        s->stored_messages = new;
+    }
+    s->stored_tail = new;
+}
+
+/*
+ * Function deallocating the messages stored for a subscriber.
+ */
+void free_stored_messages(subscriber *s) {
+    free_list(&s->stored_messages, free);
+    s->stored_tail = NULL;
+}
+
+/*
+ * Function for deallocating a subscriber structure.
+ */
+static void free_subscriber(void *p) {
+    subscriber *s = (subscriber *)p;
+    free_list(&s->stored_messages, free);
+    free(s->subscriptions);
+    free(s);
+}
+
+/*
+ * Function comparing two subscribers by identity.
+ */
+static int same_subscriber(void *a, void *b) {
+    return a == b;
+}
+
+/*
+ * Function removing a subscriber which did not log in (the structure of a connection whose client turned
+ * out to be registered already, or was refused), with the subscriptions it made, and deallocating it
+ * (once no longer read).
+ */
+void remove_shell(subscriber *s) {
+    remove_subscriptions(s);
+    unlink_from_list(&subscribers, s, same_subscriber);
+    rcu_retire(s, free_subscriber);
+}
+
+/*
+ * Function for deallocating a topic structure
+ */
+static void free_topic(void *p) {
+    topic *t = (topic *)p;
+    free_list(&t->subs, free_subscription);
+    fanout_free(t);
+    free(t->quota);
+    multicast_free(t);
+    history_free(t);
+    free(t);
+}
+
+/*
+ * Function deallocating the subscriber and topic lists and their indexes.
+ */
+void free_database(void) {
+    for (size_t i = 0; i < topic_priorities.capacity; i++) {
+        if (topic_priorities.slots[i].value) {
+            free((char *)topic_priorities.slots[i].key);
+        }
+    }
+    hashmap_free(&topic_priorities);
+    for (size_t i = 0; i < profiles.capacity; i++) {
+        profile *p = (profile *)profiles.slots[i].value;
+        if (p) {
+            free(p->entries);
+            free(p);
+        }
+    }
+    hashmap_free(&profiles);
+    hashmap_free(&subscriber_index);
+    hashmap_free(&topic_index);
+    free_list(&subscribers, free_subscriber);
+    for (list p = topics; p != NULL; p = p->next) {  // while all the base topics are still there
+        aggregate_free((topic *)p->info);
+    }
+    free_list(&topics, free_topic);
+}
@@ -0,0 +1,58 @@
+#ifndef _DATABASE_H
+#define _DATABASE_H 1
+
+#include "common.h"
+#include "hashmap.h"
+#include "list.h"
+
+/*
+ * Subscription of a profile: title, sf byte and interval, as in subscribe_packet.
+ */
+typedef struct {
+    uint32_t interval;
+    uint8_t sf;
+    char topic[51];
+} profile_entry;
+
+/*
+ * Named list of subscriptions stored on the server (configured at startup), which a client applies by
+ * sending its name at login.
+ */
+typedef struct {
+    char name[51];
+    profile_entry *entries;
+    int count, size;
+} profile;
+
+// subscribers and topics stored in the server, together with their lookup indexes
+extern list subscribers;
+extern list topics;
+extern hashmap subscriber_index;  // registered subscribers by id
+extern hashmap topic_index;  // topics by title
+
+void init_database(void);
+void free_database(void);
+
+subscriber *find_subscriber(char *);
+subscriber *add_offline_subscriber(char *);
+void index_subscriber(subscriber *, char *);
+void remove_shell(subscriber *);
+
+topic *find_topic(char *);
+topic *add_topic(char *);
+
+subscription *find_subscription(subscriber *, topic *);
+subscription *add_subscription(topic *, subscriber *, uint8_t, uint8_t, uint32_t);
+void update_subscription(subscription *, uint8_t, uint8_t, uint32_t);
+void remove_subscription(subscription *);
+void remove_subscriptions(subscriber *);
+int subscription_priority(topic *, subscription *);
+void store_message(subscriber *, stored_message *);
+void free_stored_messages(subscriber *);
+void set_topic_priority(char *, int);
+
+profile *find_profile(char *);
+void add_profile_entry(char *, char *, uint8_t, uint32_t);
+int load_profiles(char *);
+
+#endif
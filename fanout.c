@@ -0,0 +1,288 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "database.h"
+#include "fanout.h"
+#include "rcu.h"
+
+uint64_t fanout_published;
+
+static fanout *dirty;  // fan-outs with a copy to publish
+
+/*
+ * Function growing an array of "size" elements of "elem" bytes, if full; returns the array.
+ */
+static void *reserve(void *array, uint32_t count, uint32_t *size, size_t elem) {
+    if (count < *size) {
+        return array;
+    }
+
+    *size = *size ? 2 * *size : 4;
+    array = realloc(array, *size * elem);
+    DIE(array == NULL, "bad alloc");
+
+    return array;
+}
+
+/*
+ * Function deallocating a version of a fan-out table, without its chunks (shared with other versions).
+ */
+static void free_table(void *p) {
+    fanout_table *f = (fanout_table *)p;
+
+    free(f->chunk);
+    free(f->stored);
+    free(f);
+}
+
+/*
+ * Function returning the table of a topic's subscribers that can be changed: a copy of the published one
+ * (sharing its chunks), made at the first change since it was published.
+ */
+static fanout_table *writable(topic *t) {
+    if (!t->fanout) {
+        t->fanout = (fanout *)calloc(1, sizeof(fanout));
+        DIE(t->fanout == NULL, "bad alloc");
+    }
+    fanout *f = t->fanout;
+    if (f->next) {
+        return f->next;
+    }
+
+    fanout_table *live = atomic_load_explicit(&f->live, memory_order_relaxed);  // only written here
+    fanout_table *next = (fanout_table *)calloc(1, sizeof(fanout_table));
+    DIE(next == NULL, "bad alloc");
+    if (live) {
+        *next = *live;
+        next->chunk = NULL;
+        next->stored = NULL;
+        if (live->chunk_size) {
+            next->chunk = (fanout_chunk **)malloc(live->chunk_size * sizeof(fanout_chunk *));
+            DIE(next->chunk == NULL, "bad alloc");
+            memcpy(next->chunk, live->chunk, live->chunks * sizeof(fanout_chunk *));
+        }
+        if (live->stored_size) {
+            next->stored = (subscription **)malloc(live->stored_size * sizeof(subscription *));
+            DIE(next->stored == NULL, "bad alloc");
+            memcpy(next->stored, live->stored, live->stored_count * sizeof(subscription *));
+        }
+    }
+    next->version = ++f->versions;
+
+    f->next = next;
+    f->dirty = dirty;
+    dirty = f;
+    return next;
+}
+
+/*
+ * Function keeping a chunk of the published table, which the copy no longer holds, until the copy is
+ * published; a chunk made for the copy is freed right away.
+ */
+static void replace_chunk(fanout *f, fanout_chunk *k) {
+    if (k->version == f->next->version) {
+        free(k);
+        return;
+    }
+
+    f->replaced = (fanout_chunk **)reserve(f->replaced, f->replaced_count, &f->replaced_size,
+                                           sizeof(fanout_chunk *));
+    f->replaced[f->replaced_count++] = k;
+}
+
+/*
+ * Function returning the chunk of the copy of a topic's table holding the entry at position "i", copied
+ * first if the published table holds it too.
+ */
+static fanout_chunk *writable_chunk(topic *t, uint32_t i) {
+    fanout_table *next = t->fanout->next;
+    fanout_chunk *k = next->chunk[i / FANOUT_CHUNK];
+    if (k->version == next->version) {
+        return k;
+    }
+
+    fanout_chunk *copy = (fanout_chunk *)malloc(sizeof(fanout_chunk));
+    DIE(copy == NULL, "bad alloc");
+    memcpy(copy, k, sizeof(fanout_chunk));
+    copy->version = next->version;
+    replace_chunk(t->fanout, k);
+    next->chunk[i / FANOUT_CHUNK] = copy;
+
+    return copy;
+}
+
+/*
+ * Function placing a subscription in the fan-out table of its topic its subscriber's state calls for.
+ */
+static void place(subscription *sub) {
+    topic *t = sub->topic;
+
+    if (sub->sub->connected) {
+        fanout_table *f = writable(t);
+        uint32_t i = f->count;
+        if (i % FANOUT_CHUNK == 0) {  // all chunks full
+            f->chunk = (fanout_chunk **)reserve(f->chunk, f->chunks, &f->chunk_size, sizeof(fanout_chunk *));
+            f->chunk[f->chunks] = (fanout_chunk *)malloc(sizeof(fanout_chunk));
+            DIE(f->chunk[f->chunks] == NULL, "bad alloc");
+            f->chunk[f->chunks++]->version = f->version;
+        }
+
+        fanout_chunk *k = writable_chunk(t, i);
+        uint32_t j = i % FANOUT_CHUNK;
+        k->conns[j] = get_connection(sub->sub->socket);
+        k->priority[j] = subscription_priority(t, sub);
+        k->flags[j] = sub->sf | (sub->sampler ? FANOUT_SAMPLED : 0);
+        k->subs[j] = sub;
+        f->count++;
+        sub->table = FANOUT_CONNECTED;
+        sub->slot = i;
+    } else if (sub->sf & SF_MASK) {
+        fanout_table *f = writable(t);
+        f->stored = (subscription **)reserve(f->stored, f->stored_count, &f->stored_size,
+                                             sizeof(subscription *));
+        f->stored[f->stored_count] = sub;
+        sub->table = FANOUT_STORED;
+        sub->slot = f->stored_count++;
+    } else {
+        sub->table = FANOUT_NONE;
+    }
+}
+
+/*
+ * Function taking a subscription out of the fan-out table of its topic, copying at most one chunk.
+ */
+static void unplace(subscription *sub) {
+    if (sub->table == FANOUT_NONE) {
+        return;
+    }
+    topic *t = sub->topic;
+    fanout_table *f = writable(t);
+
+    if (sub->table == FANOUT_CONNECTED) {
+        uint32_t i = sub->slot, last = --f->count;
+        if (i != last) {
+            fanout_chunk *from = f->chunk[last / FANOUT_CHUNK], *to = writable_chunk(t, i);  // read only
+            uint32_t a = last % FANOUT_CHUNK, b = i % FANOUT_CHUNK;
+            to->conns[b] = from->conns[a];
+            to->priority[b] = from->priority[a];
+            to->flags[b] = from->flags[a];
+            to->subs[b] = from->subs[a];
+            to->subs[b]->slot = i;
+        }
+        if (last % FANOUT_CHUNK == 0) {  // the last chunk is now empty
+            replace_chunk(t->fanout, f->chunk[--f->chunks]);
+        }
+    } else if (sub->table == FANOUT_STORED) {
+        uint32_t i = sub->slot, last = --f->stored_count;
+        f->stored[i] = f->stored[last];
+        f->stored[i]->slot = i;
+    }
+    sub->table = FANOUT_NONE;
+}
+
+/*
+ * Function adding a new subscription to the fan-out table of its topic and to its subscriber's
+ * subscriptions.
+ */
+void fanout_attach(subscription *sub) {
+    subscriber *s = sub->sub;
+    s->subscriptions = (subscription **)reserve(s->subscriptions, s->sub_count, &s->sub_size,
+                                                sizeof(subscription *));
+    sub->index = s->sub_count++;
+    s->subscriptions[sub->index] = sub;
+
+    place(sub);
+}
+
+/*
+ * Function removing a subscription from the fan-out table of its topic and from its subscriber's
+ * subscriptions, in constant time.
+ */
+void fanout_detach(subscription *sub) {
+    unplace(sub);
+
+    subscriber *s = sub->sub;
+    uint32_t last = --s->sub_count;
+    s->subscriptions[sub->index] = s->subscriptions[last];
+    s->subscriptions[sub->index]->index = sub->index;
+}
+
+/*
+ * Function updating the fan-out entry of a subscription whose options or class changed.
+ */
+void fanout_update(subscription *sub) {
+    unplace(sub);
+    place(sub);
+}
+
+/*
+ * Function moving the subscriptions of a subscriber that just logged in (its socket set) to the connected
+ * subscribers of their topics, or of one that just disconnected to the store-and-forward ones.
+ */
+void fanout_refresh(subscriber *s) {
+    for (uint32_t i = 0; i < s->sub_count; i++) {
+        fanout_update(s->subscriptions[i]);
+    }
+}
+
+/*
+ * Function publishing the tables changed since the last call, each in a single atomic store; the versions
+ * they replace, and the chunks only those held, are retired and freed once the readers are quiescent.
+ *
+ * The separation is structural only for now: the event loop is both the only writer and the only reader,
+ * so a table is never read while it is replaced. It keeps the publishing path free of locks and of the
+ * control plane's structures, should publishing move to threads of its own.
+ */
+void fanout_publish(void) {
+    while (dirty) {
+        fanout *f = dirty;
+        dirty = f->dirty;
+        f->dirty = NULL;
+
+        fanout_table *old = atomic_exchange_explicit(&f->live, f->next, memory_order_release);
+        f->next = NULL;
+        fanout_published++;
+        if (old) {
+            rcu_retire(old, free_table);
+        }
+        for (uint32_t i = 0; i < f->replaced_count; i++) {
+            rcu_retire(f->replaced[i], free);
+        }
+        f->replaced_count = 0;
+    }
+}
+
+/*
+ * Function deallocating the fan-out tables of a topic (no longer read), published or not.
+ */
+void fanout_free(topic *t) {
+    fanout *f = t->fanout;
+    if (!f) {
+        return;
+    }
+
+    if (f->next) {  // out of the fan-outs to publish, with the chunks made for it
+        fanout **p = &dirty;
+        while (*p != f) {
+            p = &(*p)->dirty;
+        }
+        *p = f->dirty;
+        for (uint32_t i = 0; i < f->next->chunks; i++) {
+            if (f->next->chunk[i]->version == f->next->version) {
+                free(f->next->chunk[i]);
+            }
+        }
+        free_table(f->next);
+    }
+
+    fanout_table *live = atomic_load_explicit(&f->live, memory_order_relaxed);
+    if (live) {  // holding the other chunks, replaced ones included
+        for (uint32_t i = 0; i < live->chunks; i++) {
+            free(live->chunk[i]);
+        }
+        free_table(live);
+    }
+    free(f->replaced);
+    free(f);
+    t->fanout = NULL;
+}
@@ -0,0 +1,83 @@
+#ifndef _FANOUT_H
+#define _FANOUT_H 1
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "connection.h"
+
+#define FANOUT_PREFETCH 4  // subscribers ahead whose connection is prefetched while publishing
+#define FANOUT_SAMPLED 0x80  // flag of a subscription limited to one message per interval (see sampler.h)
+
+/*
+ * Fan-out tables of a subscription.
+ */
+enum {
+    FANOUT_NONE,  // disconnected subscriber without store-and-forward, gets nothing
+    FANOUT_CONNECTED,
+    FANOUT_STORED,  // disconnected subscriber with store-and-forward
+};
+
+#define FANOUT_CHUNK 256  // connected subscribers per chunk of a fan-out table
+
+/*
+ * Consecutive entries of the connected subscribers of a fan-out table, in parallel arrays (connection,
+ * class and options of each). A chunk is copied when an entry changes, if the table last published
+ * holds it too.
+ */
+typedef struct fanout_chunk {
+    uint64_t version;  // version of the table the chunk was made for, changed in place only in that one
+    connection *conns[FANOUT_CHUNK];  // connection (socket and output queues) of each
+    subscription *subs[FANOUT_CHUNK];
+    uint8_t priority[FANOUT_CHUNK];  // class the topic's messages are sent to it in
+    uint8_t flags[FANOUT_CHUNK];  // options of the subscription (MULTICAST_FLAG, FANOUT_SAMPLED)
+} fanout_chunk;
+
+/*
+ * Subscribers a topic's messages go to, kept apart from its subscription list so that publishing reads
+ * contiguous memory: the connected ones in chunks of FANOUT_CHUNK entries, the disconnected ones with
+ * store-and-forward in an array of their own. An entry is removed by moving the last one in its place.
+ */
+typedef struct fanout_table {
+    uint64_t version;
+    uint32_t count;  // connected subscribers
+    uint32_t chunks, chunk_size;  // used and allocated chunk pointers
+    fanout_chunk **chunk;
+    uint32_t stored_count, stored_size;  // disconnected subscribers with store-and-forward
+    subscription **stored;
+} fanout_table;
+
+/*
+ * Fan-out of a topic, copy-on-write: publishing reads the table last published, never changed in place
+ * and read without locks; subscription changes go to a copy (sharing the chunks it does not change),
+ * published in a single atomic store by fanout_publish() once the request changing it was handled. The
+ * version it replaces, and the chunks only that version held, are reclaimed once the readers are
+ * quiescent (see rcu.h).
+ */
+typedef struct fanout {
+    fanout_table *_Atomic live;  // table read by the publishing path, NULL before the first publication
+    fanout_table *next;  // copy being changed, NULL if the table did not change since it was published
+    uint64_t versions;  // versions made
+    fanout_chunk **replaced;  // chunks of the published table the copy no longer holds
+    uint32_t replaced_count, replaced_size;
+    struct fanout *dirty;  // next fan-out with a copy to publish
+} fanout;
+
+extern uint64_t fanout_published;  // tables published
+
+/*
+ * Function returning the table of a topic's subscribers the publishing path reads, NULL if it has none.
+ */
+static inline fanout_table *fanout_read(topic *t) {
+    return t->fanout ? atomic_load_explicit(&t->fanout->live, memory_order_acquire) : NULL;
+}
+
+void fanout_attach(subscription *);
+void fanout_detach(subscription *);
+void fanout_update(subscription *);
+void fanout_refresh(subscriber *);
+void fanout_publish(void);
+void fanout_free(topic *);
+
+#endif
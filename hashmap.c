@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+
+#define MIN_CAPACITY 16
+
+/*
+ * FNV-1a hash of a string key.
+ */
+static uint32_t hash_key(const char *key) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+/*
+ * Function returning the slot holding the given key, or NULL if the key is not in the table.
+ */
+static hashmap_slot *find_slot(hashmap *map, const char *key, uint32_t h) {
+    if (!map->capacity) {
+        return NULL;
+    }
+
+    size_t mask = map->capacity - 1;
+    for (size_t i = h & mask;; i = (i + 1) & mask) {
+        hashmap_slot *slot = &map->slots[i];
+        if (!slot->key) {
+            return NULL;
+        }
+        if (slot->value && slot->hash == h && strcmp(slot->key, key) == 0) {
+            return slot;
+        }
+    }
+}
+
+/*
+ * Function reallocating the slots of the table to a given capacity, dropping any tombstones.
+ */
+static void resize(hashmap *map, size_t capacity) {
+    hashmap_slot *old = map->slots;
+    size_t old_capacity = map->capacity;
+
+    map->slots = (hashmap_slot *)calloc(capacity, sizeof(hashmap_slot));
+    if (!map->slots) {
+        perror("bad alloc\n");
+        exit(EXIT_FAILURE);
+    }
+    map->capacity = capacity;
+    map->used = map->size;
+
+    size_t mask = capacity - 1;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].key && old[i].value) {
+            size_t j = old[i].hash & mask;
+            while (map->slots[j].key) {
+                j = (j + 1) & mask;
+            }
+            map->slots[j] = old[i];
+        }
+    }
+
+    free(old);
+}
+
+/*
+ * Function initialising an empty table able to hold at least "expected" entries without growing.
+ */
+void hashmap_init(hashmap *map, size_t expected) {
+    size_t capacity = MIN_CAPACITY;
+    while (capacity < 2 * expected) {
+        capacity <<= 1;
+    }
+
+    map->slots = NULL;
+    map->capacity = 0;
+    map->size = 0;
+    map->used = 0;
+    resize(map, capacity);
+}
+
+/*
+ * Function returning the value associated with a given key, NULL if not found.
+ */
+void *hashmap_get(hashmap *map, const char *key) {
+    hashmap_slot *slot = find_slot(map, key, hash_key(key));
+
+    return slot ? slot->value : NULL;
+}
+
+/*
+ * Function associating a (non NULL) value to a given key, replacing any previous value.
+ */
+void hashmap_put(hashmap *map, const char *key, void *value) {
+    uint32_t h = hash_key(key);
+    hashmap_slot *slot = find_slot(map, key, h);
+    if (slot) {
+        slot->key = key;
+        slot->value = value;
+        return;
+    }
+
+    // keep the load factor (tombstones included) under 1/2
+    if (2 * (map->used + 1) > map->capacity) {
+        resize(map, 2 * (map->size + 1) > map->capacity / 2 ? 2 * map->capacity : map->capacity);
+    }
+
+    size_t mask = map->capacity - 1;
+    size_t i = h & mask;
+    while (map->slots[i].key && map->slots[i].value) {
+        i = (i + 1) & mask;
+    }
+
+    if (!map->slots[i].key) {  // reusing a tombstone doesn't change the number of used slots
+        map->used++;
+    }
+    map->slots[i].key = key;
+    map->slots[i].value = value;
+    map->slots[i].hash = h;
+    map->size++;
+}
+
+/*
+ * Function removing the entry with a given key, if present; the slot is left as a tombstone so that
+ * probe sequences passing through it are not broken.
+ */
+void hashmap_remove(hashmap *map, const char *key) {
+    hashmap_slot *slot = find_slot(map, key, hash_key(key));
+    if (slot) {
+        slot->value = NULL;
+        map->size--;
+    }
+}
+
+/*
+ * Function deallocating the slots of a table; stored values are owned by the caller.
+ */
+void hashmap_free(hashmap *map) {
+    free(map->slots);
+    map->slots = NULL;
+    map->capacity = 0;
+    map->size = 0;
+    map->used = 0;
+}
@@ -0,0 +1,33 @@
+#ifndef _HASHMAP_H
+#define _HASHMAP_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Slot of an open addressing hash table; the key is not copied, it has to point inside the stored
+ * element (e.g. the id of a subscriber or the title of a topic), so it lives as long as the element.
+ */
+typedef struct {
+    const char *key;  // NULL - empty slot
+    void *value;  // NULL with a non NULL key - deleted slot (tombstone)
+    uint32_t hash;
+} hashmap_slot;
+
+/*
+ * Generic string keyed hash table, using linear probing.
+ */
+typedef struct {
+    hashmap_slot *slots;
+    size_t capacity;  // always a power of 2
+    size_t size;  // number of live entries
+    size_t used;  // number of live entries and tombstones
+} hashmap;
+
+void hashmap_init(hashmap *, size_t);
+void *hashmap_get(hashmap *, const char *);
+void hashmap_put(hashmap *, const char *, void *);
+void hashmap_remove(hashmap *, const char *);
+void hashmap_free(hashmap *);
+
+#endif
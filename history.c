@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "database.h"
+#include "history.h"
+#include "wire.h"
+
+static uint32_t max_messages;  // messages kept per topic, 0 - no history
+static size_t max_bytes;  // encoded bytes kept per topic
+
+
+/*
+ * Function enabling the history of the topics from a "<messages>[:<KB>]" specification (at most that many
+ * messages per topic, and no more than that many KB of them); returns 0 if the specification is invalid.
+ */
+int history_init(char *spec) {
+    unsigned int messages, kb = 0;
+    int n = sscanf(spec, "%u:%u", &messages, &kb);
+    if (n < 1 || !messages || (n == 2 && !kb)) {
+        return 0;
+    }
+
+    max_messages = messages;
+    max_bytes = n == 2 ? (size_t)kb << 10 : SIZE_MAX;
+    return 1;
+}
+
+/*
+ * Function returning 1 if the topics keep their last messages.
+ */
+int history_enabled(void) {
+    return max_messages > 0;
+}
+
+/*
+ * Function dropping the oldest message of a topic's history.
+ */
+static void drop_oldest(history *h) {
+    msgbuf *b = h->ring[h->oldest];
+    h->bytes -= b->len;
+    msgbuf_put(b);
+    h->ring[h->oldest] = NULL;
+    h->oldest = (h->oldest + 1) % max_messages;
+    h->count--;
+    h->seq++;
+}
+
+/*
+ * Function adding a message published on a topic to its history (taking a reference to the buffer),
+ * dropping the oldest messages to make room for it.
+ */
+void history_add(topic *t, msgbuf *b) {
+    history *h = t->history;
+    if (!h) {
+        h = t->history = (history *)calloc(1, sizeof(history));
+        DIE(h == NULL, "bad alloc");
+        h->ring = (msgbuf **)calloc(max_messages, sizeof(msgbuf *));
+        DIE(h->ring == NULL, "bad alloc");
+        h->seq = 1;
+    }
+
+    while (h->count && (h->count == max_messages || h->bytes + b->len > max_bytes)) {
+        drop_oldest(h);
+    }
+    if (b->len > max_bytes) {  // never kept, but numbered
+        h->seq++;
+        return;
+    }
+
+    msgbuf_get(b);
+    h->ring[(h->oldest + h->count) % max_messages] = b;
+    h->count++;
+    h->bytes += b->len;
+}
+
+/*
+ * Function handing to "send" (with "context") the answer to a history request for the topic with a given
+ * title: a CONTROL_HISTORY frame telling which messages follow, then the last "value" messages
+ * (HISTORY_LAST) or those numbered from "value" on (HISTORY_SINCE) still kept, oldest first.
+ */
+void history_replay(char *title, uint8_t mode, uint32_t value, void (*send)(msgbuf *, void *), void *context) {
+    topic *t = find_topic(title);
+    history *h = t ? t->history : NULL;
+    history_reply reply = {0, 0, 0};
+
+    if (h) {
+        uint32_t next = h->seq + h->count;
+        reply.next = next;
+        if (mode == HISTORY_LAST) {
+            reply.count = value < h->count ? value : h->count;
+            reply.first = next - reply.count;
+        } else {
+            reply.first = value > h->seq ? value : h->seq;
+            reply.count = reply.first < next ? next - reply.first : 0;
+        }
+    }
+
+    uint32_t first = reply.first, count = reply.count;
+    encode_history_reply(&reply);
+    msgbuf *r = encode_control(CONTROL_HISTORY, title, &reply, sizeof(reply));
+    send(r, context);
+    msgbuf_put(r);
+
+    for (uint32_t i = 0; i < count; i++) {
+        send(h->ring[(h->oldest + first - h->seq + i) % max_messages], context);
+    }
+}
+
+/*
+ * Function dropping the history of a topic.
+ */
+void history_free(topic *t) {
+    history *h = t->history;
+    if (!h) {
+        return;
+    }
+
+    while (h->count) {
+        drop_oldest(h);
+    }
+    free(h->ring);
+    free(h);
+    t->history = NULL;
+}
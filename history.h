@@ -0,0 +1,29 @@
+#ifndef _HISTORY_H
+#define _HISTORY_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "msgbuf.h"
+
+/*
+ * Last messages published on a topic, kept for the clients asking for them (history_packet): a ring of
+ * references to the encoded messages (the buffers sent to the subscribers), numbered from 1 in the order
+ * they were published. A message is dropped once the ring is full or holds too many bytes.
+ */
+typedef struct history {
+    msgbuf **ring;
+    uint32_t count, oldest;  // messages kept, position of the oldest one
+    uint32_t seq;  // sequence number of the oldest message kept
+    size_t bytes;  // encoded bytes of the messages kept
+} history;
+
+int history_init(char *);
+int history_enabled(void);
+
+void history_add(topic *, msgbuf *);
+void history_replay(char *, uint8_t, uint32_t, void (*)(msgbuf *, void *), void *);
+void history_free(topic *);
+
+#endif
@@ -0,0 +1,1258 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "libsubscriber.h"
+#include "shmring.h"
+#include "wire.h"
+
+#define RECV_BUFFER 65536  // initial size of a client's receive buffer
+#define SEND_BUFFER 1024  // initial size of a client's buffer of pending requests
+#define MCAST_PENDING 256  // multicast messages kept per topic while waiting for a missing one
+#define MCAST_BATCH 256  // datagrams read at most per call processing the connection
+#define MCAST_FRAME (sizeof(content_header) + 50 + 1500)  // largest message frame
+
+/*
+ * Growable byte buffer; bytes in [start, len) are pending (not yet sent / not yet consumed).
+ */
+typedef struct {
+    char *data;
+    size_t start, len, size;
+} byte_buffer;
+
+/*
+ * Multicast message received ahead of the one a topic waits for.
+ */
+typedef struct {
+    uint32_t seq;
+    int len;  // 0 - empty slot, -1 - the message is lost (the server no longer had it to repair)
+    char *data;  // copy of the frame
+} pending_frame;
+
+/*
+ * Topic received from a multicast group: messages are handed over in sequence number order, the missing
+ * ones being requested from the server, which sends them back over the connection.
+ */
+typedef struct {
+    char title[51];
+    struct in_addr group;
+    uint32_t expected;  // sequence number of the next message to hand over
+    uint32_t requested;  // messages before this one were already requested
+    uint32_t seen;  // one past the highest sequence number received
+    int ending;  // 1 - the topic went back to unicast after message "end"
+    uint32_t end;
+    pending_frame pending[MCAST_PENDING];  // indexed by sequence number
+} mcast_stream;
+
+/*
+ * Connection of an application to the server. A local client (connected through the server's Unix
+ * domain socket) receives messages through a shared memory ring instead of the socket. The client exposes
+ * an epoll descriptor watching the socket and, when used, the ring's data eventfd and the multicast socket.
+ */
+struct sub_client {
+    int socket;
+    int connecting;  // 1 - connect() still in progress
+    int closed;  // 1 - the server closed the connection
+    sub_callback callback;
+    void *context;  // passed back to the callback
+    byte_buffer in, out;
+    char profile[51];  // subscription profile applied at login, "" - none
+
+    int local;  // 1 - messages are received through a shared memory ring
+    int epoll_fd;
+    int epoll_out;  // 1 - the socket is watched for writability (requests are pending)
+    shm_ring ring;  // mapped once received from the server
+    uint64_t ring_pos;  // ring position up to which messages were handed over
+    uint64_t ring_head;  // producer position last seen
+    int waiting;  // 1 - the server was asked to signal the data eventfd
+
+    int mcast;  // 1 - topics may be received from multicast groups
+    struct in_addr mcast_if;  // interface the groups are joined on
+    int mcast_fd;  // socket joined to the groups, opened at the first announce
+    int wake_fd;  // eventfd making the descriptor readable when repairs arrived
+    int wake;  // 1 - repairs arrived since the multicast topics were last processed
+    mcast_stream **streams;
+    int num_streams;
+    byte_buffer mc;  // multicast messages in order, not yet handed over
+    int unicast_pending;  // 1 - a topic went back to unicast while multicast messages were not handed over
+};
+
+
+/*
+ * Function making room for "extra" more bytes at the end of a buffer, moving the pending bytes to its
+ * beginning and growing it if needed.
+ */
+static int reserve(byte_buffer *b, size_t extra) {
+    if (b->start) {
+        memmove(b->data, b->data + b->start, b->len - b->start);
+        b->len -= b->start;
+        b->start = 0;
+    }
+    if (b->len + extra <= b->size) {
+        return 0;
+    }
+
+    size_t size = b->size;
+    while (size < b->len + extra) {
+        size *= 2;
+    }
+    char *data = realloc(b->data, size);
+    if (!data) {
+        return -1;
+    }
+    b->data = data;
+    b->size = size;
+
+    return 0;
+}
+
+/*
+ * Function allocating a client; "callback" (may be NULL if messages are drained in batches instead) is
+ * called with "context" for every message received.
+ */
+sub_client *sub_client_new(sub_callback callback, void *context) {
+    sub_client *c = calloc(1, sizeof(sub_client));
+    if (!c) {
+        return NULL;
+    }
+
+    c->socket = -1;
+    c->mcast_fd = c->wake_fd = -1;
+    c->ring.hdr = NULL;
+    c->ring.mem_fd = c->ring.data_fd = c->ring.space_fd = -1;
+    c->callback = callback;
+    c->context = context;
+    c->in.data = malloc(RECV_BUFFER);
+    c->in.size = RECV_BUFFER;
+    c->out.data = malloc(SEND_BUFFER);
+    c->out.size = SEND_BUFFER;
+    c->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (!c->in.data || !c->out.data || c->epoll_fd < 0) {
+        sub_client_free(c);
+        return NULL;
+    }
+
+    return c;
+}
+
+/*
+ * Function closing a client's connection and freeing it.
+ */
+void sub_client_free(sub_client *c) {
+    if (!c) {
+        return;
+    }
+    if (c->socket >= 0) {
+        close(c->socket);
+    }
+    if (c->epoll_fd >= 0) {
+        close(c->epoll_fd);
+    }
+    if (c->mcast_fd >= 0) {
+        close(c->mcast_fd);
+    }
+    if (c->wake_fd >= 0) {
+        close(c->wake_fd);
+    }
+    shm_ring_close(&c->ring);
+    for (int i = 0; i < c->num_streams; i++) {
+        for (int j = 0; j < MCAST_PENDING; j++) {
+            free(c->streams[i]->pending[j].data);
+        }
+        free(c->streams[i]);
+    }
+    free(c->streams);
+    free(c->in.data);
+    free(c->out.data);
+    free(c->mc.data);
+    free(c);
+}
+
+/*
+ * Function letting a client receive topics from multicast groups, joined on the interface with address
+ * "iface" (NULL for the default one); the server switches a topic to multicast for the subscriptions made
+ * afterwards once enough subscribers can receive it that way. Returns -1 (errno set) on failure.
+ */
+int sub_client_multicast(sub_client *c, const char *iface) {
+    if (c->mcast) {
+        return 0;
+    }
+
+    c->mcast_if.s_addr = htonl(INADDR_ANY);
+    if (iface && inet_pton(AF_INET, iface, &c->mcast_if) <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    c->mc.data = malloc(RECV_BUFFER);
+    c->mc.size = RECV_BUFFER;
+    c->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!c->mc.data || c->wake_fd < 0) {
+        return -1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = c->wake_fd };
+    if (epoll_ctl(c->epoll_fd, EPOLL_CTL_ADD, c->wake_fd, &ev) < 0) {
+        return -1;
+    }
+    c->mcast = 1;
+
+    return 0;
+}
+
+/*
+ * Function queueing a request (header and "len" bytes of content) to be sent to the server.
+ */
+static int queue_request(sub_client *c, uint8_t type, void *content, int len) {
+    request_header hdr;
+    hdr.type = type;
+    hdr.len = len;
+    encode_request_header(&hdr);
+
+    if (reserve(&c->out, sizeof(hdr) + len) < 0) {
+        return -1;
+    }
+    memcpy(c->out.data + c->out.len, &hdr, sizeof(hdr));
+    if (len) {
+        memcpy(c->out.data + c->out.len + sizeof(hdr), content, len);
+    }
+    c->out.len += sizeof(hdr) + len;
+
+    return 0;
+}
+
+/*
+ * Function sending as many pending requests as the socket accepts without blocking.
+ */
+static int flush_requests(sub_client *c) {
+    while (c->out.start < c->out.len) {
+        ssize_t rc = send(c->socket, c->out.data + c->out.start, c->out.len - c->out.start,
+                          MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (rc < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return 0;
+            }
+            return -1;
+        }
+        c->out.start += rc;
+    }
+    c->out.start = c->out.len = 0;
+
+    return 0;
+}
+
+/*
+ * Function watching the socket for writability only while connecting or while requests are pending.
+ */
+static int update_interest(sub_client *c) {
+    int out = c->connecting || c->out.start < c->out.len;
+    if (out == c->epoll_out) {
+        return 0;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN | (out ? EPOLLOUT : 0), .data.fd = c->socket };
+    if (epoll_ctl(c->epoll_fd, EPOLL_CTL_MOD, c->socket, &ev) < 0) {
+        return -1;
+    }
+    c->epoll_out = out;
+
+    return 0;
+}
+
+/*
+ * Function queueing a request and sending it right away if the connection is established.
+ */
+static int send_request(sub_client *c, uint8_t type, void *content, int len) {
+    if (c->socket < 0) {
+        errno = ENOTCONN;
+        return -1;
+    }
+    if (queue_request(c, type, content, len) < 0) {
+        return -1;
+    }
+    if (c->connecting) {
+        return 0;
+    }
+
+    return flush_requests(c) < 0 ? -1 : update_interest(c);
+}
+
+/*
+ * Function queueing the login request with the given id, naming the profile to apply, if any.
+ */
+static int queue_login(sub_client *c, const char *id) {
+    connect_packet login;
+
+    memset(&login, 0, sizeof(login));
+    memcpy(login.id, id, strlen(id) + 1);
+    if (!c->profile[0]) {
+        return queue_request(c, 0, &login, strlen(id) + 1);
+    }
+
+    login.sf = c->mcast ? MULTICAST_FLAG : 0;
+    memcpy(login.profile, c->profile, sizeof(login.profile));
+    return queue_request(c, 0, &login, sizeof(login));
+}
+
+/*
+ * Function starting the connection to the server at "ip":"port" and queueing the login request with
+ * the given id; it does not wait for the connection to complete. Returns -1 (errno set) on failure.
+ */
+int sub_client_connect(sub_client *c, const char *ip, uint16_t port, const char *id) {
+    connect_packet login;
+    struct sockaddr_in serv_addr;
+
+    if (c->socket >= 0 || strlen(id) >= sizeof(login.id)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &serv_addr.sin_addr.s_addr) <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    c->socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->socket < 0) {
+        return -1;
+    }
+
+    // deactivate Nagle algorithm, requests are small and should leave immediately
+    int enable = 1;
+    setsockopt(c->socket, SOL_TCP, TCP_NODELAY, &enable, sizeof(int));
+
+    if (connect(c->socket, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+        if (errno != EINPROGRESS) {
+            int err = errno;
+            close(c->socket);
+            c->socket = -1;
+            errno = err;
+            return -1;
+        }
+        c->connecting = 1;
+    }
+
+    // the login request is pending, wait for writability too
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT, .data.fd = c->socket };
+    if (epoll_ctl(c->epoll_fd, EPOLL_CTL_ADD, c->socket, &ev) < 0) {
+        int err = errno;
+        close(c->socket);
+        c->socket = -1;
+        errno = err;
+        return -1;
+    }
+    c->epoll_out = 1;
+
+    return queue_login(c, id);
+}
+
+/*
+ * Function connecting to a server on the same host through its Unix domain socket at "path" and queueing
+ * the login request with the given id; messages are then received through a shared memory ring handed
+ * over by the server. Returns -1 (errno set) on failure.
+ */
+int sub_client_connect_local(sub_client *c, const char *path, const char *id) {
+    connect_packet login;
+    struct sockaddr_un addr;
+
+    if (c->socket >= 0 || strlen(id) >= sizeof(login.id) || strlen(path) >= sizeof(addr.sun_path)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    c->socket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->socket < 0) {
+        return -1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = c->socket };
+    if (connect(c->socket, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        epoll_ctl(c->epoll_fd, EPOLL_CTL_ADD, c->socket, &ev) < 0) {
+        int err = errno;
+        close(c->socket);
+        c->socket = -1;
+        errno = err;
+        return -1;
+    }
+    c->local = 1;
+
+    return queue_login(c, id);
+}
+
+/*
+ * Function returning the descriptor to be polled for the events returned by sub_client_events().
+ */
+int sub_client_fd(sub_client *c) {
+    return c->epoll_fd;
+}
+
+/*
+ * Function returning the poll events the client currently waits for.
+ */
+short sub_client_events(sub_client *c) {
+    (void)c;
+    return POLLIN;  // the epoll descriptor only becomes readable
+}
+
+/*
+ * Function checking whether the connection to the server was established.
+ */
+int sub_client_connected(sub_client *c) {
+    return c->socket >= 0 && !c->connecting;
+}
+
+/*
+ * Function naming a subscription profile stored on the server, applied at login (the server answers
+ * with a SUB_ACK message); must be called before connecting.
+ */
+int sub_client_profile(sub_client *c, const char *name) {
+    if (c->socket >= 0 || strlen(name) >= sizeof(c->profile)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(c->profile, name, strlen(name) + 1);
+
+    return 0;
+}
+
+/*
+ * Function encoding the options of a subscription as in subscribe_packet.
+ */
+static uint8_t encode_sf(sub_client *c, int sf, int priority) {
+    uint8_t code = sf & SF_MASK;
+    if (c->mcast) {
+        code |= MULTICAST_FLAG;
+    }
+    if (priority >= 0) {
+        code |= (priority + 1) << PRIORITY_SHIFT;
+    }
+
+    return code;
+}
+
+/*
+ * Function queueing a subscribe request for a topic with the store-and-forward option "sf" and the
+ * priority class "priority" (-1 to use the topic's class).
+ */
+int sub_client_subscribe(sub_client *c, const char *title, int sf, int priority) {
+    return sub_client_subscribe_sampled(c, title, sf, priority, 0);
+}
+
+/*
+ * Function queueing a subscribe request for a topic, as sub_client_subscribe(), asking the server to send
+ * at most one message every "interval" ms (0 - all of them): the latest message of each interval is sent,
+ * so the last value of a topic that went quiet is always received. Such a topic is never received by
+ * multicast.
+ */
+int sub_client_subscribe_sampled(sub_client *c, const char *title, int sf, int priority, uint32_t interval) {
+    subscribe_packet data;
+
+    if (strlen(title) >= sizeof(data.topic) || priority < -1 || priority >= NUM_PRIORITIES) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(&data, 0, sizeof(data));
+    data.sf = encode_sf(c, sf, priority);
+    memcpy(data.topic, title, strlen(title) + 1);
+    data.interval = interval;
+    encode_subscribe(&data);
+
+    // the interval comes after the whole title field, and is only sent when set (as older servers expect)
+    return send_request(c, 1, &data, interval ? sizeof(data) : strlen(title) + 2);
+}
+
+/*
+ * Function queueing an unsubscribe request for a topic.
+ */
+int sub_client_unsubscribe(sub_client *c, const char *title) {
+    unsubscribe_packet data;
+
+    if (strlen(title) >= sizeof(data.topic)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(data.topic, title, strlen(title) + 1);
+
+    return send_request(c, 2, &data, strlen(title) + 1);
+}
+
+/*
+ * Function queueing a history request for a topic, of a given mode (history_packet).
+ */
+static int send_history(sub_client *c, const char *title, uint8_t mode, uint32_t value) {
+    history_packet data;
+
+    if (strlen(title) >= sizeof(data.topic)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(&data, 0, sizeof(data));
+    memcpy(data.topic, title, strlen(title) + 1);
+    data.mode = mode;
+    data.value = value;
+    encode_history_request(&data);
+
+    return send_request(c, 7, &data, sizeof(data));
+}
+
+/*
+ * Function asking the server for the last "count" messages of a topic it keeps, whether subscribed to it
+ * or not: they are handed over after a SUB_HISTORY message, in the order they were published.
+ */
+int sub_client_history(sub_client *c, const char *title, uint32_t count) {
+    return send_history(c, title, HISTORY_LAST, count);
+}
+
+/*
+ * Function asking the server for the messages of a topic it keeps from sequence number "seq" on (e.g. the
+ * "next" of a previous SUB_HISTORY message), as sub_client_history().
+ */
+int sub_client_history_since(sub_client *c, const char *title, uint32_t seq) {
+    return send_history(c, title, HISTORY_SINCE, seq);
+}
+
+/*
+ * Function queueing a bulk subscribe (type 5, "topics" given) or unsubscribe (type 6, "titles" given)
+ * request for "count" topics, sent as a single request; the server answers with a SUB_ACK message.
+ */
+static int send_bulk(sub_client *c, uint8_t type, const sub_topic *topics, const char *const *titles, int count) {
+    size_t len = 0;
+    for (int i = 0; i < count; i++) {
+        const char *title = topics ? topics[i].topic : titles[i];
+        if (!title[0] || strlen(title) > 50 ||
+            (topics && (topics[i].priority < -1 || topics[i].priority >= NUM_PRIORITIES))) {
+            errno = EINVAL;
+            return -1;
+        }
+        len += sizeof(bulk_entry) + strlen(title);
+    }
+    if (count <= 0 || len > MAX_BULK_LEN) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char *entries = (char *)malloc(len), *pos = entries;
+    if (!entries) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        const char *title = topics ? topics[i].topic : titles[i];
+        bulk_entry e = { topics ? encode_sf(c, topics[i].sf, topics[i].priority) : 0, strlen(title) };
+        memcpy(pos, &e, sizeof(e));
+        memcpy(pos + sizeof(e), title, e.topic_len);
+        pos += sizeof(e) + e.topic_len;
+    }
+
+    int rc = send_request(c, type, entries, len);
+    free(entries);
+    return rc;
+}
+
+/*
+ * Function queueing a single request subscribing to "count" topics, each with its own options.
+ */
+int sub_client_subscribe_bulk(sub_client *c, const sub_topic *topics, int count) {
+    return send_bulk(c, 5, topics, NULL, count);
+}
+
+/*
+ * Function queueing a single request unsubscribing from "count" topics.
+ */
+int sub_client_unsubscribe_bulk(sub_client *c, const char *const *titles, int count) {
+    return send_bulk(c, 6, NULL, titles, count);
+}
+
+/*
+ * Function processing the connection of a local client: mapping the ring once the server handed it over,
+ * sending pending requests and freeing the space of the messages handed over by the previous call.
+ */
+static int pump_local(sub_client *c) {
+    if (!c->ring.hdr) {
+        int fds[3];
+        int rc = shm_ring_recv_fds(c->socket, fds);
+        if (rc <= 0) {
+            return rc;
+        }
+        if (shm_ring_attach(&c->ring, fds[0], fds[1], fds[2]) < 0) {
+            return -1;
+        }
+
+        struct epoll_event ev = { .events = EPOLLIN, .data.fd = c->ring.data_fd };
+        if (epoll_ctl(c->epoll_fd, EPOLL_CTL_ADD, c->ring.data_fd, &ev) < 0) {
+            return -1;
+        }
+        c->ring_pos = c->ring_head = atomic_load_explicit(&c->ring.hdr->tail, memory_order_relaxed);
+    }
+
+    if (!c->closed && (flush_requests(c) < 0 || update_interest(c) < 0)) {
+        return -1;
+    }
+    if (shm_ring_release(&c->ring, c->ring_pos) < 0) {
+        return -1;
+    }
+
+    if (c->waiting) {  // reset the data eventfd the server may have signalled
+        uint64_t count;
+        if (read(c->ring.data_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+            return -1;
+        }
+        c->waiting = 0;
+    }
+
+    // with nothing to read in the ring, check whether the server closed the socket (it sends nothing else)
+    if (!c->closed && atomic_load_explicit(&c->ring.hdr->head, memory_order_acquire) == c->ring_pos) {
+        char byte;
+        ssize_t rc = recv(c->socket, &byte, sizeof(byte), MSG_DONTWAIT);
+        if (rc == 0 || (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            c->closed = 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Function announcing to the server that a local client, having handed over all the messages in its
+ * ring, is about to wait on its descriptor; the descriptor is made readable right away if messages
+ * arrived meanwhile or if the server waits for the space of the messages still held by the application.
+ */
+static int prepare_wait(sub_client *c) {
+    if (shm_ring_wait(&c->ring, c->ring_head) ||
+        atomic_load_explicit(&c->ring.hdr->producer_waiting, memory_order_relaxed)) {
+        uint64_t one = 1;
+        if (write(c->ring.data_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            return -1;
+        }
+    }
+    c->waiting = 1;
+
+    return 0;
+}
+
+/*
+ * Function finishing a pending connect, sending pending requests and reading whatever the socket holds
+ * without blocking. Returns -1 (errno set) if the connection failed.
+ */
+static int pump_remote(sub_client *c) {
+    if (c->connecting) {
+        struct pollfd p = { .fd = c->socket, .events = POLLOUT };
+        if (poll(&p, 1, 0) <= 0) {
+            return 0;
+        }
+
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->socket, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            errno = err;
+            return -1;
+        }
+        c->connecting = 0;
+    }
+
+    if (!c->closed && (flush_requests(c) < 0 || update_interest(c) < 0)) {
+        return -1;
+    }
+
+    if (reserve(&c->in, RECV_BUFFER / 4) < 0) {
+        return -1;
+    }
+    while (!c->closed && c->in.len < c->in.size) {
+        ssize_t rc = recv(c->socket, c->in.data + c->in.len, c->in.size - c->in.len, MSG_DONTWAIT);
+        if (rc < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (rc == 0) {
+            c->closed = 1;  // messages left in the buffer are still delivered
+            break;
+        }
+        c->in.len += rc;
+    }
+
+    return 0;
+}
+
+/*
+ * Function returning the length of the message frame at "frame", or 0 if its "avail" available bytes do
+ * not even hold its header.
+ */
+static size_t frame_length(const char *frame, size_t avail) {
+    message_info info;
+
+    if (avail < sizeof(content_header)) {
+        return 0;
+    }
+    decode_content_header(&info, frame);
+
+    return sizeof(content_header) + info.topic_len + info.data_len;
+}
+
+/*
+ * Function returning the index of the multicast topic with the given title, or -1.
+ */
+static int find_stream(sub_client *c, const char *title, int len) {
+    for (int i = 0; i < c->num_streams; i++) {
+        if ((int)strlen(c->streams[i]->title) == len && !memcmp(c->streams[i]->title, title, len)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Function dropping the multicast topic with index "k", and its group if no other topic uses it.
+ */
+static int close_stream(sub_client *c, int k) {
+    mcast_stream *s = c->streams[k];
+    for (int i = 0; i < MCAST_PENDING; i++) {
+        free(s->pending[i].data);
+    }
+    c->streams[k] = c->streams[--c->num_streams];
+
+    int used = 0;
+    for (int i = 0; i < c->num_streams; i++) {
+        used |= c->streams[i]->group.s_addr == s->group.s_addr;
+    }
+    struct ip_mreq mreq = { .imr_multiaddr = s->group, .imr_interface = c->mcast_if };
+    free(s);
+    if (!used && setsockopt(c->mcast_fd, IPPROTO_IP, IP_DROP_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Function opening the socket receiving the multicast groups, all of them on port "port".
+ */
+static int open_multicast(sub_client *c, uint16_t port) {
+    struct sockaddr_in addr;
+    int enable = 1, disable = 0, rcvbuf = 4 << 20;
+
+    c->mcast_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->mcast_fd < 0) {
+        return -1;
+    }
+
+    // several subscribers on the same host share the port; each socket only receives the groups it joined,
+    // with room for bursts (the datagrams dropped by the kernel have to be repaired)
+    setsockopt(c->mcast_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    setsockopt(c->mcast_fd, IPPROTO_IP, IP_MULTICAST_ALL, &disable, sizeof(disable));
+    setsockopt(c->mcast_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = c->mcast_fd };
+    if (bind(c->mcast_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        epoll_ctl(c->epoll_fd, EPOLL_CTL_ADD, c->mcast_fd, &ev) < 0) {
+        int err = errno;
+        close(c->mcast_fd);
+        c->mcast_fd = -1;
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Function joining the group a topic is now multicast to, as told by the server; "seq" is the sequence
+ * number of the first message to be received from the group.
+ */
+static int join_stream(sub_client *c, const char *title, int len, multicast_announce *a) {
+    struct in_addr group;
+
+    a->group[sizeof(a->group) - 1] = '\0';
+    if (len >= (int)sizeof(((mcast_stream *)0)->title) || inet_pton(AF_INET, a->group, &group) <= 0) {
+        return 0;
+    }
+    if (c->mcast_fd < 0 && open_multicast(c, a->port) < 0) {
+        return -1;
+    }
+
+    struct ip_mreq mreq = { .imr_multiaddr = group, .imr_interface = c->mcast_if };
+    if (setsockopt(c->mcast_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0 && errno != EADDRINUSE) {
+        return -1;
+    }
+
+    mcast_stream *s;
+    int k = find_stream(c, title, len);
+    if (k >= 0) {  // multicast again before the previous period was complete, its missing messages are lost
+        s = c->streams[k];
+        for (int i = 0; i < MCAST_PENDING; i++) {
+            free(s->pending[i].data);
+        }
+    } else {
+        mcast_stream **streams = realloc(c->streams, (c->num_streams + 1) * sizeof(mcast_stream *));
+        if (!streams) {
+            return -1;
+        }
+        c->streams = streams;
+        s = malloc(sizeof(mcast_stream));
+        if (!s) {
+            return -1;
+        }
+        c->streams[c->num_streams++] = s;
+    }
+
+    memset(s, 0, sizeof(mcast_stream));
+    memcpy(s->title, title, len);
+    s->group = group;
+    s->expected = s->requested = s->seen = a->seq;
+
+    return 0;
+}
+
+/*
+ * Function keeping a copy of a multicast message received ahead of the one its topic waits for (or a
+ * mark if "frame" is NULL and the message is lost); messages already handed over, already kept or too far
+ * ahead are ignored.
+ */
+static int keep_pending(mcast_stream *s, uint32_t seq, const char *frame, int len) {
+    if (seq < s->expected || seq - s->expected >= MCAST_PENDING) {
+        return 0;
+    }
+    pending_frame *p = &s->pending[seq % MCAST_PENDING];
+    if (p->len) {
+        return 0;
+    }
+
+    p->seq = seq;
+    p->len = -1;
+    if (frame) {
+        p->data = malloc(len);
+        if (!p->data) {
+            return -1;
+        }
+        memcpy(p->data, frame, len);
+        p->len = len;
+    }
+
+    return 0;
+}
+
+/*
+ * Function asking the server for the messages of a multicast topic not yet received, up to "last", which
+ * were not requested already (as many as can be kept at once).
+ */
+static int request_missing(sub_client *c, mcast_stream *s, uint32_t last) {
+    nack_packet nack;
+
+    nack.first = s->expected > s->requested ? s->expected : s->requested;
+    nack.last = s->expected + MCAST_PENDING - 1 < last ? s->expected + MCAST_PENDING - 1 : last;
+    if (nack.first > nack.last || c->closed) {
+        return 0;
+    }
+    s->requested = nack.last + 1;
+
+    memset(nack.topic, 0, sizeof(nack.topic));
+    strcpy(nack.topic, s->title);
+    encode_nack(&nack);
+    return send_request(c, 3, &nack, sizeof(nack));
+}
+
+/*
+ * Function handling a control frame of the server: a heartbeat of the connection, or a frame about a
+ * topic received from a multicast group.
+ */
+static int handle_control(sub_client *c, sub_message *m) {
+    if (m->data_type == CONTROL_HEARTBEAT) {  // answered, so the server does not close the connection as idle
+        return send_request(c, 4, NULL, 0);
+    }
+    if (!c->mcast) {
+        return 0;
+    }
+    if (m->data_type == CONTROL_MULTICAST) {
+        multicast_announce a;
+        if (m->data_len < (int)sizeof(a)) {
+            return 0;
+        }
+        memcpy(&a, m->payload, sizeof(a));
+        decode_announce(&a);
+        return join_stream(c, m->topic, m->topic_len, &a);
+    }
+
+    int k = find_stream(c, m->topic, m->topic_len);
+    uint32_t seq[2];
+    if (k < 0 || m->data_len < (int)sizeof(seq[0])) {
+        return 0;
+    }
+    mcast_stream *s = c->streams[k];
+    seq[0] = get_le32(m->payload);
+    seq[1] = m->data_len < (int)sizeof(seq) ? 0 : get_le32(m->payload + sizeof(seq[0]));
+
+    if (m->data_type == CONTROL_UNICAST) {
+        s->ending = 1;
+        s->end = seq[0];
+    } else if (m->data_type == CONTROL_REPAIR && m->data_len == sizeof(seq)) {  // lost messages
+        for (uint64_t i = seq[0] > s->expected ? seq[0] : s->expected; i <= seq[1]; i++) {
+            if (i - s->expected >= MCAST_PENDING) {
+                break;
+            }
+            keep_pending(s, i, NULL, 0);
+        }
+    } else if (m->data_type == CONTROL_REPAIR) {  // repaired message
+        const char *frame = m->payload + sizeof(seq[0]);
+        size_t len = m->data_len - sizeof(seq[0]);
+        if (frame_length(frame, len) != len) {
+            return 0;
+        }
+        if (keep_pending(s, seq[0], frame, len) < 0) {
+            return -1;
+        }
+    } else {
+        return 0;
+    }
+
+    // the messages are handed over once the connection is processed again, make sure it is
+    if (!c->wake) {
+        uint64_t one = 1;
+        if (write(c->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            return -1;
+        }
+        c->wake = 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Function reading the datagrams of the multicast groups: a message following the last one of its topic
+ * is placed right away after the messages waiting to be handed over, the others are kept aside.
+ */
+static int receive_datagrams(sub_client *c) {
+    for (int i = 0; i < MCAST_BATCH; i++) {
+        if (reserve(&c->mc, MCAST_FRAME) < 0) {
+            return -1;
+        }
+
+        uint32_t seq;
+        char *frame = c->mc.data + c->mc.len;
+        struct iovec iov[2] = { { &seq, sizeof(seq) }, { frame, MCAST_FRAME } };
+        struct msghdr msg = {0};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+
+        ssize_t rc = recvmsg(c->mcast_fd, &msg, MSG_DONTWAIT);
+        if (rc < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        size_t len = rc - sizeof(seq);
+        if (rc < (ssize_t)sizeof(seq) || frame_length(frame, len) != len) {
+            continue;  // not a message of the server
+        }
+        message_info info;
+        decode_content_header(&info, frame);
+        int k = find_stream(c, frame + sizeof(content_header), info.topic_len);
+        if (k < 0) {
+            continue;  // not announced yet, requested later if needed
+        }
+
+        mcast_stream *s = c->streams[k];
+        seq = ntohl(seq);
+        if (seq >= s->seen) {
+            s->seen = seq + 1;
+        }
+        if (info.data_type == CONTROL_HEARTBEAT) {
+            continue;  // only tells the last sequence number of a quiet topic
+        }
+        if (seq == s->expected && !s->pending[seq % MCAST_PENDING].len) {  // unless already repaired
+            c->mc.len += len;
+            s->expected++;
+        } else if (keep_pending(s, seq, frame, len) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Function processing the multicast topics: handing over the messages that can follow the ones received
+ * in order, requesting the missing ones and leaving the topics that went back to unicast.
+ */
+static int process_streams(sub_client *c) {
+    if (c->wake) {
+        uint64_t count;
+        if (read(c->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+            return -1;
+        }
+        c->wake = 0;
+    }
+    if (c->mcast_fd >= 0 && receive_datagrams(c) < 0) {
+        return -1;
+    }
+
+    for (int k = c->num_streams - 1; k >= 0; k--) {
+        mcast_stream *s = c->streams[k];
+        pending_frame *p = &s->pending[s->expected % MCAST_PENDING];
+        for (; p->len && p->seq == s->expected; p = &s->pending[s->expected % MCAST_PENDING]) {
+            if (p->len > 0) {
+                if (reserve(&c->mc, p->len) < 0) {
+                    return -1;
+                }
+                memcpy(c->mc.data + c->mc.len, p->data, p->len);
+                c->mc.len += p->len;
+                free(p->data);
+                p->data = NULL;
+            }
+            p->len = 0;
+            s->expected++;
+        }
+
+        // gaps are noticed at the next message or heartbeat received, or at the end of the multicast period
+        if (s->ending && s->expected > s->end) {
+            if (close_stream(c, k) < 0) {
+                return -1;
+            }
+        } else if (request_missing(c, s, s->ending ? s->end : s->seen - 1) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Function processing the connection (and the multicast groups) without blocking.
+ */
+static int pump(sub_client *c) {
+    if ((c->local ? pump_local(c) : pump_remote(c)) < 0) {
+        return -1;
+    }
+
+    return c->mcast ? process_streams(c) : 0;
+}
+
+/*
+ * Function decoding the numeric value of a message, if it has one.
+ */
+static void decode_value(sub_message *m) {
+    const uint8_t *p = (const uint8_t *)m->payload;
+    uint32_t u32;
+    uint16_t u16;
+
+    m->value.i = 0;
+    switch (m->data_type) {
+        case SUB_INT:
+            if (m->data_len >= 5) {
+                memcpy(&u32, p + 1, sizeof(u32));
+                m->value.i = p[0] ? -(int64_t)ntohl(u32) : (int64_t)ntohl(u32);
+            }
+            break;
+        case SUB_SHORT_REAL:
+            if (m->data_len >= 2) {
+                memcpy(&u16, p, sizeof(u16));
+                m->value.d = ntohs(u16) / 100.0;
+            }
+            break;
+        case SUB_FLOAT:
+            if (m->data_len >= 6) {
+                memcpy(&u32, p + 1, sizeof(u32));
+                double d = ntohl(u32);
+                for (uint8_t i = 0; i < p[5]; i++) {
+                    d /= 10;
+                }
+                m->value.d = p[0] ? -d : d;
+            }
+            break;
+    }
+}
+
+/*
+ * Function filling a message with the fields of the frame at "frame", in place.
+ */
+static void parse_frame(char *frame, sub_message *m) {
+    message_info info;
+    decode_content_header(&info, frame);
+
+    frame[offsetof(content_header, ip) + sizeof(info.ip) - 1] = '\0';
+    m->ip = frame + offsetof(content_header, ip);
+    m->port = info.port;
+    m->data_type = info.data_type;
+    m->topic = frame + sizeof(content_header);
+    m->topic_len = info.topic_len;
+    m->payload = m->topic + info.topic_len;
+    m->data_len = info.data_len;
+    decode_value(m);
+}
+
+/*
+ * Function parsing the next complete message from the receive buffer (or from the ring of a local
+ * client), in place, then from the messages of the multicast groups; control frames are handled on the
+ * way. Returns 0 if no complete message is available.
+ */
+static int next_message(sub_client *c, sub_message *m) {
+    // a topic that went back to unicast first has its last multicast messages handed over
+    while (!c->unicast_pending || c->mc.start == c->mc.len) {
+        char *frame;
+        size_t avail;
+
+        c->unicast_pending = 0;
+
+        if (c->local) {
+            if (!c->ring.hdr) {
+                break;
+            }
+            frame = c->ring.data + c->ring_pos % c->ring.size;  // contiguous thanks to the second mapping
+            c->ring_head = atomic_load_explicit(&c->ring.hdr->head, memory_order_acquire);
+            avail = c->ring_head - c->ring_pos;
+        } else {
+            frame = c->in.data + c->in.start;
+            avail = c->in.len - c->in.start;
+        }
+
+        size_t total = frame_length(frame, avail);
+        if (!total || avail < total) {
+            if (!c->local && total > c->in.size) {  // make sure the whole message fits at the next read
+                reserve(&c->in, total - (c->in.len - c->in.start));
+            }
+            break;
+        }
+
+        parse_frame(frame, m);
+        if (c->local) {
+            c->ring_pos += total;
+        } else {
+            c->in.start += total;
+        }
+
+        if (!(m->data_type & CONTROL_FLAG)) {
+            return 1;
+        }
+        if (m->data_type == CONTROL_ACK && m->data_len == sizeof(bulk_ack)) {  // handed over too
+            bulk_ack ack;
+            memcpy(&ack, m->payload, sizeof(ack));
+            decode_bulk_ack(&ack);
+            m->value.i = ack.count;
+            return 1;
+        }
+        if (m->data_type == CONTROL_HISTORY && m->data_len == sizeof(history_reply)) {
+            history_reply reply;  // handed over in host order
+            memcpy(&reply, m->payload, sizeof(reply));
+            decode_history_reply(&reply);
+            memcpy((char *)m->payload, &reply, sizeof(reply));
+            m->value.i = reply.count;
+            return 1;
+        }
+        if (handle_control(c, m) < 0) {
+            return -1;
+        }
+        c->unicast_pending = m->data_type == CONTROL_UNICAST;
+    }
+
+    // messages of the multicast groups are complete and in order
+    if (c->mc.start < c->mc.len) {
+        char *frame = c->mc.data + c->mc.start;
+        c->mc.start += frame_length(frame, c->mc.len - c->mc.start);
+        parse_frame(frame, m);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Function processing the connection and handing at most "max" received messages to the callback.
+ * Returns the number of messages delivered, or -1 (errno set) on failure or when the server closed the
+ * connection (errno 0) and no message is left; if it returns "max", more messages may already be buffered
+ * and it should be called again without waiting for the descriptor.
+ */
+int sub_client_process(sub_client *c, int max) {
+    sub_message m;
+    int n = 0, rc = 0;
+
+    if (pump(c) < 0) {
+        return -1;
+    }
+
+    while (n < max && (rc = next_message(c, &m)) > 0) {
+        if (c->callback) {
+            c->callback(c->context, &m);
+        }
+        n++;
+    }
+    if (rc < 0) {
+        return -1;
+    }
+
+    // the callbacks returned, the space of their messages can be reused before waiting
+    if (c->local && c->ring.hdr && n < max &&
+        (shm_ring_release(&c->ring, c->ring_pos) < 0 || prepare_wait(c) < 0)) {
+        return -1;
+    }
+
+    if (c->closed && n == 0) {
+        errno = 0;
+        return -1;
+    }
+    return n;
+}
+
+/*
+ * Function processing the connection and filling "msgs" with at most "max" received messages, which
+ * point into the receive buffer and stay valid until the next call processing the connection.
+ * Returns the number of messages, or -1 like sub_client_process().
+ */
+int sub_client_drain(sub_client *c, sub_message *msgs, int max) {
+    int n = 0, rc = 0;
+
+    if (pump(c) < 0) {
+        return -1;
+    }
+
+    while (n < max && (rc = next_message(c, &msgs[n])) > 0) {
+        n++;
+    }
+    if (rc < 0) {
+        return -1;
+    }
+
+    if (c->local && c->ring.hdr && n < max && prepare_wait(c) < 0) {
+        return -1;
+    }
+
+    if (c->closed && n == 0) {
+        errno = 0;
+        return -1;
+    }
+    return n;
+}
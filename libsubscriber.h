@@ -0,0 +1,89 @@
+#ifndef _LIBSUBSCRIBER_H
+#define _LIBSUBSCRIBER_H 1
+
+#include <stdint.h>
+
+/*
+ * Client library for subscribing to the server's topics from inside an application: the connection is
+ * non-blocking and exposes a file descriptor that can be added to the application's own event loop;
+ * messages are handed over without copies, pointing into the library's receive buffer (or, for clients
+ * on the server's host, into the shared memory ring the server writes them to). Topics with many
+ * subscribers can also be received from multicast groups, the lost messages being repaired over the
+ * connection.
+ */
+
+// types of data carried by messages
+#define SUB_INT 0
+#define SUB_SHORT_REAL 1
+#define SUB_FLOAT 2
+#define SUB_STRING 3
+#define SUB_ACK 0x84  // answer to a bulk request or a profile: value.i - number of subscriptions made or
+                      // removed, payload[0] - type of the request (0 - login with a profile, 5 - bulk
+                      // subscribe, 6 - bulk unsubscribe), topic - name of the profile
+#define SUB_HISTORY 0x85  // answer to a history request, handed over before the messages it announces:
+                          // value.i - number of messages, payload - sub_history
+
+/*
+ * Message received on a subscribed topic; pointers are valid only until the next call processing the
+ * connection (inside a callback, until the callback returns).
+ */
+typedef struct {
+    const char *topic;  // topic title, not terminated
+    int topic_len;
+    const char *payload;  // raw payload bytes (a string payload is not terminated)
+    int data_len;
+    uint8_t data_type;
+    const char *ip;  // ip (terminated) and port of the UDP client that published the message
+    uint16_t port;
+    union {
+        int64_t i;  // decoded INT
+        double d;  // decoded SHORT_REAL or FLOAT
+    } value;
+} sub_message;
+
+/*
+ * Topic subscribed to by a bulk request, with its store-and-forward option and priority class (-1 to use
+ * the topic's class).
+ */
+typedef struct {
+    const char *topic;
+    int sf;
+    int priority;
+} sub_topic;
+
+/*
+ * Messages of a topic following a SUB_HISTORY answer: "count" messages, numbered from "first" on (the
+ * older ones asked for are no longer kept); "next" is the number the topic's next message gets (0 if the
+ * server keeps no history for the topic).
+ */
+typedef struct {
+    uint32_t first, count, next;
+} sub_history;
+
+typedef void (*sub_callback)(void *, const sub_message *);
+
+typedef struct sub_client sub_client;
+
+sub_client *sub_client_new(sub_callback, void *);
+void sub_client_free(sub_client *);
+
+int sub_client_connect(sub_client *, const char *, uint16_t, const char *);
+int sub_client_connect_local(sub_client *, const char *, const char *);
+int sub_client_fd(sub_client *);
+short sub_client_events(sub_client *);
+int sub_client_connected(sub_client *);
+int sub_client_multicast(sub_client *, const char *);
+int sub_client_profile(sub_client *, const char *);
+
+int sub_client_subscribe(sub_client *, const char *, int, int);
+int sub_client_subscribe_sampled(sub_client *, const char *, int, int, uint32_t);
+int sub_client_unsubscribe(sub_client *, const char *);
+int sub_client_subscribe_bulk(sub_client *, const sub_topic *, int);
+int sub_client_unsubscribe_bulk(sub_client *, const char *const *, int);
+int sub_client_history(sub_client *, const char *, uint32_t);
+int sub_client_history_since(sub_client *, const char *, uint32_t);
+
+int sub_client_process(sub_client *, int);
+int sub_client_drain(sub_client *, sub_message *, int);
+
+#endif
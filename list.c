@@ -26,29 +26,50 @@ void insert_in_list(list *l, void *elem) {
 }
 
 /*
- * Function removing a list cell with a given "info" field, identified using the "equal" function, comparing
- * two "info" type data structures.
+ * Function inserting a new list cell with the given "info" field at the beginning of a list, in constant
+ * time (used when the order of the elements is not relevant).
  */
-void remove_from_list(list *l, void *elem, int equal(void *, void *)) {
-    list p = *l;
-
-    if (equal(p->info, elem)) {  // remove first cell
-        *l = p->next;
-        free(p->info);
-        free(p);
+void push_in_list(list *l, void *elem) {
+    list new = (list)calloc(1, sizeof(struct cell));
+    if (!new) {
+        perror("bad alloc\n");
         return;
     }
 
-    list prev = p;
-    for (p = p->next; p != NULL; p = p->next) {
+    new->info = elem;
+    new->next = *l;
+    *l = new;
+}
+
+/*
+ * Function removing a list cell with a given "info" field, identified using the "equal" function, comparing
+ * two "info" type data structures; returns the "info" field of the cell (left allocated), NULL if not found.
+ */
+void *unlink_from_list(list *l, void *elem, int equal(void *, void *)) {
+    list prev = NULL;
+    for (list p = *l; p != NULL; p = p->next) {
         if (equal(p->info, elem)) {
-            prev->next = p->next;
-            free(p->info);
+            if (prev) {
+                prev->next = p->next;
+            } else {  // remove first cell
+                *l = p->next;
+            }
+            void *info = p->info;
             free(p);
-            return;
+            return info;
         }
         prev = p;
     }
+
+    return NULL;
+}
+
+/*
+ * Function removing a list cell with a given "info" field, as unlink_from_list(), and deallocating the
+ * "info" field.
+ */
+void remove_from_list(list *l, void *elem, int equal(void *, void *)) {
+    free(unlink_from_list(l, elem, equal));
 }
 
 /*
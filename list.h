@@ -14,6 +14,8 @@ typedef struct cell {
 } *list;
 
 void insert_in_list(list *, void *);
+void push_in_list(list *, void *);
+void *unlink_from_list(list *, void *, int (void *, void *));
 void remove_from_list(list *, void *, int (void *, void *)); 
 void free_list(list *, void (void *));
 
@@ -0,0 +1,324 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "log.h"
+
+#define LOG_MASK (LOG_SLOTS - 1)
+#define LOG_BATCH (64 << 10)  // bytes written to the console by one call
+
+/*
+ * Slot of the ring, holding a line; "seq" tells whose turn it is: position of the line that can be written
+ * in it (free), or that position + 1 (holding the line, for the writer thread).
+ */
+typedef struct {
+    _Atomic uint64_t seq;
+    uint8_t level;
+    uint16_t len;
+    char text[LOG_LINE];
+} log_slot;
+
+int log_level = LOG_INFO;
+
+// bounded ring of lines (any thread can log, a slot is claimed by advancing "tail" with a compare and swap),
+// drained by a writer thread that sleeps on an eventfd, written only when the writer announced it sleeps
+static log_slot ring[LOG_SLOTS];
+static _Alignas(64) _Atomic uint64_t tail;  // position of the next line logged
+static _Alignas(64) _Atomic uint64_t head;  // position of the next line written
+static _Atomic int sleeping, stopping, running;
+static _Atomic uint64_t dropped;  // lines not logged for lack of room in the ring
+static _Atomic uint64_t suppressed;  // repeated lines over the rate limit of their call site
+
+static int wakefd = -1;
+static pthread_t writer;
+
+
+/*
+ * Function parsing a severity name (debug, info, warn, error) into the minimum level logged; returns 0 if
+ * unknown.
+ */
+int parse_log_level(char *name) {
+    static const char *names[] = { "debug", "info", "warn", "error" };
+
+    for (int i = LOG_DEBUG; i <= LOG_ERROR; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            log_level = i;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Function writing a batch of bytes to the console (fd 1 or 2), whatever it takes.
+ */
+static void write_batch(int fd, const char *buf, size_t len) {
+    while (len) {
+        ssize_t rc = write(fd, buf, len);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;  // nowhere to report it
+        }
+        buf += rc;
+        len -= rc;
+    }
+}
+
+/*
+ * Function moving the lines waiting in the ring to the console, gathered in batches (a batch ends when the
+ * lines switch between stdout and stderr, so their order is kept); returns the number of lines written.
+ */
+static int drain_ring(void) {
+    static char batch[LOG_BATCH];
+    size_t len = 0;
+    int fd = 1, count = 0;
+    uint64_t pos = atomic_load_explicit(&head, memory_order_relaxed);
+
+    while (1) {
+        log_slot *slot = &ring[pos & LOG_MASK];
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + 1) {
+            break;  // empty, or the line is still being formatted
+        }
+
+        int line_fd = slot->level >= LOG_WARN ? 2 : 1;
+        if (len && (line_fd != fd || len + slot->len > sizeof(batch))) {
+            write_batch(fd, batch, len);
+            len = 0;
+        }
+        fd = line_fd;
+        memcpy(batch + len, slot->text, slot->len);
+        len += slot->len;
+
+        atomic_store_explicit(&slot->seq, pos + LOG_SLOTS, memory_order_release);
+        pos++;
+        count++;
+    }
+
+    if (len) {
+        write_batch(fd, batch, len);
+    }
+    atomic_store_explicit(&head, pos, memory_order_release);
+
+    return count;
+}
+
+/*
+ * Function run by the writer thread: draining the ring, and sleeping on the eventfd while it is empty.
+ */
+static void *run_writer(void *arg) {
+    while (1) {
+        if (drain_ring()) {
+            continue;
+        }
+
+        // announce the sleep, then check the ring again: a line logged in between is either seen here, or
+        // its producer sees the announcement and wakes the writer
+        atomic_store(&sleeping, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (drain_ring()) {
+            atomic_store(&sleeping, 0);
+            continue;
+        }
+        if (atomic_load(&stopping)) {
+            break;
+        }
+
+        uint64_t value;
+        if (read(wakefd, &value, sizeof(value)) < 0 && errno != EINTR) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Function waking the writer thread, if it sleeps.
+ */
+static void wake_writer(void) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&sleeping, memory_order_relaxed) && atomic_exchange(&sleeping, 0)) {
+        uint64_t value = 1;
+        if (write(wakefd, &value, sizeof(value)) < 0) {
+            return;  // the counter is saturated, the writer is awake anyway
+        }
+    }
+}
+
+/*
+ * Function queueing a line, or counting it as dropped if the ring is full.
+ */
+static void queue_line(int level, const char *text, int len) {
+    uint64_t pos = atomic_load_explicit(&tail, memory_order_relaxed);
+    log_slot *slot;
+
+    while (1) {
+        slot = &ring[pos & LOG_MASK];
+        int64_t diff = (int64_t)(atomic_load_explicit(&slot->seq, memory_order_acquire) - pos);
+        if (diff == 0) {  // free, claim it
+            if (atomic_compare_exchange_weak_explicit(&tail, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {  // the writer is a full ring behind
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return;
+        } else {  // claimed by another thread meanwhile
+            pos = atomic_load_explicit(&tail, memory_order_relaxed);
+        }
+    }
+
+    memcpy(slot->text, text, len);
+    slot->len = len;
+    slot->level = level;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+    wake_writer();
+}
+
+/*
+ * Function reporting the repetitions of the last line of a call site that were suppressed.
+ */
+static void report_suppressed(log_site *site, int level) {
+    char text[LOG_LINE];
+    int len = snprintf(text, sizeof(text), "Last line repeated %lu more times.\n", site->suppressed);
+    queue_line(level, text, len);
+    site->suppressed = 0;
+}
+
+/*
+ * Function logging a line from a call site (see LOG()): once the site logged the same line LOG_BURST times
+ * in the current second, further repetitions are only counted, and reported before the next line it logs
+ * (different lines, e.g. of distinct clients, are never suppressed).
+ */
+void log_line(log_site *site, int level, const char *format, ...) {
+    if (!atomic_load_explicit(&running, memory_order_relaxed)) {
+        return;
+    }
+
+    char text[LOG_LINE];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (len < 0) {
+        return;
+    } else if (len >= LOG_LINE) {  // cut, but still ending the line
+        len = LOG_LINE - 1;
+        text[len - 1] = '\n';
+    }
+
+    // FNV-1a hash of the line, to tell repetitions apart
+    uint64_t hash = 14695981039346656037ull;
+    for (int i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)text[i]) * 1099511628211ull;
+    }
+
+    uint64_t second = now_ns() / 1000000000ull;
+    if (hash != site->hash || second != site->window) {
+        if (site->suppressed) {
+            report_suppressed(site, level);
+        }
+        site->hash = hash;
+        site->window = second;
+        site->count = 0;
+    }
+    if (site->count++ >= LOG_BURST) {
+        site->suppressed++;
+        atomic_fetch_add_explicit(&suppressed, 1, memory_order_relaxed);
+        return;
+    }
+
+    queue_line(level, text, len);
+}
+
+/*
+ * Function starting the writer thread; lines logged before are discarded. The lines still queued at exit
+ * are written out.
+ */
+void log_init(void) {
+    for (uint64_t i = 0; i < LOG_SLOTS; i++) {
+        atomic_init(&ring[i].seq, i);
+    }
+
+    wakefd = eventfd(0, EFD_CLOEXEC);
+    DIE(wakefd < 0, "eventfd");
+
+    int rc = pthread_create(&writer, NULL, run_writer, NULL);
+    DIE(rc != 0, "pthread_create");
+
+    atomic_store(&running, 1);
+    atexit(log_close);
+}
+
+/*
+ * Function waiting until the lines logged so far are written, so that output printed directly comes after
+ * them.
+ */
+void log_flush(void) {
+    if (!atomic_load(&running)) {
+        return;
+    }
+
+    uint64_t pos = atomic_load(&tail);
+    struct timespec pause = { 0, 100000 };
+    while (atomic_load_explicit(&head, memory_order_acquire) < pos) {
+        wake_writer();
+        nanosleep(&pause, NULL);
+    }
+}
+
+/*
+ * Function printing the counters of lines not logged.
+ */
+void log_stats(FILE *f) {
+    uint64_t d = atomic_load(&dropped), s = atomic_load(&suppressed);
+
+    if (d || s) {
+        fprintf(f, "Log: %lu lines dropped, %lu suppressed.\n", d, s);
+    }
+}
+
+/*
+ * Function stopping the writer thread, once it wrote all the lines queued.
+ */
+void log_close(void) {
+    if (!atomic_exchange(&running, 0)) {
+        return;
+    }
+
+    atomic_store(&stopping, 1);
+    uint64_t value = 1;
+    if (write(wakefd, &value, sizeof(value)) < 0) {
+        perror("log wakeup failed");
+    }
+    pthread_join(writer, NULL);
+    close(wakefd);
+}
+
+/*
+ * Function dropping the logger a forked process inherited, without the writer thread: the lines its parent
+ * had not written yet are left to the parent, and the process can start its own writer with log_init().
+ */
+void log_abandon(void) {
+    if (!atomic_exchange(&running, 0)) {
+        return;
+    }
+
+    close(wakefd);
+    wakefd = -1;
+    atomic_store(&head, 0);
+    atomic_store(&tail, 0);
+    atomic_store(&sleeping, 0);
+    atomic_store(&dropped, 0);
+    atomic_store(&suppressed, 0);
+}
@@ -0,0 +1,54 @@
+#ifndef _LOG_H
+#define _LOG_H 1
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define LOG_SLOTS 4096  // lines waiting for the writer thread (a power of 2)
+#define LOG_LINE 248  // longest line kept, terminator included; longer ones are cut
+#define LOG_BURST 100  // times a call site logs the same line per second, further repetitions are suppressed
+
+/*
+ * Severities of the logged lines: debug and info lines go to stdout, warnings and errors to stderr, with
+ * no prefix (the console output of the server is unchanged).
+ */
+enum {
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARN,
+    LOG_ERROR,
+};
+
+/*
+ * State of a call site of LOG(), limiting the repetitions of a line to LOG_BURST per second.
+ */
+typedef struct {
+    uint64_t hash;  // hash of the last line
+    uint64_t window;  // second (of the monotonic clock) the repetitions counted are from
+    uint32_t count;  // repetitions logged in that second
+    uint64_t suppressed;  // repetitions suppressed since the last line logged
+} log_site;
+
+/*
+ * Macro logging a line (formatted as by printf, the newline included) of a given severity, without waiting
+ * for the console: the line is only queued for the writer thread. Repetitions are rate limited per call site.
+ */
+#define LOG(level, ...)                                                        \
+  do {                                                                         \
+    static log_site _site;                                                     \
+    if ((level) >= log_level) {                                                \
+      log_line(&_site, (level), __VA_ARGS__);                                  \
+    }                                                                          \
+  } while (0)
+
+extern int log_level;  // lines of lower severity are not logged
+
+int parse_log_level(char *);
+void log_init(void);
+void log_line(log_site *, int, const char *, ...) __attribute__((format(printf, 3, 4)));
+void log_flush(void);
+void log_stats(FILE *);
+void log_close(void);
+void log_abandon(void);
+
+#endif
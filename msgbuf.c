@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "msgbuf.h"
+#include "wire.h"
+
+#define MIN_CLASS_SIZE 64  // capacity of the smallest size class; each class doubles the previous one
+#define NUM_CLASSES 6  // largest class holds 2048 bytes, enough for any message
+#define MAX_FREE 1024  // maximum number of buffers kept for reuse in each class
+
+static msgbuf *free_lists[NUM_CLASSES];
+static int free_count[NUM_CLASSES];
+
+
+/*
+ * Function returning a buffer with room for at least "len" bytes and a single reference; buffers are
+ * recycled through per size class free lists to keep allocation off the fan-out path.
+ */
+msgbuf *msgbuf_new(size_t len) {
+    uint8_t c = 0;
+    while (c < NUM_CLASSES - 1 && (size_t)(MIN_CLASS_SIZE << c) < len) {
+        c++;
+    }
+
+    msgbuf *b;
+    if ((size_t)(MIN_CLASS_SIZE << c) < len) {  // larger than any class, not recycled
+        b = (msgbuf *)malloc(sizeof(msgbuf) + len);
+        c = NUM_CLASSES;
+    } else if (free_lists[c]) {
+        b = free_lists[c];
+        free_lists[c] = b->next_free;
+        free_count[c]--;
+    } else {
+        b = (msgbuf *)malloc(sizeof(msgbuf) + (MIN_CLASS_SIZE << c));
+    }
+    if (!b) {
+        perror("bad alloc\n");
+        exit(EXIT_FAILURE);
+    }
+
+    b->refs = 1;
+    b->size_class = c;
+    b->len = len;
+    b->stamp = 0;
+    b->next_free = NULL;
+
+    return b;
+}
+
+/*
+ * Function taking a new reference to a buffer.
+ */
+void msgbuf_get(msgbuf *b) {
+    b->refs++;
+}
+
+/*
+ * Function dropping a reference to a buffer, releasing it when no references are left.
+ */
+void msgbuf_put(msgbuf *b) {
+    if (--b->refs > 0) {
+        return;
+    }
+
+    uint8_t c = b->size_class;
+    if (c < NUM_CLASSES && free_count[c] < MAX_FREE) {
+        b->next_free = free_lists[c];
+        free_lists[c] = b;
+        free_count[c]++;
+    } else {
+        free(b);
+    }
+}
+
+/*
+ * Function encoding a message for the TCP clients: the header, followed by the relevant bytes of the
+ * topic title and of the payload; returns a buffer holding a single reference.
+ */
+msgbuf *encode_message(message_info *info, char *topic, char *payload) {
+    msgbuf *b = msgbuf_new(sizeof(content_header) + info->topic_len + info->data_len);
+    encode_content_header((content_header *)b->data, info);
+    memcpy(b->data + sizeof(content_header), topic, info->topic_len);
+    memcpy(b->data + sizeof(content_header) + info->topic_len, payload, info->data_len);
+
+    return b;
+}
+
+/*
+ * Function encoding a control frame of a given type for the TCP clients: a header without source, the
+ * topic title it concerns and a body of "len" bytes; returns a buffer holding a single reference.
+ */
+msgbuf *encode_control(uint8_t type, char *title, void *body, int len) {
+    message_info info;
+    memset(&info, 0, sizeof(info));
+    info.data_len = len;
+    info.topic_len = strlen(title);
+    info.data_type = type;
+
+    msgbuf *b = encode_message(&info, title, body);
+    b->stamp = now_ns();
+    return b;
+}
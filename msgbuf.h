@@ -0,0 +1,29 @@
+#ifndef _MSGBUF_H
+#define _MSGBUF_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+/*
+ * Reference counted buffer holding an encoded message (exactly the bytes sent to a client); a message
+ * sent to several subscribers is encoded once and shared by all their output queues.
+ */
+typedef struct msgbuf {
+    int refs;
+    uint8_t size_class;  // index of the free list the buffer returns to
+    uint32_t len;  // number of used bytes in data
+    uint64_t stamp;  // moment (ns) the message was received, for measuring delivery latency
+    struct msgbuf *next_free;
+    char data[];
+} msgbuf;
+
+msgbuf *msgbuf_new(size_t);
+void msgbuf_get(msgbuf *);
+void msgbuf_put(msgbuf *);
+
+msgbuf *encode_message(message_info *, char *, char *);
+msgbuf *encode_control(uint8_t, char *, void *, int);
+
+#endif
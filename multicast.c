@@ -0,0 +1,264 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "multicast.h"
+#include "wire.h"
+
+int mcast_threshold = MCAST_THRESHOLD;
+
+static int mcast_fd = -1;  // socket the multicast datagrams are sent from
+static struct sockaddr_in base;  // first group topics are spread on, and the port of all groups
+static uint32_t next_group;  // number of topics given a group so far
+
+
+/*
+ * Function enabling multicast egress from a "<group>:<port>[:<interface ip>]" specification; returns
+ * 0 if the specification is invalid.
+ */
+int multicast_init(char *spec) {
+    char group[16], iface[16] = "";
+    uint16_t port;
+
+    if (sscanf(spec, "%15[0-9.]:%hu:%15[0-9.]", group, &port, iface) < 2 || !port) {
+        return 0;
+    }
+
+    memset(&base, 0, sizeof(base));
+    base.sin_family = AF_INET;
+    base.sin_port = htons(port);
+    if (inet_pton(AF_INET, group, &base.sin_addr) <= 0 || !IN_MULTICAST(ntohl(base.sin_addr.s_addr))) {
+        return 0;
+    }
+
+    struct in_addr if_addr = { .s_addr = htonl(INADDR_ANY) };
+    if (iface[0] && inet_pton(AF_INET, iface, &if_addr) <= 0) {
+        return 0;
+    }
+
+    mcast_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    DIE(mcast_fd < 0, "bad socket");
+
+    // keep the datagrams on the local network, deliver them to subscribers on this host too and send
+    // them through the given interface, if any (127.0.0.1 for testing over loopback)
+    uint8_t ttl = 1, loop = 1;
+    if (setsockopt(mcast_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0)
+        perror("setsockopt(IP_MULTICAST_TTL) failed");
+    if (setsockopt(mcast_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0)
+        perror("setsockopt(IP_MULTICAST_LOOP) failed");
+    if (iface[0] && setsockopt(mcast_fd, IPPROTO_IP, IP_MULTICAST_IF, &if_addr, sizeof(if_addr)) < 0)
+        perror("setsockopt(IP_MULTICAST_IF) failed");
+
+    return 1;
+}
+
+/*
+ * Function checking whether multicast egress is enabled.
+ */
+int multicast_enabled(void) {
+    return mcast_fd >= 0;
+}
+
+/*
+ * Function closing the multicast socket.
+ */
+void multicast_close(void) {
+    if (mcast_fd >= 0) {
+        close(mcast_fd);
+        mcast_fd = -1;
+    }
+}
+
+/*
+ * Function sending an encoded frame to the group of a topic, under sequence number "seq".
+ */
+static void send_datagram(mcast_topic *m, uint32_t seq, msgbuf *b) {
+    uint32_t net_seq = htonl(seq);
+    struct iovec iov[2] = { { &net_seq, sizeof(net_seq) }, { b->data, b->len } };
+    struct sockaddr_in dest = base;
+    dest.sin_addr = m->group;
+
+    struct msghdr msg = {0};
+    msg.msg_name = &dest;
+    msg.msg_namelen = sizeof(dest);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    if (sendmsg(mcast_fd, &msg, MSG_DONTWAIT) < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        LOG(LOG_ERROR, "multicast send failed: %s\n", strerror(errno));  // lost like any datagram, subscribers ask for a repair
+    }
+}
+
+/*
+ * Function sending the heartbeat of a quiet topic that is due, under the sequence number of its last
+ * message, so that subscribers which lost the last messages ask for them; the heartbeats get further
+ * apart, each interval twice the previous one.
+ */
+static void multicast_heartbeat(void *data) {
+    topic *t = (topic *)data;
+    mcast_topic *m = t->mcast;
+
+    msgbuf *b = encode_control(CONTROL_HEARTBEAT, t->title, NULL, 0);
+    send_datagram(m, m->seq, b);
+    msgbuf_put(b);
+
+    if (--m->heartbeats) {
+        timer_start(&m->heartbeat, MCAST_HEARTBEAT << (MCAST_HEARTBEATS - m->heartbeats));
+    }
+}
+
+/*
+ * Function switching a topic to multicast; a topic keeps the group it was first given.
+ */
+void multicast_start(topic *t) {
+    if (!t->mcast) {
+        t->mcast = (mcast_topic *)calloc(1, sizeof(mcast_topic));
+        DIE(t->mcast == NULL, "bad alloc");
+        t->mcast->group.s_addr = htonl(ntohl(base.sin_addr.s_addr) + next_group++ % MCAST_GROUPS);
+        timer_init(&t->mcast->heartbeat, multicast_heartbeat, t);
+    }
+
+    t->mcast->active = 1;
+}
+
+/*
+ * Function switching a topic back to unicast; its subscribers were told the last sequence number, so no
+ * more heartbeats are needed.
+ */
+void multicast_stop(topic *t) {
+    t->mcast->active = 0;
+    t->mcast->heartbeats = 0;
+    timer_cancel(&t->mcast->heartbeat);
+}
+
+/*
+ * Function sending an encoded message of a multicast topic to its group, under the next sequence number,
+ * and keeping it for repairs.
+ */
+void multicast_send(topic *t, msgbuf *b) {
+    mcast_topic *m = t->mcast;
+    uint32_t seq = ++m->seq, slot = seq % MCAST_HISTORY;
+
+    if (m->history[slot]) {
+        msgbuf_put(m->history[slot]);
+    }
+    msgbuf_get(b);
+    m->history[slot] = b;
+    m->history_seq[slot] = seq;
+
+    send_datagram(m, seq, b);
+
+    // heartbeats follow the message once the topic goes quiet
+    m->heartbeats = MCAST_HEARTBEATS;
+    timer_start(&m->heartbeat, MCAST_HEARTBEAT);
+}
+
+/*
+ * Function encoding the control frame telling a subscriber that it receives a topic by multicast,
+ * starting with the message with sequence number "seq".
+ */
+msgbuf *announce_multicast(topic *t, uint32_t seq) {
+    multicast_announce body;
+    memset(&body, 0, sizeof(body));
+    inet_ntop(AF_INET, &t->mcast->group, body.group, sizeof(body.group));
+    body.port = ntohs(base.sin_port);
+    body.seq = seq;
+    encode_announce(&body);
+
+    return encode_control(CONTROL_MULTICAST, t->title, &body, sizeof(body));
+}
+
+/*
+ * Function encoding the control frame telling a subscriber that a topic went back to unicast, after the
+ * last message sent to the group.
+ */
+msgbuf *announce_unicast(topic *t) {
+    char body[sizeof(uint32_t)];
+    put_le32(body, t->mcast->seq);
+    return encode_control(CONTROL_UNICAST, t->title, body, sizeof(body));
+}
+
+/*
+ * Function handing to "send" (with "context") the repair frame of a range of lost messages.
+ */
+static void send_lost(topic *t, uint32_t first, uint32_t last, void (*send)(msgbuf *, void *), void *context) {
+    char lost[2 * sizeof(uint32_t)];
+    put_le32(lost, first);
+    put_le32(lost + sizeof(uint32_t), last);
+    msgbuf *r = encode_control(CONTROL_REPAIR, t->title, lost, sizeof(lost));
+    send(r, context);
+    msgbuf_put(r);
+}
+
+/*
+ * Function handing to "send" (with "context") the repair frames of the messages of a topic with sequence
+ * numbers from "first" to "last": each message still in the history, and ranges of lost messages.
+ */
+void multicast_repair(topic *t, uint32_t first, uint32_t last, void (*send)(msgbuf *, void *), void *context) {
+    mcast_topic *m = t->mcast;
+    char body[sizeof(uint32_t) + sizeof(content_header) + sizeof(((udp_packet *)0)->topic) +
+              sizeof(((udp_packet *)0)->payload)];
+
+    if (!m || !first || first > last || last > m->seq) {
+        return;
+    }
+
+    // messages older than the history are lost
+    uint32_t oldest = m->seq >= MCAST_HISTORY ? m->seq - MCAST_HISTORY + 1 : 1;
+    if (first < oldest) {
+        send_lost(t, first, last < oldest ? last : oldest - 1, send, context);
+        first = oldest;
+    }
+
+    int lost = 0;
+    uint32_t lost_first = 0;
+    for (uint64_t seq = first; seq <= last; seq++) {
+        uint32_t slot = seq % MCAST_HISTORY;
+        msgbuf *b = m->history_seq[slot] == seq ? m->history[slot] : NULL;
+        if (!b) {  // extend the current range of lost messages
+            if (!lost) {
+                lost = 1;
+                lost_first = seq;
+            }
+            continue;
+        }
+        if (lost) {
+            send_lost(t, lost_first, seq - 1, send, context);
+            lost = 0;
+        }
+
+        put_le32(body, seq);
+        memcpy(body + sizeof(uint32_t), b->data, b->len);
+        msgbuf *r = encode_control(CONTROL_REPAIR, t->title, body, sizeof(uint32_t) + b->len);
+        send(r, context);
+        msgbuf_put(r);
+    }
+    if (lost) {
+        send_lost(t, lost_first, last, send, context);
+    }
+}
+
+/*
+ * Function deallocating the multicast state of a topic.
+ */
+void multicast_free(topic *t) {
+    if (!t->mcast) {
+        return;
+    }
+
+    timer_cancel(&t->mcast->heartbeat);
+    for (int i = 0; i < MCAST_HISTORY; i++) {
+        if (t->mcast->history[i]) {
+            msgbuf_put(t->mcast->history[i]);
+        }
+    }
+    free(t->mcast);
+    t->mcast = NULL;
+}
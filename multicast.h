@@ -0,0 +1,46 @@
+#ifndef _MULTICAST_H
+#define _MULTICAST_H 1
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "msgbuf.h"
+#include "timer.h"
+
+#define MCAST_THRESHOLD 32  // default number of subscribers from which a topic is multicast
+#define MCAST_HISTORY 1024  // number of messages kept per multicast topic for repairs
+#define MCAST_GROUPS 256  // number of groups (consecutive addresses from the configured one) topics are spread on
+#define MCAST_HEARTBEAT 20  // ms after the last message of a topic before the first heartbeat
+#define MCAST_HEARTBEATS 5  // heartbeats sent after the last message, each interval twice the previous one
+
+/*
+ * Multicast state of a topic; once allocated it is kept (with its history) when the topic goes back
+ * to unicast, so that late repairs can still be served and sequence numbers keep increasing.
+ */
+typedef struct mcast_topic {
+    int active;  // 1 - the topic's messages are currently sent to the group
+    struct in_addr group;
+    uint32_t seq;  // sequence number of the last message sent to the group
+    msgbuf *history[MCAST_HISTORY];  // last messages sent, by sequence number modulo MCAST_HISTORY
+    uint32_t history_seq[MCAST_HISTORY];
+    int heartbeats;  // heartbeats still to be sent since the last message
+    timer heartbeat;  // next heartbeat
+} mcast_topic;
+
+extern int mcast_threshold;
+
+int multicast_init(char *);
+int multicast_enabled(void);
+void multicast_close(void);
+
+void multicast_start(topic *);
+void multicast_stop(topic *);
+void multicast_send(topic *, msgbuf *);
+
+msgbuf *announce_multicast(topic *, uint32_t);
+msgbuf *announce_unicast(topic *);
+void multicast_repair(topic *, uint32_t, uint32_t, void (*)(msgbuf *, void *), void *);
+void multicast_free(topic *);
+
+#endif
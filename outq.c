@@ -0,0 +1,280 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "common.h"
+#include "outq.h"
+
+#define MAX_IOV 64  // maximum number of queued messages handed to the kernel in one call
+
+size_t outq_backlog;
+latency_stats delivery_latency[NUM_PRIORITIES];
+
+static outq_entry *free_entries;  // recycled queue cells
+
+
+/*
+ * Function initialising an empty output queue.
+ */
+void outq_init(outq *q) {
+    for (int c = 0; c < NUM_PRIORITIES; c++) {
+        q->fifo[c].head = NULL;
+        q->fifo[c].tail = NULL;
+    }
+    q->partial = -1;
+    q->offset = 0;
+    q->skipped = 0;
+    q->bytes = 0;
+    q->ring = NULL;
+}
+
+/*
+ * Function recording the delivery latency of a message of a given class, handed to the kernel at "now".
+ */
+static void record_latency(int priority, msgbuf *b, uint64_t now) {
+    latency_stats *l = &delivery_latency[priority];
+    uint64_t ns = now > b->stamp ? now - b->stamp : 0;
+
+    l->count++;
+    l->total_ns += ns;
+    if (ns > l->max_ns) {
+        l->max_ns = ns;
+    }
+    l->hist[ns ? 63 - __builtin_clzll(ns) : 0]++;
+}
+
+/*
+ * Function appending a message (from a given offset) to the FIFO of its class, taking a reference to it.
+ */
+static void push(outq *q, msgbuf *b, int priority, size_t offset, uint64_t now) {
+    outq_entry *e = free_entries;
+    if (e) {
+        free_entries = e->next;
+    } else {
+        e = (outq_entry *)malloc(sizeof(outq_entry));
+        DIE(e == NULL, "bad alloc");
+    }
+
+    msgbuf_get(b);
+    e->buf = b;
+    e->queued = now;
+    e->next = NULL;
+
+    outq_fifo *f = &q->fifo[priority];
+    if (f->tail) {
+        f->tail->next = e;
+    } else {
+        f->head = e;
+    }
+    f->tail = e;
+
+    if (offset) {
+        q->partial = priority;
+        q->offset = offset;
+    }
+    q->bytes += b->len - offset;
+    outq_backlog += b->len - offset;
+}
+
+/*
+ * Function removing the first message of the FIFO of a class.
+ */
+static void pop(outq *q, int priority) {
+    outq_fifo *f = &q->fifo[priority];
+    outq_entry *e = f->head;
+    size_t left = e->buf->len - (q->partial == priority ? q->offset : 0);
+
+    f->head = e->next;
+    if (!f->head) {
+        f->tail = NULL;
+    }
+    if (q->partial == priority) {
+        q->partial = -1;
+        q->offset = 0;
+    }
+    q->bytes -= left;
+    outq_backlog -= left;
+
+    msgbuf_put(e->buf);
+    e->next = free_entries;
+    free_entries = e;
+}
+
+/*
+ * Function handing bytes to the kernel through the socket, or writing them to the shared memory ring
+ * of a local subscriber; behaves like a non-blocking sendmsg(). A local subscriber that corrupted its
+ * ring is disconnected: its socket is shut down, and the event loop closes the connection as if the
+ * subscriber had left.
+ */
+static ssize_t transmit(outq *q, int sockfd, struct iovec *iov, int n) {
+    if (q->ring) {
+        ssize_t rc = shm_ring_writev(q->ring, iov, n);
+        if (rc < 0 && errno == EPROTO) {
+            shutdown(sockfd, SHUT_RDWR);
+            errno = EPROTO;
+        }
+        return rc;
+    }
+
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    return sendmsg(sockfd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/*
+ * Function sending a message of a given priority class through a connection without blocking; if
+ * other messages are still waiting or the socket buffer is full, the (rest of the) message is queued.
+ * Returns -1 if the connection failed, 0 if the message was sent entirely, 1 if (part of) it was queued.
+ */
+int outq_send(outq *q, int sockfd, msgbuf *b, int priority) {
+    size_t sent = 0;
+    uint64_t now = now_ns();
+
+    if (!q->bytes) {  // nothing waiting, try sending directly
+        struct iovec iov = { .iov_base = b->data, .iov_len = b->len };
+        ssize_t rc = transmit(q, sockfd, &iov, 1);
+        if (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            return -1;
+        }
+        if (rc == (ssize_t)b->len) {
+            record_latency(priority, b, now);
+            return 0;
+        }
+        sent = rc > 0 ? rc : 0;
+    }
+
+    push(q, b, priority, sent, now);
+    return 1;
+}
+
+/*
+ * Function choosing the class whose messages are sent next, and how many of them may be sent at once:
+ * a partially sent message is always finished first; otherwise the highest class with waiting messages,
+ * unless a lower class message is starved and its turn has come, in which case only that one is sent.
+ */
+static int next_class(outq *q, uint64_t now, int *batch) {
+    *batch = MAX_IOV;
+    if (q->partial >= 0) {
+        return q->partial;
+    }
+
+    int first = -1, starved = -1;
+    for (int c = 0; c < NUM_PRIORITIES; c++) {
+        outq_entry *head = q->fifo[c].head;
+        if (!head) {
+            continue;
+        }
+        if (first < 0) {
+            first = c;
+        } else if (starved < 0 && now - head->queued > STARVATION_NS) {
+            starved = c;
+        }
+    }
+
+    if (starved < 0) {
+        q->skipped = 0;
+        return first;
+    }
+    if (q->skipped >= STARVATION_RATIO) {
+        q->skipped = 0;
+        *batch = 1;
+        return starved;
+    }
+
+    *batch = STARVATION_RATIO - q->skipped;
+    return first;
+}
+
+/*
+ * Function sending as many queued messages as the socket accepts without blocking; returns -1 if the
+ * connection failed, 0 if the queue is now empty, 1 if messages are still waiting.
+ */
+int outq_flush(outq *q, int sockfd) {
+    while (q->bytes) {
+        uint64_t now = now_ns();
+        int batch;
+        int c = next_class(q, now, &batch);
+
+        struct iovec iov[MAX_IOV];
+        int n = 0;
+        for (outq_entry *e = q->fifo[c].head; e && n < batch; e = e->next, n++) {
+            size_t offset = n == 0 && q->partial == c ? q->offset : 0;
+            iov[n].iov_base = e->buf->data + offset;
+            iov[n].iov_len = e->buf->len - offset;
+        }
+
+        ssize_t rc = transmit(q, sockfd, iov, n);
+        if (rc < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return 1;
+            }
+            return -1;
+        }
+
+        // drop the messages sent entirely and advance into the first one sent partially
+        size_t left = rc;
+        for (int i = 0; i < n; i++) {
+            size_t len = iov[i].iov_len;
+            if (left < len) {
+                break;
+            }
+            left -= len;
+            record_latency(c, q->fifo[c].head->buf, now);
+            pop(q, c);
+            q->skipped++;
+        }
+        if (left) {
+            q->partial = c;
+            q->offset += left;
+            q->bytes -= left;
+            outq_backlog -= left;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Function dropping all messages from an output queue (when its connection is closed).
+ */
+void outq_clear(outq *q) {
+    for (int c = 0; c < NUM_PRIORITIES; c++) {
+        while (q->fifo[c].head) {
+            pop(q, c);
+        }
+    }
+}
+
+/*
+ * Function returning the latency (ns) under which a given fraction of the messages of a class were sent.
+ */
+static uint64_t percentile(latency_stats *l, double fraction) {
+    uint64_t target = l->count * fraction, seen = 0;
+    for (int i = 0; i < 64; i++) {
+        seen += l->hist[i];
+        if (seen > target) {
+            return 2ull << i;
+        }
+    }
+
+    return l->max_ns;
+}
+
+/*
+ * Function printing the delivery latency of each priority class.
+ */
+void print_latency_stats(FILE *f) {
+    for (int c = 0; c < NUM_PRIORITIES; c++) {
+        latency_stats *l = &delivery_latency[c];
+        if (!l->count) {
+            continue;
+        }
+        fprintf(f, "Class %d: %lu messages, latency avg %lu ns, p50 < %lu ns, p99 < %lu ns, max %lu ns.\n",
+                c, l->count, l->total_ns / l->count, percentile(l, 0.5), percentile(l, 0.99), l->max_ns);
+    }
+}
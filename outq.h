@@ -0,0 +1,64 @@
+#ifndef _OUTQ_H
+#define _OUTQ_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "common.h"
+#include "msgbuf.h"
+#include "shmring.h"
+
+#define STARVATION_NS 20000000ull  // time after which a waiting lower class message is considered starved
+#define STARVATION_RATIO 8  // starved messages get one turn for every STARVATION_RATIO higher class messages
+
+/*
+ * Cell of an output queue, referencing a message waiting to be sent.
+ */
+typedef struct outq_entry {
+    msgbuf *buf;
+    uint64_t queued;  // moment (ns) the message was queued
+    struct outq_entry *next;
+} outq_entry;
+
+/*
+ * FIFO of the waiting messages of one priority class.
+ */
+typedef struct {
+    outq_entry *head, *tail;
+} outq_fifo;
+
+/*
+ * Queue of messages not yet accepted by the kernel for a TCP connection; messages are sent without
+ * blocking, and whatever does not fit in the socket buffer waits here, in the FIFO of its priority
+ * class, until the socket is writable. Classes are drained highest first, but a lower class message
+ * that waited longer than STARVATION_NS is sent after at most STARVATION_RATIO higher class ones.
+ */
+typedef struct {
+    // read for every message sent, most of which do not wait
+    size_t bytes;  // number of bytes waiting in the queue
+    shm_ring *ring;  // shared memory ring messages are written to instead of the socket, for local subscribers
+    int partial;  // class whose first message was partially sent (and has to be finished first), -1 if none
+    unsigned skipped;  // higher class messages sent since a starved message was last given a turn
+    size_t offset;  // number of bytes of the partially sent message already sent
+    outq_fifo fifo[NUM_PRIORITIES];
+} outq;
+
+/*
+ * Delivery latency (from receiving a message to handing it to the kernel) of a priority class.
+ */
+typedef struct {
+    uint64_t count, total_ns, max_ns;
+    uint64_t hist[64];  // number of messages by log2 of their latency (ns)
+} latency_stats;
+
+extern size_t outq_backlog;  // total number of bytes waiting in all output queues
+extern latency_stats delivery_latency[NUM_PRIORITIES];
+
+void outq_init(outq *);
+int outq_send(outq *, int, msgbuf *, int);
+int outq_flush(outq *, int);
+void outq_clear(outq *);
+void print_latency_stats(FILE *);
+
+#endif
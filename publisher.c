@@ -0,0 +1,137 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "publisher.h"
+#include "wire.h"
+
+static publisher **publishers;  // connected publishers, indexed by socket
+static int capacity;
+
+
+/*
+ * Function allocating the state of a newly accepted publisher connection.
+ */
+publisher *open_publisher(int sockfd, struct sockaddr_in *addr) {
+    if (sockfd >= capacity) {
+        int new_capacity = capacity ? capacity : 64;
+        while (new_capacity <= sockfd) {
+            new_capacity <<= 1;
+        }
+
+        publishers = (publisher **)realloc(publishers, new_capacity * sizeof(publisher *));
+        DIE(publishers == NULL, "bad alloc");
+        memset(publishers + capacity, 0, (new_capacity - capacity) * sizeof(publisher *));
+        capacity = new_capacity;
+    }
+
+    publisher *p = (publisher *)calloc(1, sizeof(publisher));
+    DIE(p == NULL, "bad alloc");
+    p->socket = sockfd;
+    inet_ntop(AF_INET, &addr->sin_addr, p->ip, sizeof(p->ip));
+    p->port = ntohs(addr->sin_port);
+    p->data = (char *)malloc(PUBLISHER_BUFFER);
+    DIE(p->data == NULL, "bad alloc");
+    p->size = PUBLISHER_BUFFER;
+    publishers[sockfd] = p;
+
+    return p;
+}
+
+/*
+ * Function returning the state of the publisher with a given socket, NULL if there is none.
+ */
+publisher *get_publisher(int sockfd) {
+    if (sockfd < 0 || sockfd >= capacity) {
+        return NULL;
+    }
+
+    return publishers[sockfd];
+}
+
+/*
+ * Function reading from a publisher's socket, without blocking, as many bytes as fit in its buffer; the
+ * buffer grows to fit the batch it ends with. Returns the number of bytes read, 0 if the publisher closed
+ * the connection, -1 on failure (errno EAGAIN if there was nothing to read).
+ */
+int receive_batches(publisher *p) {
+    // move the unpublished bytes to the beginning of the buffer
+    if (p->start) {
+        memmove(p->data, p->data + p->start, p->len - p->start);
+        p->len -= p->start;
+        p->start = 0;
+    }
+
+    publish_batch hdr;
+    if (p->len >= sizeof(hdr)) {
+        memcpy(&hdr, p->data, sizeof(hdr));
+        decode_publish_batch(&hdr);
+        size_t needed = sizeof(hdr) + (hdr.len <= MAX_BATCH_LEN ? hdr.len : 0);
+        if (needed > p->size) {
+            p->data = (char *)realloc(p->data, needed);
+            DIE(p->data == NULL, "bad alloc");
+            p->size = needed;
+        }
+    }
+
+    ssize_t rc = recv(p->socket, p->data + p->len, p->size - p->len, MSG_DONTWAIT);
+    if (rc > 0) {
+        p->len += rc;
+    }
+
+    return rc;
+}
+
+/*
+ * Function taking the next complete batch out of a publisher's buffer: fills in its header and points
+ * "records" to its records, which stay valid until the next read. Returns 1 if a batch was taken, 0 if
+ * the next one is not complete yet, -1 if its header is invalid.
+ */
+int next_batch(publisher *p, publish_batch *hdr, char **records) {
+    if (p->len - p->start < sizeof(publish_batch)) {
+        return 0;
+    }
+    memcpy(hdr, p->data + p->start, sizeof(publish_batch));
+    decode_publish_batch(hdr);
+    if (hdr->len > MAX_BATCH_LEN) {
+        return -1;
+    }
+    if (p->len - p->start < sizeof(publish_batch) + hdr->len) {
+        return 0;
+    }
+
+    *records = p->data + p->start + sizeof(publish_batch);
+    p->start += sizeof(publish_batch) + hdr->len;
+
+    return 1;
+}
+
+/*
+ * Function deallocating the state of a closed publisher connection.
+ */
+void close_publisher(int sockfd) {
+    publisher *p = get_publisher(sockfd);
+    if (!p) {
+        return;
+    }
+
+    free(p->data);
+    free(p);
+    publishers[sockfd] = NULL;
+}
+
+/*
+ * Function deallocating the publisher table.
+ */
+void free_publishers(void) {
+    for (int i = 0; i < capacity; i++) {
+        close_publisher(i);
+    }
+
+    free(publishers);
+    publishers = NULL;
+    capacity = 0;
+}
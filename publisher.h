@@ -0,0 +1,32 @@
+#ifndef _PUBLISHER_H
+#define _PUBLISHER_H 1
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+#define PUBLISHER_BUFFER (256 << 10)  // initial size of a publisher's receive buffer
+
+/*
+ * State kept by the server for each connected TCP publisher, indexed by its socket: the bytes received
+ * and not yet published (bytes in [start, len) of the buffer), and the address its messages are shown
+ * as coming from.
+ */
+typedef struct {
+    int socket;
+    char ip[16];
+    uint16_t port;
+    char *data;
+    size_t start, len, size;
+} publisher;
+
+publisher *open_publisher(int, struct sockaddr_in *);
+publisher *get_publisher(int);
+int receive_batches(publisher *);
+int next_batch(publisher *, publish_batch *, char **);
+void close_publisher(int);
+void free_publishers(void);
+
+#endif
@@ -0,0 +1,230 @@
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "outq.h"
+#include "ratelimit.h"
+
+#define PROBE_WINDOW 8  // number of slots searched for a source before evicting the stalest one
+#define NS_PER_SEC 1000000000ull
+
+/*
+ * State kept for each UDP source (address and port) seen by the server.
+ */
+typedef struct {
+    uint32_t addr;  // network byte order
+    uint16_t port;  // network byte order
+    uint8_t used;
+    rate_bucket bucket;
+    uint64_t shed;  // datagrams dropped while the server was overloaded
+    uint32_t window;  // index (s) of the window the counter below refers to
+    uint32_t count, prev_count;  // datagrams received in the current and in the previous window
+} source_entry;
+
+rate_limit source_limit;
+rate_limit topic_limit;
+
+static source_entry *sources;  // open addressing table, never grows
+static size_t capacity;
+static uint64_t evicted;  // sources dropped from the table to make room for new ones
+
+static size_t soft_watermark = SOFT_WATERMARK, hard_watermark = HARD_WATERMARK;
+
+// datagrams and active sources in the current and in the previous window, used to compute fair shares
+static uint32_t window;
+static uint64_t total, prev_total;
+static uint32_t active, prev_active;
+
+
+/*
+ * Function parsing a rate limit given as "<rate>[:<burst>]" (the burst defaults to one second's worth
+ * of messages); returns 1 on success, 0 if the format is invalid.
+ */
+int parse_rate_limit(char *s, rate_limit *limit) {
+    char *end;
+    limit->rate = strtod(s, &end);
+    limit->burst = limit->rate;
+    if (*end == ':') {
+        limit->burst = strtod(end + 1, &end);
+    }
+
+    return end != s && *end == '\0' && limit->rate >= 0 && limit->burst >= 1;
+}
+
+/*
+ * Function taking a token from a bucket, refilling it first for the time passed since the last call;
+ * returns 1 if the message is allowed, 0 if it has to be dropped.
+ */
+int bucket_take(rate_bucket *b, rate_limit *limit, uint64_t now) {
+    if (limit->rate <= 0) {
+        b->passed++;
+        return 1;
+    }
+
+    if (!b->last) {  // new bucket starts full
+        b->tokens = limit->burst;
+    } else {
+        b->tokens += (double)(now - b->last) * limit->rate / NS_PER_SEC;
+        if (b->tokens > limit->burst) {
+            b->tokens = limit->burst;
+        }
+    }
+    b->last = now;
+
+    if (b->tokens < 1) {
+        b->dropped++;
+        return 0;
+    }
+
+    b->tokens -= 1;
+    b->passed++;
+    return 1;
+}
+
+/*
+ * Function allocating the table of UDP sources, able to track up to "max_sources" of them.
+ */
+void ratelimit_init(size_t max_sources) {
+    capacity = PROBE_WINDOW;
+    while (capacity < max_sources) {
+        capacity <<= 1;
+    }
+
+    sources = (source_entry *)calloc(capacity, sizeof(source_entry));
+    DIE(sources == NULL, "bad alloc");
+}
+
+/*
+ * Function setting the output backlog thresholds of the two overload levels.
+ */
+void set_overload_watermarks(size_t soft, size_t hard) {
+    soft_watermark = soft;
+    hard_watermark = hard;
+}
+
+/*
+ * Function returning the current overload level, based on the bytes waiting in the output queues.
+ */
+int overload_level(void) {
+    if (outq_backlog >= hard_watermark) {
+        return OVERLOAD_HARD;
+    }
+    if (outq_backlog >= soft_watermark) {
+        return OVERLOAD_SOFT;
+    }
+
+    return OVERLOAD_NONE;
+}
+
+/*
+ * Function returning the entry of a UDP source, creating it if needed; when the probed slots are all
+ * taken by other sources, the one that was idle the longest is replaced.
+ */
+static source_entry *get_source(uint32_t addr, uint16_t port) {
+    uint64_t h = ((uint64_t)addr << 16 | port) * 0x9e3779b97f4a7c15ull;
+    size_t mask = capacity - 1;
+    size_t i = (h >> 32) & mask;
+
+    source_entry *victim = NULL;
+    for (int n = 0; n < PROBE_WINDOW; n++, i = (i + 1) & mask) {
+        source_entry *s = &sources[i];
+        if (!s->used) {
+            victim = s;
+            break;
+        }
+        if (s->addr == addr && s->port == port) {
+            return s;
+        }
+        if (!victim || s->window < victim->window ||
+            (s->window == victim->window && s->bucket.last < victim->bucket.last)) {
+            victim = s;
+        }
+    }
+
+    if (victim->used) {
+        evicted++;
+    }
+    memset(victim, 0, sizeof(*victim));
+    victim->used = 1;
+    victim->addr = addr;
+    victim->port = port;
+
+    return victim;
+}
+
+/*
+ * Function updating the per window counters of a source and of all sources.
+ */
+static void count_datagram(source_entry *s, uint32_t w) {
+    if (w != window) {
+        prev_total = w == window + 1 ? total : 0;
+        prev_active = w == window + 1 ? active : 0;
+        total = 0;
+        active = 0;
+        window = w;
+    }
+
+    if (s->window != w) {
+        s->prev_count = s->window + 1 == w ? s->count : 0;
+        s->count = 0;
+        s->window = w;
+    }
+    if (!s->count++) {
+        active++;
+    }
+    total++;
+}
+
+/*
+ * Function checking if a source sends more than the average of all sources in the last window.
+ */
+static int heavy_source(source_entry *s) {
+    if (prev_active) {
+        return (uint64_t)s->prev_count * prev_active > prev_total;
+    }
+
+    return (uint64_t)s->count * active > total;
+}
+
+/*
+ * Function deciding if a datagram received from a given source, for a topic of a given priority class,
+ * is forwarded to subscribers, based on the rate limit of the source and on the current overload level;
+ * when overloaded, the lowest priority traffic is shed first.
+ */
+int admit_datagram(struct sockaddr_in *addr, uint64_t now, int priority) {
+    source_entry *s = get_source(addr->sin_addr.s_addr, addr->sin_port);
+    count_datagram(s, now / NS_PER_SEC);
+
+    int level = overload_level();
+    int shed = 0;
+    if (level == OVERLOAD_HARD) {
+        shed = priority > 0;
+    } else if (level == OVERLOAD_SOFT) {
+        shed = priority == NUM_PRIORITIES - 1 || (priority > 0 && heavy_source(s));
+    }
+    if (shed) {
+        s->shed++;
+        return ADMIT_SHED;
+    }
+
+    return bucket_take(&s->bucket, &source_limit, now) ? ADMIT_OK : ADMIT_RATE;
+}
+
+/*
+ * Function printing the counters of the sources that had datagrams dropped.
+ */
+void print_source_stats(FILE *f) {
+    fprintf(f, "Output backlog: %zu bytes, overload level %d, sources evicted: %lu.\n",
+            outq_backlog, overload_level(), evicted);
+
+    for (size_t i = 0; i < capacity; i++) {
+        source_entry *s = &sources[i];
+        if (s->used && (s->bucket.dropped || s->shed)) {
+            struct in_addr a = {s->addr};
+            fprintf(f, "Source %s:%hu: %lu passed, %lu over rate, %lu shed.\n", inet_ntoa(a),
+                    ntohs(s->port), s->bucket.passed, s->bucket.dropped, s->shed);
+        }
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef _RATELIMIT_H
+#define _RATELIMIT_H 1
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define MAX_SOURCES 65536  // default number of UDP sources tracked at the same time
+#define SOFT_WATERMARK (16 << 20)  // default output backlog (bytes) above which heavy sources are shed
+#define HARD_WATERMARK (64 << 20)  // default output backlog (bytes) above which all datagrams are shed
+
+/*
+ * Token bucket parameters: sustained number of messages per second and maximum burst.
+ */
+typedef struct {
+    double rate;  // 0 - unlimited
+    double burst;
+} rate_limit;
+
+/*
+ * Token bucket state, with counters of the messages it let through or dropped.
+ */
+typedef struct rate_bucket {
+    double tokens;
+    uint64_t last;  // moment (ns) of the last refill
+    uint64_t passed, dropped;
+} rate_bucket;
+
+/*
+ * Overload levels, depending on the number of bytes waiting in the output queues.
+ */
+enum {
+    OVERLOAD_NONE,
+    OVERLOAD_SOFT,  // shed the lowest class, and the middle classes from sources sending over their fair share
+    OVERLOAD_HARD,  // shed all classes but the highest one
+};
+
+/*
+ * Decisions taken for a received datagram.
+ */
+enum {
+    ADMIT_OK,
+    ADMIT_RATE,  // dropped, source over its rate limit
+    ADMIT_SHED,  // dropped, server overloaded
+};
+
+extern rate_limit source_limit;  // limit applied to each UDP source
+extern rate_limit topic_limit;  // limit applied to the messages published on each topic
+
+int parse_rate_limit(char *, rate_limit *);
+int bucket_take(rate_bucket *, rate_limit *, uint64_t);
+
+void ratelimit_init(size_t);
+void set_overload_watermarks(size_t, size_t);
+int overload_level(void);
+int admit_datagram(struct sockaddr_in *, uint64_t, int);
+void print_source_stats(FILE *);
+
+#endif
@@ -0,0 +1,129 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "rcu.h"
+
+/*
+ * Quiescent state of a reader, on a cache line of its own.
+ */
+typedef struct {
+    _Atomic int online;
+    _Atomic uint64_t seen;  // epoch at the reader's last quiescent state
+    char pad[64 - sizeof(int) - sizeof(uint64_t)];
+} rcu_reader;
+
+/*
+ * Object retired by the writer, freed once no reader can hold a reference to it.
+ */
+typedef struct retired {
+    void *p;
+    void (*free)(void *);
+    uint64_t epoch;  // epoch the object was retired at
+    struct retired *next;
+} retired;
+
+static _Atomic uint64_t epoch = 1;
+static rcu_reader readers[RCU_READERS];
+static __thread int reader = -1;  // slot of the calling thread, -1 if not a reader
+
+// objects retired and not freed yet, oldest first (kept by the writer)
+static retired *oldest, *newest;
+static uint64_t pending, since_reclaim;
+
+
+/*
+ * Function registering the calling thread as a reader; it holds no references until it reads a
+ * published structure.
+ */
+void rcu_register(void) {
+    for (int i = 0; i < RCU_READERS; i++) {
+        int offline = 0;
+        if (atomic_compare_exchange_strong(&readers[i].online, &offline, 1)) {
+            atomic_store(&readers[i].seen, atomic_load(&epoch));
+            reader = i;
+            return;
+        }
+    }
+
+    DIE(1, "too many rcu readers");
+}
+
+/*
+ * Function unregistering the calling thread as a reader, once it holds no more references.
+ */
+void rcu_unregister(void) {
+    if (reader >= 0) {
+        atomic_store(&readers[reader].online, 0);
+        reader = -1;
+    }
+}
+
+/*
+ * Function announcing that the calling reader holds no reference to the structures it read so far.
+ */
+void rcu_quiescent(void) {
+    if (reader >= 0) {
+        atomic_store(&readers[reader].seen, atomic_load(&epoch));
+    }
+}
+
+/*
+ * Function handing over an object the readers can no longer reach (after the structure replacing it was
+ * published), to be freed with "free" once they hold no reference to it either.
+ */
+void rcu_retire(void *p, void (*free_object)(void *)) {
+    retired *r = (retired *)malloc(sizeof(retired));
+    DIE(r == NULL, "bad alloc");
+    r->p = p;
+    r->free = free_object;
+    r->epoch = atomic_fetch_add(&epoch, 1) + 1;
+    r->next = NULL;
+
+    if (newest) {
+        newest->next = r;
+    } else {
+        oldest = r;
+    }
+    newest = r;
+    pending++;
+
+    if (++since_reclaim >= RCU_BATCH) {
+        rcu_reclaim();
+    }
+}
+
+/*
+ * Function freeing the retired objects no reader can hold a reference to anymore (all of them if there
+ * are no readers).
+ */
+void rcu_reclaim(void) {
+    uint64_t safe = UINT64_MAX;
+    for (int i = 0; i < RCU_READERS; i++) {
+        if (atomic_load(&readers[i].online)) {
+            uint64_t seen = atomic_load(&readers[i].seen);
+            if (seen < safe) {
+                safe = seen;
+            }
+        }
+    }
+
+    while (oldest && oldest->epoch <= safe) {
+        retired *r = oldest;
+        oldest = r->next;
+        r->free(r->p);
+        free(r);
+        pending--;
+    }
+    if (!oldest) {
+        newest = NULL;
+    }
+    since_reclaim = 0;
+}
+
+/*
+ * Function returning the number of retired objects not freed yet.
+ */
+uint64_t rcu_pending(void) {
+    return pending;
+}
@@ -0,0 +1,28 @@
+#ifndef _RCU_H
+#define _RCU_H 1
+
+#include <stdint.h>
+
+#define RCU_READERS 64  // threads that can read published structures at once
+#define RCU_BATCH 64  // objects retired between two attempts to reclaim them
+
+/*
+ * Quiescent-state-based reclamation of the versions of structures published to readers (the fan-out
+ * tables, see fanout.h): readers take no lock and only announce, between two batches of work, that they
+ * hold no reference to anything they read before (rcu_quiescent()); a writer replacing a structure
+ * retires the old version, which is freed once every reader has announced a quiescent state since.
+ *
+ * Each retirement advances a global epoch; a reader records the epoch it saw at its last quiescent state,
+ * and the objects retired at an epoch not above the smallest one recorded are freed. Threads which are
+ * not registered as readers (or no longer are) hold no references.
+ */
+
+void rcu_register(void);
+void rcu_unregister(void);
+void rcu_quiescent(void);
+
+void rcu_retire(void *, void (*)(void *));
+void rcu_reclaim(void);
+uint64_t rcu_pending(void);
+
+#endif
@@ -0,0 +1,304 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "common.h"
+
+#define MAX_FILTERS 64  // maximum number of topics replayed, when filtering
+#define MAX_REMAPS 64  // maximum number of source remapping rules
+#define MAX_SOCKETS 1024  // sockets opened for distinct sources; further sources share them
+
+/*
+ * Rule sending the datagrams of a captured source (port 0 - any port of the address) from a given local
+ * address and port (port 0 - an ephemeral one).
+ */
+typedef struct {
+    struct sockaddr_in from, to;
+} remap_rule;
+
+/*
+ * Source of captured datagrams and the socket replaying them.
+ */
+typedef struct {
+    uint32_t addr;
+    uint16_t port;
+    int fd;
+} source;
+
+static char *filters[MAX_FILTERS];
+static int filter_count;
+static remap_rule remaps[MAX_REMAPS];
+static int remap_count;
+static source sources[MAX_SOCKETS];
+static int source_count;
+static uint64_t shared;  // datagrams of sources sent through the socket of another one
+
+
+/*
+ * Function parsing "<ip>[:<port>]" into an address; returns 0 if invalid.
+ */
+static int parse_address(char *text, struct sockaddr_in *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+
+    char *sep = strchr(text, ':');
+    if (sep) {
+        *sep = '\0';
+        uint16_t port;
+        if (sscanf(sep + 1, "%hu", &port) != 1) {
+            return 0;
+        }
+        addr->sin_port = htons(port);
+    }
+
+    return inet_aton(text, &addr->sin_addr);
+}
+
+/*
+ * Function parsing a "<ip>[:<port>]=<ip>[:<port>]" remapping rule; returns 0 if invalid.
+ */
+static int parse_remap(char *text) {
+    char *sep = strchr(text, '=');
+    if (!sep || remap_count == MAX_REMAPS) {
+        return 0;
+    }
+    *sep = '\0';
+
+    remap_rule *rule = &remaps[remap_count++];
+    return parse_address(text, &rule->from) && parse_address(sep + 1, &rule->to);
+}
+
+/*
+ * Function checking whether a captured datagram is on one of the replayed topics.
+ */
+static int filtered(const char *data, int len) {
+    if (!filter_count) {
+        return 1;
+    }
+
+    if (len < (int)sizeof(((udp_packet *)0)->topic)) {  // too short to carry a topic, replayed as is
+        return 1;
+    }
+    for (int i = 0; i < filter_count; i++) {
+        if (strncmp(data, filters[i], sizeof(((udp_packet *)0)->topic)) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Function returning the socket replaying the datagrams of a captured source: one socket per source,
+ * bound as its first matching remapping rule requires (or to an ephemeral port), so that the server sees
+ * as many distinct publishers as were captured.
+ */
+static int source_socket(uint32_t addr, uint16_t port) {
+    for (int i = 0; i < source_count; i++) {
+        if (sources[i].addr == addr && sources[i].port == port) {
+            return sources[i].fd;
+        }
+    }
+
+    if (source_count == MAX_SOCKETS) {
+        shared++;
+        return sources[(addr ^ port) % MAX_SOCKETS].fd;
+    }
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    DIE(fd < 0, "socket");
+
+    for (int i = 0; i < remap_count; i++) {
+        if (remaps[i].from.sin_addr.s_addr == addr && (!remaps[i].from.sin_port || remaps[i].from.sin_port == port)) {
+            int enable = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+            int rc = bind(fd, (struct sockaddr *)&remaps[i].to, sizeof(remaps[i].to));
+            DIE(rc < 0, "bind");
+            break;
+        }
+    }
+
+    sources[source_count].addr = addr;
+    sources[source_count].port = port;
+    sources[source_count].fd = fd;
+    source_count++;
+
+    return fd;
+}
+
+/*
+ * Function positioning the capture file on the first record received at least "offset" ns after the first
+ * one, using the index to skip most of the records before it; returns the time of the first record.
+ */
+static uint64_t seek_records(FILE *f, char *path, uint64_t offset) {
+    capture_record rec;
+    long start = ftell(f);
+    if (fread(&rec, sizeof(rec), 1, f) != 1) {
+        return 0;
+    }
+    uint64_t first = rec.ns;
+    fseek(f, start, SEEK_SET);
+    if (!offset) {
+        return first;
+    }
+
+    // binary search of the last index entry not after the target time
+    char index_path[4096];
+    snprintf(index_path, sizeof(index_path), "%s.idx", path);
+    FILE *idx = fopen(index_path, "r");
+    if (idx) {
+        fseek(idx, 0, SEEK_END);
+        long count = ftell(idx) / sizeof(capture_index);
+        capture_index *entries = (capture_index *)malloc(count * sizeof(capture_index) + 1);
+        DIE(entries == NULL, "bad alloc");
+        fseek(idx, 0, SEEK_SET);
+        count = fread(entries, sizeof(capture_index), count, idx);
+        fclose(idx);
+
+        long lo = 0, hi = count - 1, found = -1;
+        while (lo <= hi) {
+            long mid = (lo + hi) / 2;
+            if (entries[mid].ns <= first + offset) {
+                found = mid;
+                lo = mid + 1;
+            } else {
+                hi = mid - 1;
+            }
+        }
+        if (found >= 0) {
+            fseek(f, entries[found].offset, SEEK_SET);
+        }
+        free(entries);
+    }
+
+    // skip the remaining records before the target time
+    char data[UINT16_MAX];
+    while (1) {
+        long pos = ftell(f);
+        if (fread(&rec, sizeof(rec), 1, f) != 1 || rec.ns >= first + offset) {
+            fseek(f, pos, SEEK_SET);
+            break;
+        }
+        if (rec.len && fread(data, rec.len, 1, f) != 1) {
+            break;
+        }
+    }
+
+    return first + offset;
+}
+
+/*
+ * Function sending the captured datagrams to the server, spaced as they were received divided by the
+ * speed factor (0 - as fast as possible).
+ */
+static void replay(FILE *f, uint64_t start, struct sockaddr_in *server, double speed) {
+    uint64_t sent = 0, skipped = 0, base = now_ns();
+    capture_record rec;
+    char data[UINT16_MAX];
+
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        if (rec.len && fread(data, rec.len, 1, f) != 1) {
+            fprintf(stderr, "Capture truncated.\n");
+            break;
+        }
+        if (!filtered(data, rec.len)) {
+            skipped++;
+            continue;
+        }
+
+        if (speed > 0 && rec.ns > start) {  // wait for the moment of the record, relative to the start
+            uint64_t due = base + (uint64_t)((rec.ns - start) / speed);
+            struct timespec ts = { due / 1000000000ull, due % 1000000000ull };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+        }
+
+        int fd = source_socket(rec.addr, rec.port);
+        if (sendto(fd, data, rec.len, 0, (struct sockaddr *)server, sizeof(*server)) < 0) {
+            perror("sendto");
+        }
+        sent++;
+    }
+
+    double elapsed = (now_ns() - base) / 1e9;
+    fprintf(stderr, "Replayed %lu datagrams from %d sources in %.3f s (%.0f/s), %lu filtered out.\n",
+            sent, source_count, elapsed, elapsed > 0 ? sent / elapsed : 0, skipped);
+    if (shared) {
+        fprintf(stderr, "%lu datagrams sent through the socket of another source.\n", shared);
+    }
+}
+
+
+int main(int argc, char *argv[]) {
+    // parse options: speed factor (or max), replayed topics, source remapping rules, start offset (s)
+    double speed = 1, offset = 0;
+    int opt, valid = 1;
+    while ((opt = getopt(argc, argv, "s:t:r:o:")) != -1) {
+        switch (opt) {
+            case 's':
+                if (strcmp(optarg, "max") == 0) {
+                    speed = 0;
+                } else {
+                    valid &= sscanf(optarg, "%lf", &speed) == 1 && speed > 0;
+                }
+                break;
+            case 't':
+                valid &= filter_count < MAX_FILTERS && strlen(optarg) <= 50;
+                if (valid) {
+                    filters[filter_count++] = optarg;
+                }
+                break;
+            case 'r':
+                valid &= parse_remap(optarg);
+                break;
+            case 'o':
+                valid &= sscanf(optarg, "%lf", &offset) == 1 && offset >= 0;
+                break;
+            default:
+                valid = 0;
+        }
+    }
+
+    // check number of arguments
+    if (argc - optind != 3 || !valid) {
+        fprintf(stderr, "\n Usage: ./replay <capture file> <server ip> <server port> [-s <speed factor>|max]"
+                        " [-t <topic>]... [-r <ip>[:<port>]=<local ip>[:<port>]]... [-o <start offset (s)>]\n");
+        return -1;
+    }
+    char *path = argv[optind];
+
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    uint16_t port;
+    DIE(sscanf(argv[optind + 2], "%hu", &port) != 1, "Given port is invalid");
+    server.sin_port = htons(port);
+    DIE(inet_aton(argv[optind + 1], &server.sin_addr) == 0, "Given ip is invalid");
+
+    FILE *f = fopen(path, "r");
+    DIE(f == NULL, "cannot open capture");
+    setvbuf(f, NULL, _IOFBF, 1 << 20);
+
+    capture_header hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC))) {
+        fprintf(stderr, "%s is not a capture file.\n", path);
+        return -1;
+    }
+
+    uint64_t start = seek_records(f, path, (uint64_t)(offset * 1e9));
+    replay(f, start, &server, speed);
+
+    fclose(f);
+    for (int i = 0; i < source_count; i++) {
+        close(sources[i].fd);
+    }
+
+    return 0;
+}
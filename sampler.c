@@ -0,0 +1,96 @@
+#include <stdlib.h>
+
+#include "connection.h"
+#include "sampler.h"
+
+uint64_t sampler_suppressed;
+
+
+/*
+ * Function sending a message to the subscriber of a sampled subscription, if connected, and closing the
+ * gate for an interval.
+ */
+static void pass(sampler *sm, msgbuf *b, int priority) {
+    subscriber *s = sm->sub->sub;
+    connection *c = s->connected ? get_connection(s->socket) : NULL;
+    if (c) {
+        outq_send(&c->out, s->socket, b, priority);
+        sm->passed++;
+    }
+
+    timer_start(&sm->gate, sm->interval);
+}
+
+/*
+ * Function called when the gate of a sampled subscription opens: the message held back, if any, is sent
+ * (closing the gate again); otherwise the next message goes through right away.
+ */
+static void open_gate(void *data) {
+    sampler *sm = (sampler *)data;
+
+    if (sm->latest) {
+        msgbuf *b = sm->latest;
+        sm->latest = NULL;
+        pass(sm, b, sm->priority);
+        msgbuf_put(b);
+    }
+}
+
+/*
+ * Function setting the minimum interval (ms) between two messages sent for a subscription, 0 to send all
+ * of them (dropping any message held back).
+ */
+void sampler_set(subscription *sub, uint32_t interval) {
+    sub->interval = interval;
+    if (!interval) {
+        sampler_free(sub);
+        return;
+    }
+
+    if (!sub->sampler) {
+        sub->sampler = (sampler *)calloc(1, sizeof(sampler));
+        DIE(sub->sampler == NULL, "bad alloc");
+        sub->sampler->sub = sub;
+        timer_init(&sub->sampler->gate, open_gate, sub->sampler);
+    }
+    sub->sampler->interval = interval;
+}
+
+/*
+ * Function offering a message of its topic to a sampled subscription: it is sent if the gate is open,
+ * held back (replacing the one held back before) otherwise.
+ */
+void sampler_offer(subscription *sub, msgbuf *b, int priority) {
+    sampler *sm = sub->sampler;
+
+    if (!timer_pending(&sm->gate)) {
+        pass(sm, b, priority);
+        return;
+    }
+
+    if (sm->latest) {
+        msgbuf_put(sm->latest);
+        sm->suppressed++;
+        sampler_suppressed++;
+    }
+    msgbuf_get(b);
+    sm->latest = b;
+    sm->priority = priority;
+}
+
+/*
+ * Function deallocating the throttling state of a subscription, dropping the message held back.
+ */
+void sampler_free(subscription *sub) {
+    sampler *sm = sub->sampler;
+    if (!sm) {
+        return;
+    }
+
+    timer_cancel(&sm->gate);
+    if (sm->latest) {
+        msgbuf_put(sm->latest);
+    }
+    free(sm);
+    sub->sampler = NULL;
+}
@@ -0,0 +1,30 @@
+#ifndef _SAMPLER_H
+#define _SAMPLER_H 1
+
+#include <stdint.h>
+
+#include "common.h"
+#include "msgbuf.h"
+#include "timer.h"
+
+/*
+ * Throttling state of a subscription limited to one message every "interval" ms: a message arriving
+ * while the gate is closed replaces the one held back (if any), which is sent once the gate opens, so
+ * the latest value of the topic always reaches the subscriber at most one interval late.
+ */
+typedef struct sampler {
+    uint32_t interval;  // ms
+    timer gate;  // pending while the subscriber may not get another message
+    msgbuf *latest;  // message held back until the gate opens
+    uint8_t priority;  // class it is sent in
+    uint64_t passed, suppressed;  // messages sent, messages replaced by a later one
+    subscription *sub;
+} sampler;
+
+extern uint64_t sampler_suppressed;  // messages suppressed by all the sampled subscriptions
+
+void sampler_set(subscription *, uint32_t);
+void sampler_offer(subscription *, msgbuf *, int);
+void sampler_free(subscription *);
+
+#endif
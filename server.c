@@ -1,5 +1,6 @@
 #include <arpa/inet.h>
 #include <errno.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <poll.h>
@@ -7,54 +8,46 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include "aggregate.h"
+#include "capture.h"
 #include "common.h"
+#include "connection.h"
+#include "database.h"
+#include "fanout.h"
+#include "history.h"
 #include "list.h"
+#include "log.h"
+#include "msgbuf.h"
+#include "multicast.h"
+#include "publisher.h"
+#include "rcu.h"
+#include "sampler.h"
+#include "ratelimit.h"
+#include "shard.h"
+#include "snapshot.h"
+#include "timer.h"
+#include "wire.h"
 
 #define MAX_CONNECTIONS 50  // maximum simultaneous TCP connections, used as "listen" call argument
+#define SEND_BUFFER 65536  // default kernel send buffer of subscriber sockets; messages waiting beyond it
+                           // stay in the output queues, where they are ordered by priority class; also
+                           // the size of the shared memory ring of a local subscriber
 
-// subscribers and topics stored in the server
-list subscribers;
-list topics;
+#define FIRST_CONNECTION 3  // position of the first poll structure after stdin and the TCP / UDP sockets
+                           // (the ring of datagrams fed by the supervisor, in shard mode)
 
+int send_buffer = SEND_BUFFER;
+static uint64_t heartbeat_interval, idle_timeout;  // ms, 0 - disabled
+static unsigned long idle_evicted;  // connections closed for being idle
 
-/*
- * Function comparing 2 subscribers based on the socket they are connected to.
- */
-int equal_socket(void *a, void *b) {
-    subscriber *s1 = (subscriber *)a;
-    subscriber *s2 = (subscriber *)b;
-
-    return s1->socket == s2->socket;
-}
-
-/*
- * Function comparing a the subscriber associated to a subscription and a second subscriber based on
- * the socket they are connected to.
- */
-int equal_socket_sub(void *a, void *b) {
-    subscription *sub = (subscription *)a;
-    subscriber *s = (subscriber *)b;
+static struct pollfd *poll_fds;  // descriptors polled by the server
+static int num_fds, max_fds;  // current and allocated number of poll structures
 
-    return sub->sub->socket == s->socket;
-}
-
-/*
- * Function checking if a given subscriber id already exists in the current database; returns a pointer
- * to said subscriber if found, and NULL if not.
- */
-subscriber *already_exists(char *id) {
-    for (list p = subscribers; p != NULL; p = p->next) {
-        subscriber *s = (subscriber *)p->info;
-        if (strcmp(s->id, id) == 0) {
-            return s;
-        }
-    }
-
-    return NULL;
-}
 
 /*
  * Function removing the subscriber connected to the given socket from the list of subscribers.
@@ -63,7 +56,7 @@ void remove_subscriber(int sockfd) {
     for (list p = subscribers; p != NULL; p = p->next) {
         subscriber *s = (subscriber *)p->info;
         if (s->socket == sockfd) {
-            remove_from_list(&subscribers, s, equal_socket);
+            remove_shell(s);  // with the subscriptions made before logging in
             return;
         }
     }
@@ -81,25 +74,42 @@ void replace(int sockfd, subscriber *original) {
             memcpy(original->ip, s->ip, sizeof(s->ip));
             original->port = s->port;
 
-            remove_from_list(&subscribers, s, equal_socket);
+            remove_shell(s);
             return;
         }
     }
 }
 
 /*
- * Function that sends any stored messages the subscriber pointed to by *s may have when reconnecting.
+ * Function sending an encoded message to a connected subscriber without blocking; whatever the socket
+ * does not accept right away waits in the output queue of its connection, in the given priority class.
+ */
+void deliver(subscriber *s, msgbuf *b, int priority) {
+    connection *c = get_connection(s->socket);
+    if (c) {
+        outq_send(&c->out, s->socket, b, priority);
+    }
+}
+
+/*
+ * Function that sends any stored messages the subscriber pointed to by *s may have when reconnecting,
+ * highest priority class first (in the order they were received within a class).
  */
 void get_stored_messages(subscriber *s) {
-    for (list p = s->stored_messages; p != NULL; p = p->next) {
-        stored_message *message = (stored_message *)p->info;
-        content_header *hdr = &message->hdr;
-        send_all(s->socket, hdr, sizeof(content_header));
-        send_all(s->socket, message->topic, hdr->topic_len);
-        send_all(s->socket, message->payload, hdr->data_len);
+    for (int c = 0; c < NUM_PRIORITIES; c++) {
+        for (list p = s->stored_messages; p != NULL; p = p->next) {
+            stored_message *message = (stored_message *)p->info;
+            if (message->priority != c) {
+                continue;
+            }
+            msgbuf *b = encode_message(&message->hdr, message->topic, message->payload);
+            deliver(s, b, c);
+            msgbuf_put(b);
+        }
     }
 
-    free_list(&s->stored_messages, free);
+    journal_flush(s);
+    free_stored_messages(s);
 }
 
 /*
@@ -107,17 +117,20 @@ void get_stored_messages(subscriber *s) {
  * 1 if succsefull registration occured, -1 in case of any error.
  */
 int register_subscriber(int sockfd, char *id) {
-    subscriber *s = already_exists(id);
+    subscriber *s = find_subscriber(id);
 
     if (s) {  // given id already exists in the current list of subscribers
         if (s->connected) {  // client with given id is connected
-            printf("Client %s already connected.\n", id);
+            LOG(LOG_INFO, "Client %s already connected.\n", id);
             return 0;
         } else {  // client with given id is reconnecting
             replace(sockfd, s);
             s->connected = 1;
+            s->session++;
             s->socket = sockfd;
-            printf("New client %s connected from %s:%hu.\n", id, s->ip, s->port);
+            get_connection(sockfd)->sub = s;
+            fanout_refresh(s);  // messages of its topics are sent to it again
+            LOG(LOG_INFO, "New client %s connected from %s:%hu.\n", id, s->ip, s->port);
             get_stored_messages(s);  // get any messages missed when disconnected
             return 1;
         }
@@ -128,8 +141,11 @@ int register_subscriber(int sockfd, char *id) {
         s = (subscriber *)p->info;
         if (s->socket == sockfd) {
             s->connected = 1;
-            memcpy(s->id, id, strlen(id) + 1);
-            printf("New client %s connected from %s:%hu.\n", id, s->ip, s->port);
+            s->session++;
+            fanout_refresh(s);
+            index_subscriber(s, id);
+            journal_subscriber(s);
+            LOG(LOG_INFO, "New client %s connected from %s:%hu.\n", id, s->ip, s->port);
             return 1;
         }
     }
@@ -147,7 +163,8 @@ void disconnect_subscriber(int sockfd) {
         if (s->socket == sockfd) {
             s->connected = 0;
             s->socket = -1;
-            printf("Client %s disconnected.\n", s->id);
+            fanout_refresh(s);  // messages of its topics are stored for it, or dropped
+            LOG(LOG_INFO, "Client %s disconnected.\n", s->id);
             return;
         }
     }
@@ -158,66 +175,71 @@ void disconnect_subscriber(int sockfd) {
  * given socket.
  */
 subscriber *get_subscriber(int sockfd) {
-    for (list p = subscribers; p != NULL; p = p->next) {
-        subscriber *s = (subscriber *)p->info;
-        if (s->socket == sockfd) {
-            return s;
-        }
-    }
+    connection *c = get_connection(sockfd);
 
-    return NULL;
+    return c ? c->sub : NULL;
 }
 
 /*
- * Function checking if the subscriber pointed to by *sub is already subscribed to a specific topic
- * identified by its subscription list; returns a pointer to the corresponding subscription structure
- * if found, NULL if not.
+ * Function subscribing a subscriber to a topic; "sf" holds the store-and-forward option and the requested
+ * priority class, and "interval" the minimum ms between two messages, as encoded in subscribe_packet.
  */
-subscription *already_subscribed(list subscriptions, subscriber *sub) {
-    for (list p = subscriptions; p != NULL; p = p->next) {
-        subscription *s = (subscription *)p->info;
-        if (strcmp(s->sub->id, sub->id) == 0) {
-            return s;
+void subscribe_topic(subscriber *s, char *title, uint8_t sf, uint32_t interval) {
+    uint8_t priority = (sf >> PRIORITY_SHIFT) & PRIORITY_MASK;
+    if (priority > NUM_PRIORITIES) {
+        priority = 0;
+    }
+    sf &= SF_MASK | MULTICAST_FLAG;
+    if (interval) {  // a sampled subscription gets its messages by unicast, the group carries all of them
+        sf &= ~MULTICAST_FLAG;
+    }
+
+    // allocate and add to the topics list a new topic structure if the topic is newly introduced
+    topic *t = find_topic(title);
+    if (!t) {
+        t = add_topic(title);
+    }
+
+    subscription *existing = find_subscription(s, t);
+    if (existing) {  // if subscriber is already subscribed to the topic, update its sf value and class
+        if (existing->mcast_session == s->session && !(sf & MULTICAST_FLAG)) {
+            // the subscriber received the topic by multicast and no longer wants to
+            msgbuf *b = announce_unicast(t);
+            deliver(s, b, subscription_priority(t, existing));
+            msgbuf_put(b);
+            existing->mcast_session = 0;
         }
+        update_subscription(existing, sf, priority, interval);
+    } else {
+        add_subscription(t, s, sf, priority, interval);  // add new subscrition to subscription list
     }
 
-    return NULL;
+    journal_subscribe(s, title, sf, priority, interval);
 }
 
 /*
- * Function registering a new subscription in the server's database. 
+ * Function registering a new subscription in the server's database.
  */
-void register_subscription(int sockfd, char *title, uint8_t sf) {
-    // allocate new subscription structure with given info
-    subscription *new = (subscription *)calloc(1, sizeof(subscription));
-    DIE(new == NULL, "bad alloc");
-    new->sub = get_subscriber(sockfd);
-    new->sf = sf;
-
-    // check if topic with given title already exists
-    for (list p = topics; p != NULL; p = p->next) {
-        topic *t = (topic *)p->info;
-        if (strcmp(t->title, title) == 0) {
-            subscription *existing = already_subscribed(t->subs, new->sub);
-            if (existing) {  // if subscriber is already subscribed to the topic, update its sf value
-                existing->sf = sf;
-                free(new);
-            } else {
-                insert_in_list(&t->subs, new);  // add new subscrition to subscription list
-            }
+void register_subscription(int sockfd, char *title, uint8_t sf, uint32_t interval) {
+    subscriber *s = get_subscriber(sockfd);
+    subscribe_topic(s, title, sf, interval);
+    LOG(LOG_DEBUG, "Client %s subscribed to %s.\n", s->id, title);
+}
 
-            return;
-        }
+/*
+ * Function removing the subscription of a subscriber from the subscription list of a given topic;
+ * returns 0 if there is no such topic or the subscriber is not subscribed to it.
+ */
+int unsubscribe_topic(subscriber *s, char *title) {
+    topic *t = find_topic(title);
+    subscription *sub = t ? find_subscription(s, t) : NULL;
+    if (!sub) {
+        return 0;
     }
 
-    // allocate and add to the topics list a new topic structure if the topic is newly introduced
-    topic *new_topic = (topic *)calloc(1, sizeof(topic));
-    DIE(new_topic == NULL, "bad alloc");
-    memcpy(new_topic->title, title, strlen(title) + 1);
-    new_topic->subs = NULL;
-    insert_in_list(&new_topic->subs, new);
-
-    insert_in_list(&topics, new_topic);
+    remove_subscription(sub);
+    journal_unsubscribe(s, title);
+    return 1;
 }
 
 /* 
@@ -225,15 +247,143 @@ void register_subscription(int sockfd, char *title, uint8_t sf) {
  * subscription list of a given topic.
  */
 void register_unsubscription(int sockfd, char *title) {
-    for (list p = topics; p != NULL; p = p->next) {
-        topic *t = (topic *)p->info;
-        if (strcmp(t->title, title) == 0) {
-            remove_from_list(&t->subs, get_subscriber(sockfd), equal_socket_sub);
-            return;
+    subscriber *s = get_subscriber(sockfd);
+    if (unsubscribe_topic(s, title)) {
+        LOG(LOG_DEBUG, "Client %s unsubscribed from %s.\n", s->id, title);
+    }
+}
+
+/*
+ * Function answering a bulk request or a login applying a profile, with the number of subscriptions
+ * made or removed.
+ */
+void send_ack(subscriber *s, uint8_t type, char *name, uint32_t count) {
+    bulk_ack ack = { type, count };
+    encode_bulk_ack(&ack);
+    msgbuf *b = encode_control(CONTROL_ACK, name, &ack, sizeof(ack));
+    deliver(s, b, 0);
+    msgbuf_put(b);
+}
+
+/*
+ * Function handling a bulk subscribe (type 5) or unsubscribe (type 6) request of "len" bytes of entries,
+ * received on the given socket: the subscriber is looked up once, the entries are applied in order and a
+ * single acknowledgement is sent. Returns 0 if the request is malformed (the entries before the malformed
+ * one are applied, and no acknowledgement is sent).
+ */
+int register_bulk(int sockfd, uint8_t type, char *entries, int len) {
+    subscriber *s = get_subscriber(sockfd);
+    char *pos = entries, *end = entries + len;
+    char title[51];
+    uint32_t count = 0;
+    bulk_entry e;
+
+    while (pos < end) {
+        if (end - pos < (long)sizeof(e)) {
+            break;
+        }
+        memcpy(&e, pos, sizeof(e));
+        if (!e.topic_len || e.topic_len >= sizeof(title) || end - pos - (long)sizeof(e) < e.topic_len) {
+            break;
         }
+        pos += sizeof(e);
+        memcpy(title, pos, e.topic_len);
+        title[e.topic_len] = '\0';
+        pos += e.topic_len;
+
+        if (type == 5) {
+            subscribe_topic(s, title, e.sf, 0);
+            count++;
+        } else {
+            count += unsubscribe_topic(s, title);
+        }
+    }
+
+    if (pos != end) {
+        return 0;
+    }
+
+    send_ack(s, type, "", count);
+    return 1;
+}
+
+/*
+ * Function applying a subscription profile to a subscriber that just logged in, adding the client's
+ * options ("sf") to each subscription, and acknowledging it.
+ */
+void apply_profile(subscriber *s, char *name, uint8_t sf) {
+    profile *p = find_profile(name);
+    if (!p) {
+        LOG(LOG_WARN, "Unknown profile %s requested by client %s.\n", name, s->id);
+        send_ack(s, 0, name, 0);
+        return;
+    }
+
+    for (int i = 0; i < p->count; i++) {
+        subscribe_topic(s, p->entries[i].topic, p->entries[i].sf | (sf & MULTICAST_FLAG),
+                        p->entries[i].interval);
+    }
+    send_ack(s, 0, name, p->count);
+}
+
+/*
+ * Function sending a repair frame to the subscriber given as context, in the highest priority class (the
+ * subscriber holds back the later messages of the topic until the gap is filled).
+ */
+void send_repair(msgbuf *b, void *context) {
+    deliver((subscriber *)context, b, 0);
+}
+
+/*
+ * Function answering a subscriber's request to repair the messages of a multicast topic it did not
+ * receive, over its TCP connection.
+ */
+void register_nack(int sockfd, nack_packet *nack) {
+    nack->topic[sizeof(nack->topic) - 1] = '\0';
+    topic *t = find_topic(nack->topic);
+    subscriber *s = get_subscriber(sockfd);
+
+    if (t && s) {
+        multicast_repair(t, nack->first, nack->last, send_repair, s);
     }
 }
 
+/*
+ * Subscriber a history request is answered to, and the class the answer is sent in.
+ */
+typedef struct {
+    subscriber *s;
+    int priority;
+} history_target;
+
+/*
+ * Function sending a frame of the answer to a history request to the subscriber given as context.
+ */
+void send_history(msgbuf *b, void *context) {
+    history_target *target = (history_target *)context;
+    deliver(target->s, b, target->priority);
+}
+
+/*
+ * Function answering a subscriber's request for the last messages of a topic, over its TCP connection,
+ * in the class of its subscription to the topic (the topic's class if not subscribed), so that the
+ * messages are not overtaken by the live ones.
+ */
+void register_history(int sockfd, history_packet *request) {
+    request->topic[sizeof(request->topic) - 1] = '\0';
+    topic *t = find_topic(request->topic);
+    history_target target = { get_subscriber(sockfd), t ? t->priority : DEFAULT_PRIORITY };
+    if (!target.s) {
+        return;
+    }
+
+    subscription *sub = t ? find_subscription(target.s, t) : NULL;
+    if (sub) {
+        target.priority = subscription_priority(t, sub);
+    }
+    history_replay(request->topic, request->mode, request->value, send_history, &target);
+}
+
 /*
  * Function returning the number of relevant bytes in payload (the content of a message received from a
  * UDP client) based on the type of data transmitted.
@@ -253,44 +403,391 @@ int get_payload_length(int type, char *payload) {
     return 0;
 }
 
+/*
+ * Function switching a topic back to unicast, telling the subscribers receiving it by multicast after
+ * which message the group is left.
+ */
+void stop_multicast(topic *t) {
+    msgbuf *b = announce_unicast(t);
+    for (list q = t->subs; q != NULL; q = q->next) {
+        subscription *sub = (subscription *)q->info;
+        if (sub->sub->connected && sub->mcast_session == sub->sub->session) {
+            deliver(sub->sub, b, subscription_priority(t, sub));
+        }
+        sub->mcast_session = 0;
+    }
+    msgbuf_put(b);
+
+    multicast_stop(t);
+}
+
+/*
+ * Function encoding a message of a topic, received at moment "now", and sending it to the topic's
+ * subscribers (or storing it for the disconnected ones with store-and-forward enabled).
+ */
+void publish_message(topic *t, message_info *info, char *payload, uint64_t now) {
+    msgbuf *b = encode_message(info, t->title, payload);  // encoded once for all subscribers
+    b->stamp = now;
+
+    // switch the topic between unicast and multicast by the number of subscribers able to receive it by
+    // multicast (counted at the previous message), going back to unicast below half the threshold
+    if (multicast_enabled()) {
+        int active = t->mcast && t->mcast->active;
+        if (!active && t->mcast_count >= (uint32_t)mcast_threshold) {
+            multicast_start(t);
+        } else if (active && t->mcast_count < (uint32_t)mcast_threshold / 2) {
+            stop_multicast(t);
+        }
+    }
+    mcast_topic *m = t->mcast && t->mcast->active ? t->mcast : NULL;
+    if (m) {
+        multicast_send(t, b);  // sent once to the group
+    }
+
+    fanout_table *f = fanout_read(t);  // as last published, not changed while it is read
+    uint32_t capable = 0;
+    for (uint32_t i = 0; f && i < f->count; i += FANOUT_CHUNK) {  // go through the connected subscribers
+        fanout_chunk *k = f->chunk[i / FANOUT_CHUNK];
+        uint32_t n = f->count - i < FANOUT_CHUNK ? f->count - i : FANOUT_CHUNK;
+
+        for (uint32_t j = 0; j < n; j++) {
+            if (j + FANOUT_PREFETCH < n) {
+                __builtin_prefetch(k->conns[j + FANOUT_PREFETCH]);
+            }
+            if (k->flags[j] & FANOUT_SAMPLED) {  // sent now or held back, at most one per interval
+                sampler_offer(k->subs[j], b, k->priority[j]);
+                continue;
+            }
+            if (k->flags[j] & MULTICAST_FLAG) {
+                subscription *sub = k->subs[j];
+                capable++;
+                if (m && sub->mcast_session == sub->sub->session) {
+                    continue;  // received through the group
+                }
+                if (m) {  // tell the subscriber to join the group, this message still comes by unicast
+                    msgbuf *a = announce_multicast(t, m->seq + 1);
+                    deliver(sub->sub, a, k->priority[j]);
+                    msgbuf_put(a);
+                    sub->mcast_session = sub->sub->session;
+                }
+            }
+
+            connection *c = k->conns[j];
+            if (c) {  // send header and relevant payload bytes
+                outq_send(&c->out, c->socket, b, k->priority[j]);
+            }
+        }
+    }
+
+    // allocate and add the message to the stored_messages list of each disconnected subscriber with
+    // store-and-forward enabled
+    for (uint32_t i = 0; f && i < f->stored_count; i++) {
+        subscription *sub = f->stored[i];
+        stored_message *new = (stored_message *)calloc(1, sizeof(stored_message));
+        DIE(new == NULL, "bad alloc");
+
+        new->hdr = *info;
+        new->priority = subscription_priority(t, sub);
+        memcpy(new->topic, t->title, info->topic_len);
+        memcpy(new->payload, payload, info->data_len);
+
+        store_message(sub->sub, new);
+        journal_store(sub->sub, new);
+    }
+    t->mcast_count = capable;
+
+    if (history_enabled()) {
+        history_add(t, b);
+    }
+    aggregate_feed(t, info->data_type, payload);  // windows of the topics derived from this one
+    msgbuf_put(b);
+}
+
+/*
+ * Function enforcing the publish quota of a topic (-q), if any; returns 0 if the message is over quota
+ * and has to be dropped.
+ */
+static int within_quota(topic *t, uint64_t now) {
+    if (topic_limit.rate <= 0) {
+        return 1;
+    }
+    if (!t->quota) {
+        t->quota = (rate_bucket *)calloc(1, sizeof(rate_bucket));
+        DIE(t->quota == NULL, "bad alloc");
+    }
+
+    return bucket_take(t->quota, &topic_limit, now);
+}
+
 /*
  * Function used to format a received UDP message as the established format for the TCP messages to clients,
  * and send the newly formed message.
  */
 void send_messages(udp_packet received, struct sockaddr_in cli_addr) {
-    content_header info;  // create meta data structure for new message
+    uint64_t now = now_ns();
+    message_info info;  // create meta data structure for new message
     info.data_len = get_payload_length(received.data_type, received.payload);
-    info.topic_len = strlen(received.topic);
+    info.topic_len = strnlen(received.topic, sizeof(received.topic));
 
     char *ip = inet_ntoa(cli_addr.sin_addr);
     memcpy(info.ip, ip, sizeof(info.ip));
     info.port = ntohs(cli_addr.sin_port);
     info.data_type = received.data_type;
 
-    char *topic_title = received.topic;
-    for (list p = topics; p != NULL; p = p->next) {  // find topic given by the received title in the topic list
+    char topic_title[sizeof(received.topic) + 1];  // received title is not terminated if it has 50 characters
+    memcpy(topic_title, received.topic, info.topic_len);
+    topic_title[info.topic_len] = '\0';
+
+    topic *t = find_topic(topic_title);  // find topic given by the received title in the topic index
+
+    // drop datagrams from sources over their rate limit, or shed them by priority class if overloaded
+    if (admit_datagram(&cli_addr, now, t ? t->priority : DEFAULT_PRIORITY) != ADMIT_OK || !t) {
+        return;
+    }
+    if (!within_quota(t, now)) {
+        return;
+    }
+
+    publish_message(t, &info, received.payload, now);
+}
+
+/*
+ * Function publishing the records of a batch received from a TCP publisher, with the same semantics as
+ * the UDP messages; the topic is looked up once for consecutive records of the same topic. Returns 0 if
+ * the batch is malformed (the records before the malformed one are published).
+ *
+ * The records are subject to the publish quotas of their topics, but not to the rate limits of the UDP
+ * sources nor to shedding: the event loop stops reading from publishers while the server is overloaded,
+ * so their messages are held back (in their socket buffers, then by their blocked sends) instead of
+ * dropped.
+ */
+int publish_batch_records(publisher *p, publish_batch *hdr, char *records) {
+    uint64_t now = now_ns();
+    char *pos = records, *end = records + hdr->len;
+    char title[sizeof(((topic *)0)->title)] = "";
+    size_t title_len = 0;
+    topic *t = NULL;
+    publish_record rec;
+    message_info info;
+
+    memcpy(info.ip, p->ip, sizeof(info.ip));
+    info.port = p->port;
+
+    for (int i = 0; i < hdr->count; i++) {
+        if ((size_t)(end - pos) < sizeof(rec)) {
+            return 0;
+        }
+        memcpy(&rec, pos, sizeof(rec));
+        decode_publish_record(&rec);
+        pos += sizeof(rec);
+
+        if (rec.topic_len) {  // look the topic up unless it is the previous one again
+            if (rec.topic_len >= sizeof(title) || end - pos < rec.topic_len) {
+                return 0;
+            }
+            if (title_len != rec.topic_len || memcmp(title, pos, rec.topic_len)) {
+                memcpy(title, pos, rec.topic_len);
+                title[rec.topic_len] = '\0';
+                title_len = rec.topic_len;
+                t = find_topic(title);
+            }
+            pos += rec.topic_len;
+        } else if (!title_len) {
+            return 0;
+        }
+
+        // the payload has the fixed length of its type, or is a string of at most 1500 bytes
+        int len = rec.data_type == 3 ? rec.data_len : get_payload_length(rec.data_type, pos);
+        if (rec.data_type > 3 || rec.data_len != len || rec.data_len > sizeof(((udp_packet *)0)->payload) ||
+            end - pos < rec.data_len) {
+            return 0;
+        }
+
+        if (t && within_quota(t, now)) {
+            info.topic_len = title_len;
+            info.data_len = rec.data_len;
+            info.data_type = rec.data_type;
+            publish_message(t, &info, pos, now);
+        }
+        pos += rec.data_len;
+    }
+
+    return pos == end;
+}
+
+/*
+ * Function printing the counters of dropped messages (per UDP source and per topic) and the delivery
+ * latency of each priority class.
+ */
+void print_stats(void) {
+    log_flush();  // after the lines logged so far
+    log_stats(stderr);
+    print_source_stats(stderr);
+    print_latency_stats(stderr);
+    capture_stats(stderr);
+    if (idle_timeout) {
+        fprintf(stderr, "Idle connections closed: %lu.\n", idle_evicted);
+    }
+    if (shard_count) {
+        shard_stats(stderr);
+    }
+    fprintf(stderr, "Routing: %lu fan-out tables published, %lu replaced objects not reclaimed yet.\n",
+            fanout_published, rcu_pending());
+    if (sampler_suppressed) {
+        fprintf(stderr, "Sampled subscriptions: %lu messages suppressed.\n", sampler_suppressed);
+    }
+
+    for (list p = topics; p != NULL; p = p->next) {
         topic *t = (topic *)p->info;
-        if (strcmp(t->title, topic_title) == 0) {
-            for (list q = t->subs; q != NULL; q = q->next) {  // go through all subscriptions of the topic
-                subscription *sub = (subscription *)q->info;
-                if (sub->sub->connected) {  // if subscriber is connected, send header and relevand payload bytes
-                    send_all(sub->sub->socket, &info, sizeof(info));
-                    send_all(sub->sub->socket, received.topic, info.topic_len);
-                    send_all(sub->sub->socket, received.payload, info.data_len);
-                } else if (sub->sf) {  // if subscriber is disconnected but has store-and-forward enabled, 
-                                       // allocate and add new message to its stored_messages list
-                    stored_message *new = (stored_message *)calloc(1, sizeof(stored_message));
-                    DIE(new == NULL, "bad alloc");
-
-                    memcpy(&new->hdr, &info, sizeof(info));
-                    memcpy(new->topic, topic_title, info.topic_len);
-                    memcpy(new->payload, received.payload, info.data_len);
-
-                    insert_in_list(&sub->sub->stored_messages, new);
-                }
+        if (t->quota && t->quota->dropped) {
+            fprintf(stderr, "Topic %s: %lu passed, %lu over quota.\n", t->title, t->quota->passed,
+                    t->quota->dropped);
+        }
+
+        if (t->aggregate) {
+            fprintf(stderr, "Topic %s: %lu results published.\n", t->title, t->aggregate->published);
+        }
+
+        // messages sent to and suppressed for the topic's sampled subscribers
+        uint64_t passed = 0, suppressed = 0;
+        for (list q = t->subs; q != NULL; q = q->next) {
+            subscription *sub = (subscription *)q->info;
+            if (sub->sampler) {
+                passed += sub->sampler->passed;
+                suppressed += sub->sampler->suppressed;
             }
+        }
+        if (suppressed) {
+            fprintf(stderr, "Topic %s: %lu sampled messages sent, %lu suppressed.\n", t->title, passed,
+                    suppressed);
+        }
+    }
+}
 
-            return;
+/*
+ * Function reading from a publisher's connection and publishing the complete batches received; returns 0
+ * if the connection has to be closed (closed by the publisher, or a malformed batch was received).
+ */
+int receive_publisher(publisher *p) {
+    publish_batch hdr;
+    char *records;
+
+    int rc = receive_batches(p);
+    if (rc <= 0) {
+        return rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+    }
+
+    while ((rc = next_batch(p, &hdr, &records)) > 0) {
+        if (!publish_batch_records(p, &hdr, records)) {
+            break;
+        }
+    }
+    if (rc) {
+        LOG(LOG_WARN, "Malformed batch from publisher %s:%hu.\n", p->ip, p->port);
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Function adding a descriptor to the poll structures, growing them if needed.
+ */
+void watch_fd(int fd) {
+    if (num_fds == max_fds) {
+        max_fds = max_fds ? 2 * max_fds : MAX_CONNECTIONS + 4;
+        poll_fds = (struct pollfd *)realloc(poll_fds, max_fds * sizeof(struct pollfd));
+        DIE(poll_fds == NULL, "bad alloc");
+    }
+
+    poll_fds[num_fds].fd = fd;
+    poll_fds[num_fds].events = POLLIN;
+    poll_fds[num_fds].revents = 0;
+    num_fds++;
+}
+
+/*
+ * Function removing the poll structure at a given position.
+ */
+void unwatch_fd(int i) {
+    for (int j = i; j < num_fds - 1; j++) {
+        poll_fds[j] = poll_fds[j + 1];
+    }
+
+    num_fds--;
+}
+
+/*
+ * Function closing a subscriber connection and dropping its state; the poll structure of the eventfd of
+ * a local subscriber's ring is disabled here and removed at the next iteration. The fan-out tables
+ * without the connection are published at once.
+ */
+void drop_connection(int sockfd) {
+    connection *c = get_connection(sockfd);
+    if (c && c->ring) {
+        for (int j = FIRST_CONNECTION; j < num_fds; j++) {
+            if (poll_fds[j].fd == c->ring->space_fd) {
+                poll_fds[j].fd = -1;
+            }
+        }
+    }
+
+    close(sockfd);
+    close_connection(sockfd);
+
+    // the published fan-out tables still hold the freed connection, and a timer run before the end of
+    // the iteration (an aggregate's window closing) may publish through them
+    fanout_publish();
+}
+
+/*
+ * Function closing the subscriber connection polled at a given position, the subscriber being
+ * disconnected (or dropped, if it never logged in).
+ */
+void close_subscriber(int i) {
+    int sockfd = poll_fds[i].fd;
+    connection *c = get_connection(sockfd);
+
+    if (c->sub->connected) {
+        disconnect_subscriber(sockfd);
+    } else {
+        remove_subscriber(sockfd);  // "shell" subscriber
+    }
+    drop_connection(sockfd);
+    unwatch_fd(i);
+}
+
+/*
+ * Function sending a heartbeat frame to the subscriber of a connection, in the highest priority class;
+ * clients answer it with a heartbeat request, so a live subscriber is never idle for long.
+ */
+void send_heartbeat(void *data) {
+    connection *c = (connection *)data;
+    if (c->sub && c->sub->connected) {
+        msgbuf *b = encode_control(CONTROL_HEARTBEAT, "", NULL, 0);
+        deliver(c->sub, b, 0);
+        msgbuf_put(b);
+    }
+
+    timer_start(&c->heartbeat, heartbeat_interval);
+}
+
+/*
+ * Function closing a connection nothing was received on for the idle timeout (a peer that went away
+ * without closing it, or never logged in), as if the subscriber had disconnected.
+ */
+void evict_idle(void *data) {
+    connection *c = (connection *)data;
+    int sockfd = c->socket;
+
+    LOG(LOG_WARN, "Connection from %s:%hu idle for %lu ms, closed.\n", c->sub->ip, c->sub->port,
+          idle_timeout);
+    idle_evicted++;
+
+    for (int i = FIRST_CONNECTION; i < num_fds; i++) {
+        if (poll_fds[i].fd == sockfd) {
+            close_subscriber(i);
+            break;
         }
     }
 }
@@ -308,19 +805,124 @@ void add_subscriber_structure(int newsockfd, struct sockaddr_in cli_addr) {
     new_subscriber->socket = newsockfd;
     new_subscriber->stored_messages = NULL;
     insert_in_list(&subscribers, new_subscriber);
+
+    connection *c = open_connection(newsockfd);
+    c->sub = new_subscriber;
+
+    // send heartbeats and watch for idleness, if enabled
+    if (heartbeat_interval) {
+        timer_init(&c->heartbeat, send_heartbeat, c);
+        timer_start(&c->heartbeat, heartbeat_interval);
+    }
+    if (idle_timeout) {
+        timer_init(&c->idle, evict_idle, c);
+        timer_start(&c->idle, idle_timeout);
+    }
+}
+
+/*
+ * Function accepting a local subscriber on the Unix domain socket and handing it the shared memory ring
+ * its messages are delivered through (login and subscriptions then follow on the socket, as over TCP).
+ */
+void accept_local(int localfd) {
+    int newsockfd = accept(localfd, NULL, NULL);
+    DIE(newsockfd < 0, "accept");
+
+    // local subscribers are shown as connected from the loopback address
+    struct sockaddr_in cli_addr;
+    memset(&cli_addr, 0, sizeof(cli_addr));
+    cli_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    add_subscriber_structure(newsockfd, cli_addr);
+
+    connection *c = get_connection(newsockfd);
+    if (open_ring(c, send_buffer) < 0 || shm_ring_send_fds(newsockfd, c->ring) < 0) {
+        LOG(LOG_ERROR, "local subscriber setup failed: %s\n", strerror(errno));
+        remove_subscriber(newsockfd);
+        close(newsockfd);
+        close_connection(newsockfd);
+        return;
+    }
+
+    watch_fd(newsockfd);
+    watch_fd(c->ring->space_fd);
+}
+
+/*
+ * Function handling the login request of "len" bytes received on the connection polled at a given
+ * position; in shard mode, the connection of a subscriber of another shard is handed off to the worker
+ * owning it. Returns 0 if the connection is no longer polled here.
+ */
+int receive_login(int i, connect_packet *connect, int len) {
+    int sockfd = poll_fds[i].fd;
+
+    if (shard_count && shard_owner(connect->id) != shard_index) {
+        int owner = shard_owner(connect->id);
+        if (shard_handoff(owner, sockfd, connect, len) < 0) {
+            LOG(LOG_WARN, "Handoff of client %s to shard %d failed: %s\n", connect->id, owner, strerror(errno));
+        }
+
+        // the owner holds its own descriptor of the socket, this one is closed
+        remove_subscriber(sockfd);
+        drop_connection(sockfd);
+        unwatch_fd(i);
+        return 0;
+    }
+
+    int rc = register_subscriber(sockfd, connect->id);
+    if (!rc) {
+        // remove "shell" subscriber structure from subscriber list and close the connection if client
+        // tried to login with an aready existing active id
+        remove_subscriber(sockfd);
+        drop_connection(sockfd);
+        unwatch_fd(i);
+        return 0;
+    } else if (rc > 0 && len > (int)sizeof(connect->id)) {
+        apply_profile(get_subscriber(sockfd), connect->profile, connect->sf);
+    }
+
+    return 1;
+}
+
+/*
+ * Function receiving a subscriber connection handed off by another worker, with the login request it
+ * sent there, as if it was accepted and the login received here.
+ */
+void receive_handoff(void) {
+    connect_packet connect;
+    int len;
+
+    int newsockfd = shard_accept(&connect, &len);
+    if (newsockfd < 0) {
+        return;
+    }
+
+    struct sockaddr_in cli_addr;
+    socklen_t cli_len = sizeof(cli_addr);
+    if (getpeername(newsockfd, (struct sockaddr *)&cli_addr, &cli_len) < 0) {  // closed meanwhile
+        close(newsockfd);
+        return;
+    }
+
+    // the send buffer is sized here as for a connection accepted here, not left to the sending worker
+    if (setsockopt(newsockfd, SOL_SOCKET, SO_SNDBUF, &send_buffer, sizeof(int)) < 0)
+        LOG(LOG_ERROR, "setsockopt(SO_SNDBUF) failed: %s\n", strerror(errno));
+
+    watch_fd(newsockfd);
+    add_subscriber_structure(newsockfd, cli_addr);
+    receive_login(num_fds - 1, &connect, len);
 }
 
 /*
  * Function containing the main logic and multiplexing of the server's functionality.
  */
-void run_server(int listenfd, int udpfd) {
-    struct pollfd poll_fds[MAX_CONNECTIONS + 3];
-    int num_fds = 3;  // current number of poll structures 
+void run_server(int listenfd, int udpfd, int localfd, int pubfd) {
     int rc;
     request_header received_tcp;
     connect_packet connect;
     subscribe_packet subscribe;
     unsubscribe_packet unsubscribe;
+    nack_packet nack;
+    history_packet history_request;
     udp_packet received_udp;
     char buff[256];
 
@@ -329,35 +931,120 @@ void run_server(int listenfd, int udpfd) {
     DIE(rc < 0, "bad listen");
 
     // add stdin as first file descriptor to track
-    poll_fds[0].fd = 0;
-    poll_fds[0].events = POLLIN;
+    watch_fd(0);
 
     // add pollfd for listening socket for TCP connections
-    poll_fds[1].fd = listenfd;
-    poll_fds[1].events = POLLIN;
+    watch_fd(listenfd);
+
+    // add pollfd for listening socket for UDP connections (in shard mode, for the eventfd of the ring the
+    // supervisor writes the datagrams to)
+    watch_fd(udpfd);
+
+    // add pollfd for the Unix domain socket local subscribers connect to, if any
+    if (localfd >= 0) {
+        rc = listen(localfd, MAX_CONNECTIONS);
+        DIE(rc < 0, "bad listen");
+        watch_fd(localfd);
+    }
 
-    // add pollfd for listening socket for UDP connections
-    poll_fds[2].fd = udpfd;
-    poll_fds[2].events = POLLIN;
+    // add pollfd for the listening socket for TCP publishers, if any
+    if (pubfd >= 0) {
+        rc = listen(pubfd, MAX_CONNECTIONS);
+        DIE(rc < 0, "bad listen");
+        watch_fd(pubfd);
+    }
+
+    // add pollfd for the socket the logins of this shard received by other workers are handed off to
+    int handofffd = shard_count ? shard_handoff_fd() : -1;
+    if (handofffd >= 0) {
+        watch_fd(handofffd);
+    }
+
+    // the event loop publishes messages through the fan-out tables as a reader; it is also the only
+    // writer, publishing the tables changed by each event it handles
+    rcu_register();
+    fanout_publish();  // restored or configured before
 
     while (1) {  // wait for events
-        rc = poll(poll_fds, num_fds, -1);
+        for (int i = FIRST_CONNECTION; i < num_fds; i++) {
+            if (poll_fds[i].fd < 0) {  // eventfd of a closed local connection
+                unwatch_fd(i--);
+                continue;
+            }
+
+            // also wait for subscriber sockets to become writable while they have messages queued (local
+            // subscribers signal the eventfd of their ring instead)
+            connection *c = get_connection(poll_fds[i].fd);
+            poll_fds[i].events = POLLIN;
+            if (c && c->socket == poll_fds[i].fd && !c->ring && c->out.bytes) {
+                poll_fds[i].events |= POLLOUT;
+            }
+
+            // stop reading from publishers while the output queues are over the soft watermark: their
+            // socket buffers fill up and they are held back instead of having their messages dropped
+            if (get_publisher(poll_fds[i].fd) && overload_level() != OVERLOAD_NONE) {
+                poll_fds[i].events = 0;
+            }
+        }
+
+        // wake up when a snapshot of the server's state or a timer (heartbeat, idle connection) is due,
+        // even if no other event occurs
+        int timeout = snapshot_timeout(), next_timer = timers_timeout();
+        if (next_timer >= 0 && (timeout < 0 || next_timer < timeout)) {
+            timeout = next_timer;
+        }
+        if (shard_count && shard_feed_pending()) {  // datagrams left from the last batch
+            timeout = 0;
+        }
+        rc = poll(poll_fds, num_fds, timeout);
         DIE(rc < 0, "bad poll");
 
+        // in shard mode, datagrams are taken from the ring in batches, whether or not the eventfd was
+        // signalled (the supervisor only signals a worker that waits)
+        if (shard_count) {
+            shard_feed_drain(send_messages);
+            fanout_publish();
+        }
+
         for (int i = 0; i < num_fds; i++) {
-            if (poll_fds[i].revents & POLLIN) {
+            if (poll_fds[i].fd < 0) {  // disabled during this iteration
+                continue;
+            }
+
+            if (poll_fds[i].revents & POLLOUT) {  // send queued messages, as much as the socket accepts
+                connection *c = get_connection(poll_fds[i].fd);
+                if (c) {
+                    outq_flush(&c->out, c->socket);
+                }
+            }
+
+            // a closed stdin only reports POLLHUP, even if the last lines are still to be read
+            if (poll_fds[i].revents & (POLLIN | (poll_fds[i].fd == 0 ? POLLHUP : 0))) {
+                connection *c = get_connection(poll_fds[i].fd);
+
                 if (poll_fds[i].fd == 0) {  // event from stdin
-                    fgets(buff, sizeof(buff), stdin);
+                    if (!fgets(buff, sizeof(buff), stdin)) {
+                        poll_fds[i].fd = -1;  // end of input, stop polling stdin
+                        continue;
+                    }
                     
                     char *command = strtok(buff, " \n");
 
                     // if exit is typed from stdin, stop server
                     if (command && strcmp(command, "exit") == 0) {
                         for (int j = 0; j < num_fds; j++) {
-                            close(poll_fds[j].fd);
+                            c = get_connection(poll_fds[j].fd);
+                            if (poll_fds[j].fd >= 0 && (!c || c->socket == poll_fds[j].fd)) {
+                                close(poll_fds[j].fd);  // ring eventfds are closed with their connection
+                            }
                         }
                         return;
                     }
+
+                    // print drop counters to stderr (stdout is left to the client messages)
+                    if (command && strcmp(command, "stats") == 0) {
+                        print_stats();
+                    }
                 } else if (poll_fds[i].fd == listenfd) {  // event from listening socket for TCP connections
                     struct sockaddr_in cli_addr;
                     socklen_t cli_len = sizeof(cli_addr);
@@ -365,67 +1052,182 @@ void run_server(int listenfd, int udpfd) {
                     int newsockfd = accept(listenfd, (struct sockaddr *)&cli_addr, &cli_len);
                     DIE(newsockfd < 0, "accept");
 
+                    // keep the kernel buffer small, so that a backlog builds up in the priority queues
+                    if (setsockopt(newsockfd, SOL_SOCKET, SO_SNDBUF, &send_buffer, sizeof(int)) < 0)
+                        LOG(LOG_ERROR, "setsockopt(SO_SNDBUF) failed: %s\n", strerror(errno));
+
                     // add new socket to pollfd structure
-                    poll_fds[num_fds].fd = newsockfd;
-                    poll_fds[num_fds].events = POLLIN;
-                    num_fds++;
+                    watch_fd(newsockfd);
 
                     add_subscriber_structure(newsockfd, cli_addr);
+                } else if (poll_fds[i].fd == localfd) {  // event from the socket for local subscribers
+                    accept_local(localfd);
+                } else if (poll_fds[i].fd == pubfd) {  // event from the listening socket for publishers
+                    struct sockaddr_in pub_addr;
+                    socklen_t pub_len = sizeof(pub_addr);
+                    int newsockfd = accept(pubfd, (struct sockaddr *)&pub_addr, &pub_len);
+                    DIE(newsockfd < 0, "accept");
+
+                    watch_fd(newsockfd);
+                    open_publisher(newsockfd, &pub_addr);
+                } else if (get_publisher(poll_fds[i].fd)) {  // batches of messages from a publisher
+                    if (!receive_publisher(get_publisher(poll_fds[i].fd))) {
+                        close(poll_fds[i].fd);
+                        close_publisher(poll_fds[i].fd);
+                        unwatch_fd(i--);
+                    }
+                } else if (poll_fds[i].fd == udpfd && shard_count) {  // the supervisor wrote datagrams
+                    uint64_t count;
+                    if (read(udpfd, &count, sizeof(count)) < 0) {
+                        LOG(LOG_ERROR, "ring eventfd read failed: %s\n", strerror(errno));
+                    }
+                } else if (poll_fds[i].fd == handofffd) {  // a login of this shard received by another worker
+                    receive_handoff();
                 } else if (poll_fds[i].fd == udpfd) {  // socket for UDP connections
                     memset(&received_udp, 0, sizeof(received_udp));
                     struct sockaddr_in client_addr;
                     socklen_t clen = sizeof(client_addr);
                     rc = recvfrom(poll_fds[i].fd, &received_udp, sizeof(udp_packet), 0, (struct sockaddr *)&client_addr, &clen);
+                    if (rc >= 0 && capture_enabled()) {  // recorded as received, before any filtering
+                        capture_datagram(&client_addr, &received_udp, rc);
+                    }
 
                     send_messages(received_udp, client_addr);
+                } else if (c && c->socket != poll_fds[i].fd) {  // a local subscriber freed space in its ring
+                    uint64_t count;
+                    if (read(poll_fds[i].fd, &count, sizeof(count)) > 0) {
+                        outq_flush(&c->out, c->socket);
+                    }
                 } else {  // received data from a TCP connection (subscriber)
                     // receive meta data first (request_header)
                     rc = recv_all(poll_fds[i].fd, &received_tcp, sizeof(received_tcp));
                     DIE(rc < 0, "bad recv");
+                    decode_request_header(&received_tcp);
 
                     if (rc == 0) {  // if user disconnects, remove its socket from the poll structure
-                        close(poll_fds[i].fd);
                         disconnect_subscriber(poll_fds[i].fd);
-
-                        for (int j = i; j < num_fds - 1; j++) {
-                            poll_fds[j] = poll_fds[j + 1];
+                        drop_connection(poll_fds[i].fd);
+                        unwatch_fd(i--);
+                    } else {
+                        if (idle_timeout) {  // the connection is alive
+                            timer_start(&c->idle, idle_timeout);
                         }
 
-                        num_fds--;
-
-                    } else {
                         switch (received_tcp.type) {  // proceed according to type of request received
-                            case 0:  // receive login request
+                            case 0:  // receive login request, possibly naming a profile to apply
+                                if (received_tcp.len <= 0 || received_tcp.len > (int)sizeof(connect)) {
+                                    close_subscriber(i--);
+                                    break;
+                                }
+                                memset(&connect, 0, sizeof(connect));
                                 recv_all(poll_fds[i].fd, &connect, received_tcp.len);
-                                if (!register_subscriber(poll_fds[i].fd, connect.id)) {
-                                    // remove "shell" subscriber structure from subscriber list and close
-                                    // the connection if client tried to login with an aready existing active id
-                                    close(poll_fds[i].fd);
-                                    remove_subscriber(poll_fds[i].fd);
-
-                                    for (int j = i; j < num_fds - 1; j++) {
-                                        poll_fds[j] = poll_fds[j + 1];
-                                    }
+                                connect.id[sizeof(connect.id) - 1] = '\0';
+                                connect.profile[sizeof(connect.profile) - 1] = '\0';
 
-                                    num_fds--;
+                                if (!receive_login(i, &connect, received_tcp.len)) {
+                                    i--;
                                 }
                                 break;
-                            case 1:  // receive subscribe request
+                            case 1:  // receive subscribe request, the interval is left out by older clients
+                                if (received_tcp.len <= 0 || received_tcp.len > (int)sizeof(subscribe)) {
+                                    close_subscriber(i--);
+                                    break;
+                                }
+                                memset(&subscribe, 0, sizeof(subscribe));
                                 recv_all(poll_fds[i].fd, &subscribe, received_tcp.len);
-                                register_subscription(poll_fds[i].fd, subscribe.topic, subscribe.sf);
+                                decode_subscribe(&subscribe);
+                                subscribe.topic[sizeof(subscribe.topic) - 1] = '\0';
+                                register_subscription(poll_fds[i].fd, subscribe.topic, subscribe.sf,
+                                                      subscribe.interval);
                                 break;
                             case 2:  // register unsubscribe request
+                                if (received_tcp.len <= 0 || received_tcp.len > (int)sizeof(unsubscribe)) {
+                                    close_subscriber(i--);
+                                    break;
+                                }
+                                memset(&unsubscribe, 0, sizeof(unsubscribe));
                                 recv_all(poll_fds[i].fd, &unsubscribe, received_tcp.len);
+                                unsubscribe.topic[sizeof(unsubscribe.topic) - 1] = '\0';
                                 register_unsubscription(poll_fds[i].fd, unsubscribe.topic);
                                 break;
+                            case 3:  // repair request for messages lost from a multicast group
+                                if (received_tcp.len != (int)sizeof(nack)) {
+                                    close_subscriber(i--);
+                                    break;
+                                }
+                                recv_all(poll_fds[i].fd, &nack, received_tcp.len);
+                                decode_nack(&nack);
+                                register_nack(poll_fds[i].fd, &nack);
+                                break;
+                            case 4:  // heartbeat, answering one of the server's (no content)
+                                break;
+                            case 5:  // bulk subscribe or unsubscribe request
+                            case 6: {
+                                char *entries = NULL;
+                                if (received_tcp.len >= 0 && received_tcp.len <= MAX_BULK_LEN) {
+                                    entries = (char *)malloc(received_tcp.len + 1);
+                                    DIE(entries == NULL, "bad alloc");
+                                    recv_all(poll_fds[i].fd, entries, received_tcp.len);
+                                }
+                                if (!entries || !register_bulk(poll_fds[i].fd, received_tcp.type, entries,
+                                                               received_tcp.len)) {
+                                    LOG(LOG_WARN, "Malformed bulk request from %s:%hu.\n", c->sub->ip,
+                                          c->sub->port);
+                                    close_subscriber(i--);
+                                }
+                                free(entries);
+                                break;
+                            }
+                            case 7:  // request for the last messages of a topic
+                                if (received_tcp.len != (int)sizeof(history_request)) {
+                                    close_subscriber(i--);
+                                    break;
+                                }
+                                recv_all(poll_fds[i].fd, &history_request, received_tcp.len);
+                                decode_history_request(&history_request);
+                                register_history(poll_fds[i].fd, &history_request);
+                                break;
                         }
                     }
                 }   
             }
+
+            fanout_publish();  // subscription changes of the event, seen by the messages handled next
+        }
+
+        snapshot_tick();  // write journal records of the handled events
+        timers_run();  // heartbeats, idle connections
+        fanout_publish();
+
+        // nothing read from the fan-out tables is held across iterations: the versions replaced so far
+        // can be freed (the event loop being the only reader, only worth doing once something is retired)
+        if (rcu_pending()) {
+            rcu_quiescent();
+            rcu_reclaim();
         }
     }
 }
 
+/*
+ * Function creating the Unix domain socket local subscribers connect to, at a given path.
+ */
+int get_local_socket(char *path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    DIE(fd < 0, "bad socket");
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    DIE(strlen(path) >= sizeof(addr.sun_path), "Given socket path is too long");
+    strcpy(addr.sun_path, path);
+
+    unlink(path);  // remove the socket left by a previous run
+    int rc = bind(fd, (const struct sockaddr *)&addr, sizeof(addr));
+    DIE(rc < 0, "bad bind");
+
+    return fd;
+}
+
 
 /*
  * Function creating a new socket of given type on a given port; returns new socket.
@@ -444,6 +1246,9 @@ int get_socket(int type, uint16_t port) {
     if (type ==SOCK_STREAM) {
         if (setsockopt(fd, SOL_TCP, TCP_NODELAY, &enable, sizeof(int)) < 0)
             perror("setsockopt(TCP_NODELAY) failed");
+        // the workers of shard mode each listen on the port, connections are spread among them
+        if (shard_count && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0)
+            perror("setsockopt(SO_REUSEPORT) failed");
     }
 
     // fil in server info
@@ -459,56 +1264,203 @@ int get_socket(int type, uint16_t port) {
     return fd;
 }
 
-/*
- * Function for deallocating a subscriber structure.
- */
-void free_subscriber(void *p) {
-    subscriber *s = (subscriber *)p;
-    free_list(&s->stored_messages, free);
-}
-
-
-/*
- * Function for deallocating a topic structure
- */
-void free_topic(void *p) {
-    topic *t = (topic *)p;
-    free_list(&t->subs, free);
-}
-
-
 int main(int argc, char *argv[]) {
     setvbuf(stdout, NULL, _IONBF, BUFSIZ);
 
+    // initialise subscriber and topic lists
+    init_database();
+
+    // parse options: directory in which the server's state is persisted, interval between snapshots,
+    // rate limits, output backlog watermarks (KB), number of tracked UDP sources, topic classes, kernel
+    // send buffer of subscriber sockets (KB), Unix domain socket for local subscribers and multicast
+    // egress (first group and port, number of subscribers from which a topic is multicast), port of TCP
+    // publishers, heartbeat interval and idle timeout of subscriber connections (s), file of subscription
+    // profiles, file the received datagrams are captured to, minimum severity of the lines logged, last
+    // messages kept per topic, number of worker processes (shard mode)
+    char *state_dir = NULL, *local_path = NULL, *capture_path = NULL;
+    uint16_t pub_port = 0;
+    int interval = SNAPSHOT_INTERVAL, heartbeat = 0, idle = 0, workers = 0;
+    size_t soft = SOFT_WATERMARK, hard = HARD_WATERMARK, max_sources = MAX_SOURCES;
+    int opt, valid = 1;
+    while ((opt = getopt(argc, argv, "d:i:r:q:o:S:P:b:u:m:M:p:H:F:C:L:R:w:")) != -1) {
+        switch (opt) {
+            case 'd':
+                state_dir = optarg;
+                break;
+            case 'i':
+                interval = atoi(optarg);
+                valid &= interval > 0;
+                break;
+            case 'r':
+                valid &= parse_rate_limit(optarg, &source_limit);
+                break;
+            case 'q':
+                valid &= parse_rate_limit(optarg, &topic_limit);
+                break;
+            case 'o':
+                valid &= sscanf(optarg, "%zu:%zu", &soft, &hard) == 2 && soft <= hard;
+                soft <<= 10;
+                hard <<= 10;
+                break;
+            case 'S':
+                max_sources = strtoul(optarg, NULL, 10);
+                valid &= max_sources > 0;
+                break;
+            case 'b':
+                send_buffer = atoi(optarg) << 10;
+                valid &= send_buffer > 0;
+                break;
+            case 'u':
+                local_path = optarg;
+                break;
+            case 'm':
+                valid &= multicast_init(optarg);
+                break;
+            case 'M':
+                mcast_threshold = atoi(optarg);
+                valid &= mcast_threshold > 0;
+                break;
+            case 'p':
+                valid &= sscanf(optarg, "%hu", &pub_port) == 1 && pub_port;
+                break;
+            case 'C':
+                capture_path = optarg;
+                break;
+            case 'L':
+                valid &= parse_log_level(optarg);
+                break;
+            case 'R':
+                valid &= history_init(optarg);
+                break;
+            case 'F':
+                valid &= load_profiles(optarg);
+                break;
+            case 'w':
+                workers = atoi(optarg);
+                valid &= workers > 0 && workers <= MAX_WORKERS;
+                break;
+            case 'H': {  // <heartbeat interval>[:<idle timeout>], 3 intervals by default
+                int n = sscanf(optarg, "%d:%d", &heartbeat, &idle);
+                if (n == 1) {
+                    idle = 3 * heartbeat;
+                }
+                valid &= n >= 1 && heartbeat >= 0 && idle > 0;
+                heartbeat_interval = heartbeat * 1000ULL;
+                idle_timeout = idle * 1000ULL;
+                break;
+            }
+            case 'P': {  // <topic>=<class>
+                char *sep = strrchr(optarg, '=');
+                if (!sep || sep == optarg || sep - optarg > 50 || sep[1] < '0' || sep[1] >= '0' + NUM_PRIORITIES ||
+                    sep[2] != '\0') {
+                    valid = 0;
+                    break;
+                }
+                *sep = '\0';
+                set_topic_priority(optarg, sep[1] - '0');
+                break;
+            }
+            default:
+                valid = 0;
+        }
+    }
+
     // check number of arguments
-    if (argc != 2) {
-        fprintf(stderr, "\n Usage: ./server <port>\n");
+    if (argc - optind != 1 || !valid) {
+        fprintf(stderr, "\n Usage: ./server <port> [-d <state dir>] [-i <snapshot interval (s)>]"
+                        " [-r <msgs/s per source>[:<burst>]] [-q <msgs/s per topic>[:<burst>]]"
+                        " [-o <soft KB>:<hard KB>] [-S <max sources>] [-P <topic>=<priority class>]..."
+                        " [-b <send buffer KB>] [-u <local socket path>]"
+                        " [-m <group>:<port>[:<interface ip>]] [-M <multicast subscribers>]"
+                        " [-p <publisher port>] [-H <heartbeat interval (s)>[:<idle timeout (s)>]]"
+                        " [-F <profiles file>] [-C <capture file>]"
+                        " [-L debug|info|warn|error] [-R <messages per topic>[:<KB per topic>]]"
+                        " [-w <workers>]\n");
+        return -1;
+    }
+    if (workers && (local_path || pub_port || multicast_enabled())) {
+        fprintf(stderr, "Local subscribers (-u), publishers (-p) and multicast (-m) are not available in"
+                        " shard mode (-w).\n");
         return -1;
     }
-
-    // initialise subscriber and topic lists
-    subscribers = NULL;
-    topics = NULL;
 
     // parse port as number
     uint16_t port;
-    int rc = sscanf(argv[1], "%hu", &port);
+    int rc = sscanf(argv[optind], "%hu", &port);
     DIE(rc != 1, "Given port is invalid");
 
-    // create TCP and UDP sockets
+    // console lines are written by a background thread, the event loop never waits for the console (in
+    // shard mode, each worker starts a writer thread of its own)
+    log_init();
+
+    // in shard mode, this process becomes the supervisor, receiving the datagrams (and capturing them, if
+    // requested) for the workers; each worker goes on below as the server of its shard, with its state in
+    // a directory of its own
+    char shard_dir[PATH_MAX];
+    if (workers) {
+        int udpfd = get_socket(SOCK_DGRAM, port);
+        DIE(capture_path && !capture_open(capture_path), "Cannot start the capture");
+
+        if (!shard_run(workers, udpfd)) {  // all the workers stopped
+            capture_close();
+            close(udpfd);
+            free_database();
+            return 0;
+        }
+
+        capture_path = NULL;
+        if (state_dir) {
+            mkdir(state_dir, 0755);  // the snapshot creates the directory of the shard only
+            snprintf(shard_dir, sizeof(shard_dir), "%s/%d", state_dir, shard_index);
+            state_dir = shard_dir;
+        }
+    }
+
+    ratelimit_init(max_sources);
+    set_overload_watermarks(soft, hard);
+
+    // restore any saved state
+    if (state_dir) {
+        snapshot_init(state_dir, interval);
+    }
+
+    // create TCP and UDP sockets (a worker receives the datagrams from the supervisor)
     int listenfd = get_socket(SOCK_STREAM, port);
-    int udpfd = get_socket(SOCK_DGRAM, port);
+    int udpfd = shard_count ? shard_feed_fd() : get_socket(SOCK_DGRAM, port);
+    int localfd = local_path ? get_local_socket(local_path) : -1;
+    int pubfd = pub_port ? get_socket(SOCK_STREAM, pub_port) : -1;
+
+    // start capturing the received datagrams, if requested
+    DIE(capture_path && !capture_open(capture_path), "Cannot start the capture");
 
     // run server and begin waiting for events
-    run_server(listenfd, udpfd);
+    run_server(listenfd, udpfd, localfd, pubfd);
 
     // close sockets
     close(listenfd);
-    close(udpfd);
-
-    // deallocate lists
-    free_list(&subscribers, free_subscriber);
-    free_list(&topics, free_topic);
+    if (shard_count) {
+        shard_close();  // with the ring
+    } else {
+        close(udpfd);
+    }
+    if (localfd >= 0) {
+        close(localfd);
+        unlink(local_path);
+    }
+    if (pubfd >= 0) {
+        close(pubfd);
+    }
+    free(poll_fds);
+    multicast_close();
+    capture_close();
+
+    // save final state and deallocate lists
+    snapshot_close();
+    free_connections();
+    free_publishers();
+    free_database();
+    rcu_unregister();
+    rcu_reclaim();  // no readers left
 
     return 0;
 }
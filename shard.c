@@ -0,0 +1,485 @@
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "log.h"
+#include "shard.h"
+
+/*
+ * State of a worker, kept by the supervisor; each worker has a copy of the table as it was when it
+ * started, of which it uses its own ring and the handoff sockets.
+ */
+typedef struct {
+    pid_t pid;  // 0 - not running
+    shm_ring feed;  // datagrams written by the supervisor
+    int handoff[2];  // Unix datagram socket pair: logins are sent to [1] and received by the worker on [0]
+    int input;  // end of the pipe the worker reads as its console, -1 if closed
+    uint64_t started;  // ms
+    uint64_t fed, dropped;  // datagrams written to the ring, or lost for lack of room in it
+    unsigned restarts;
+} worker;
+
+int shard_count, shard_index;
+
+static worker *workers;
+static pid_t supervisor;
+static int console_closed;  // end of the supervisor's console, the pipes of the workers are closed too
+
+static uint64_t feed_pos;  // position of the worker in its ring
+static uint64_t handed_off, handoff_failed, accepted;  // logins of other shards, and of this one
+
+
+/*
+ * Function returning the monotonic time in ms.
+ */
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Function starting a worker, with a new ring and console pipe; returns 1 in the worker, 0 in the
+ * supervisor.
+ */
+static int start_worker(int i, int udpfd) {
+    worker *w = &workers[i];
+    int input[2];
+
+    DIE(shm_ring_create(&w->feed, SHARD_RING) < 0, "shm_ring_create");
+    DIE(pipe(input) < 0, "pipe");
+
+    pid_t pid = fork();
+    DIE(pid < 0, "fork");
+
+    if (pid == 0) {
+        // stop with the supervisor, even if it died before this point
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != supervisor) {
+            _exit(0);
+        }
+        signal(SIGPIPE, SIG_DFL);
+
+        // the pipe becomes the console of the worker; the descriptors of the other workers are closed,
+        // except for the ends their logins are handed off to
+        DIE(dup2(input[0], 0) < 0, "dup2");
+        close(input[0]);
+        close(input[1]);
+        for (int j = 0; j < shard_count; j++) {
+            if (j != i) {
+                shm_ring_close(&workers[j].feed);
+                close(workers[j].handoff[0]);
+                if (workers[j].input >= 0) {
+                    close(workers[j].input);
+                }
+            }
+        }
+        close(udpfd);
+        capture_abandon();  // the datagrams are captured by the supervisor
+        log_abandon();  // the writer thread of the supervisor is not forked, the worker starts its own
+        log_init();
+
+        shard_index = i;
+        feed_pos = 0;
+        return 1;
+    }
+
+    close(input[0]);
+    w->input = input[1];
+    if (console_closed) {
+        close(w->input);
+        w->input = -1;
+    }
+    w->pid = pid;
+    w->started = now_ms();
+
+    return 0;
+}
+
+/*
+ * Function writing a datagram to the ring of every running worker, unless the ring cannot hold it whole.
+ */
+static void feed(struct sockaddr_in *source, char *data, int len) {
+    shard_frame frame = { *source, len };
+    struct iovec iov[2] = { { &frame, sizeof(frame) }, { data, len } };
+
+    for (int i = 0; i < shard_count; i++) {
+        worker *w = &workers[i];
+        if (!w->pid) {
+            continue;
+        }
+
+        uint64_t used = shm_ring_used(&w->feed);
+        if (used == UINT64_MAX) {  // the worker corrupted its position, it is restarted with a new ring
+            kill(w->pid, SIGKILL);
+            w->dropped++;
+            continue;
+        }
+        if (w->feed.size - used < sizeof(frame) + len) {
+            w->dropped++;
+            continue;
+        }
+
+        shm_ring_writev(&w->feed, iov, 2);
+        w->fed++;
+    }
+}
+
+/*
+ * Function receiving the datagrams waiting on the UDP socket, at most SHARD_BATCH, and feeding them to
+ * the workers.
+ */
+static void receive_datagrams(int udpfd) {
+    udp_packet received;
+    struct sockaddr_in source;
+
+    for (int n = 0; n < SHARD_BATCH; n++) {
+        socklen_t len = sizeof(source);
+        int rc = recvfrom(udpfd, &received, sizeof(received), MSG_DONTWAIT, (struct sockaddr *)&source, &len);
+        if (rc < 0) {
+            return;
+        }
+        if (capture_enabled()) {  // recorded as received, before any filtering
+            capture_datagram(&source, &received, rc);
+        }
+
+        feed(&source, (char *)&received, rc);
+    }
+}
+
+/*
+ * Function printing the counters of the supervisor.
+ */
+static void print_supervisor_stats(void) {
+    log_flush();  // after the lines logged so far
+    capture_stats(stderr);
+    for (int i = 0; i < shard_count; i++) {
+        worker *w = &workers[i];
+        fprintf(stderr, "Worker %d: pid %d, %lu datagrams fed, %lu dropped, %u restarts.\n", i, (int)w->pid,
+                w->fed, w->dropped, w->restarts);
+    }
+}
+
+/*
+ * Function closing the console pipe of a worker.
+ */
+static void close_input(worker *w) {
+    if (w->input >= 0) {
+        close(w->input);
+        w->input = -1;
+    }
+}
+
+/*
+ * Function handling a console line of the supervisor: forwarded to the workers, which act on it as a
+ * single server does; returns 0 on "exit", once all the workers stopped.
+ */
+static int console_line(char *line, int len) {
+    for (int i = 0; i < shard_count; i++) {
+        if (workers[i].input >= 0 && write(workers[i].input, line, len) != len) {
+            close_input(&workers[i]);  // the worker died, it is restarted with a new pipe
+        }
+    }
+
+    if (len >= 4 && strncmp(line, "exit", 4) == 0 && (len == 4 || line[4] == '\n' || line[4] == ' ')) {
+        for (int i = 0; i < shard_count; i++) {
+            if (workers[i].pid) {
+                waitpid(workers[i].pid, NULL, 0);
+                workers[i].pid = 0;
+            }
+        }
+        return 0;
+    }
+
+    if (len >= 5 && strncmp(line, "stats", 5) == 0) {
+        print_supervisor_stats();
+    }
+
+    return 1;
+}
+
+/*
+ * Function releasing the rings and the handoff sockets of the workers, once they all stopped.
+ */
+static void release_workers(void) {
+    for (int i = 0; i < shard_count; i++) {
+        shm_ring_close(&workers[i].feed);
+        close(workers[i].handoff[0]);
+        close(workers[i].handoff[1]);
+        close_input(&workers[i]);
+    }
+    free(workers);
+    workers = NULL;
+}
+
+/*
+ * Function collecting the workers that died and restarting them, at most once per SHARD_RESTART;
+ * returns 1 in a restarted worker, 0 in the supervisor.
+ */
+static int restart_workers(int udpfd) {
+    int status;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < shard_count; i++) {
+            if (workers[i].pid == pid) {
+                if (WIFSIGNALED(status)) {
+                    LOG(LOG_WARN, "Worker %d (pid %d) killed by signal %d.\n", i, (int)pid, WTERMSIG(status));
+                } else {
+                    LOG(LOG_WARN, "Worker %d (pid %d) exited with status %d.\n", i, (int)pid,
+                        WEXITSTATUS(status));
+                }
+                workers[i].pid = 0;
+                close_input(&workers[i]);
+            }
+        }
+    }
+
+    uint64_t now = now_ms();
+    for (int i = 0; i < shard_count; i++) {
+        worker *w = &workers[i];
+        if (w->pid || now - w->started < SHARD_RESTART) {
+            continue;
+        }
+
+        shm_ring_close(&w->feed);  // with the datagrams the dead worker did not handle
+        w->restarts++;
+        if (start_worker(i, udpfd)) {
+            return 1;
+        }
+        LOG(LOG_WARN, "Worker %d restarted (pid %d).\n", i, (int)w->pid);
+    }
+
+    return 0;
+}
+
+/*
+ * Function running the supervisor of "count" workers, fed with the datagrams of the given UDP socket:
+ * returns 1 in each worker, with shard_index set, and 0 in the supervisor, once the workers stopped (on
+ * "exit").
+ */
+int shard_run(int count, int udpfd) {
+    shard_count = count;
+    supervisor = getpid();
+    signal(SIGPIPE, SIG_IGN);  // a worker died, its pipe is closed
+
+    workers = (worker *)calloc(count, sizeof(worker));
+    DIE(workers == NULL, "bad alloc");
+    for (int i = 0; i < count; i++) {
+        workers[i].input = -1;
+        workers[i].feed.mem_fd = workers[i].feed.data_fd = workers[i].feed.space_fd = -1;  // not created yet
+        DIE(socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, workers[i].handoff) < 0, "socketpair");
+    }
+    for (int i = 0; i < count; i++) {
+        if (start_worker(i, udpfd)) {
+            return 1;
+        }
+    }
+
+    // the console is read without stdio, whose buffer the workers would inherit
+    struct pollfd fds[2] = { { 0, POLLIN, 0 }, { udpfd, POLLIN, 0 } };
+    char line[256];
+    int len = 0;
+    while (1) {
+        int rc = poll(fds, 2, 100);  // also checking on the workers every 100ms
+        DIE(rc < 0 && errno != EINTR, "bad poll");
+
+        if (rc > 0 && (fds[1].revents & POLLIN)) {
+            receive_datagrams(udpfd);
+        }
+
+        if (rc > 0 && (fds[0].revents & (POLLIN | POLLHUP))) {
+            int n = read(0, line + len, sizeof(line) - 1 - len);
+            if (n <= 0) {  // end of input, the workers stop reading their console too
+                fds[0].fd = -1;
+                console_closed = 1;
+                for (int i = 0; i < count; i++) {
+                    close_input(&workers[i]);
+                }
+            } else {
+                len += n;
+                char *end;
+                while ((end = memchr(line, '\n', len)) || len == sizeof(line) - 1) {
+                    int line_len = end ? end - line + 1 : len;
+                    if (!console_line(line, line_len)) {
+                        release_workers();
+                        return 0;
+                    }
+                    len -= line_len;
+                    memmove(line, line + line_len, len);
+                }
+            }
+        }
+
+        if (restart_workers(udpfd)) {
+            return 1;
+        }
+    }
+}
+
+/*
+ * Function returning the shard owning a subscriber id: FNV-1a hash of the id, its bits mixed so that ids
+ * differing only in their last character spread over the shards too.
+ */
+int shard_owner(char *id) {
+    uint32_t hash = 2166136261u;
+    for (; *id; id++) {
+        hash = (hash ^ (uint8_t)*id) * 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+
+    return hash % shard_count;
+}
+
+/*
+ * Function returning the eventfd signalled when datagrams are written to the ring of the worker.
+ */
+int shard_feed_fd(void) {
+    return workers[shard_index].feed.data_fd;
+}
+
+/*
+ * Function announcing that the worker is about to wait for datagrams; returns 1 if some are already
+ * waiting in its ring (and the worker should not wait).
+ */
+int shard_feed_pending(void) {
+    return shm_ring_wait(&workers[shard_index].feed, feed_pos);
+}
+
+/*
+ * Function passing the datagrams waiting in the ring of the worker, at most SHARD_BATCH, to "handle";
+ * returns the number of datagrams handled.
+ */
+int shard_feed_drain(void (*handle)(udp_packet, struct sockaddr_in)) {
+    shm_ring *r = &workers[shard_index].feed;
+    uint64_t head = atomic_load_explicit(&r->hdr->head, memory_order_acquire);
+    udp_packet received;
+    shard_frame frame;
+    int n = 0;
+
+    // frames are read in place, the second mapping of the ring making them contiguous
+    while (feed_pos != head && n < SHARD_BATCH) {
+        memcpy(&frame, r->data + feed_pos % r->size, sizeof(frame));
+        memset(&received, 0, sizeof(received));
+        memcpy(&received, r->data + (feed_pos + sizeof(frame)) % r->size,
+               frame.len < sizeof(received) ? frame.len : sizeof(received));
+        feed_pos += sizeof(frame) + frame.len;
+
+        handle(received, frame.source);
+        n++;
+    }
+    shm_ring_release(r, feed_pos);
+
+    return n;
+}
+
+/*
+ * Function returning the socket the logins handed off to the worker are received on.
+ */
+int shard_handoff_fd(void) {
+    return workers[shard_index].handoff[0];
+}
+
+/*
+ * Function handing off a subscriber's socket, with the login request of "len" bytes received on it, to
+ * the worker owning the subscriber; returns 0 on success, -1 if its socket pair is full.
+ */
+int shard_handoff(int owner, int sockfd, connect_packet *request, int len) {
+    shard_login login = { len, *request };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { .iov_base = &login, .iov_len = sizeof(login) };
+    struct msghdr msg = {0};
+
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &sockfd, sizeof(int));
+
+    if (sendmsg(workers[owner].handoff[1], &msg, MSG_DONTWAIT | MSG_NOSIGNAL) != sizeof(login)) {
+        handoff_failed++;
+        return -1;
+    }
+
+    handed_off++;
+    return 0;
+}
+
+/*
+ * Function receiving a subscriber's socket handed off to the worker, with its login request and the
+ * request's length; returns the socket, or -1 if nothing valid was received.
+ */
+int shard_accept(connect_packet *request, int *len) {
+    shard_login login;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { .iov_base = &login, .iov_len = sizeof(login) };
+    struct msghdr msg = {0};
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t rc = recvmsg(shard_handoff_fd(), &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (rc < 0) {
+        return -1;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+        return -1;
+    }
+    int sockfd;
+    memcpy(&sockfd, CMSG_DATA(cmsg), sizeof(int));
+    if (rc != sizeof(login)) {
+        close(sockfd);
+        return -1;
+    }
+
+    *request = login.request;
+    *len = login.len;
+    accepted++;
+    return sockfd;
+}
+
+/*
+ * Function printing the handoff counters of the worker.
+ */
+void shard_stats(FILE *f) {
+    fprintf(f, "Shard %d of %d: %lu logins handed off (%lu failed), %lu received.\n", shard_index,
+            shard_count, handed_off, handoff_failed, accepted);
+}
+
+/*
+ * Function releasing the ring and the handoff sockets of the worker.
+ */
+void shard_close(void) {
+    if (!workers) {
+        return;
+    }
+
+    for (int i = 0; i < shard_count; i++) {
+        close(workers[i].handoff[1]);
+    }
+    close(shard_handoff_fd());
+    shm_ring_close(&workers[shard_index].feed);
+    free(workers);
+    workers = NULL;
+}
@@ -0,0 +1,63 @@
+#ifndef _SHARD_H
+#define _SHARD_H 1
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "common.h"
+#include "shmring.h"
+
+#define MAX_WORKERS 64
+#define SHARD_RING (4 << 20)  // bytes of datagrams waiting for each worker
+#define SHARD_BATCH 64  // datagrams read by the supervisor, or handled by a worker, per wakeup
+#define SHARD_RESTART 1000  // minimum time between two starts of a worker (ms)
+
+/*
+ * Shard mode (-w): the server runs as a supervisor and a number of worker processes, each a complete
+ * server for the subscribers whose ids hash to it (its shard), with its own state. The workers share the
+ * TCP port (SO_REUSEPORT), so a subscriber may connect to any of them: a login received by a worker not
+ * owning the id is handed off, with the socket itself, to the owner (SCM_RIGHTS over a Unix datagram
+ * socket pair per worker), and the rest of the session goes on there.
+ *
+ * The supervisor receives the datagrams on the UDP port and writes each to the shared memory ring of every
+ * worker (a frame: shard_frame, then the datagram); a worker behind by a full ring loses the datagram, as
+ * from a full socket buffer. It also forwards the console lines to the workers, and restarts a worker that
+ * died, with its ring renewed; the handoff sockets outlive the worker, so the logins handed to it meanwhile
+ * are served once it is back. The other shards are not affected.
+ */
+
+/*
+ * Header of a datagram in the ring of a worker.
+ */
+typedef struct {
+    struct sockaddr_in source;
+    uint32_t len;  // bytes of the datagram following
+} shard_frame;
+
+/*
+ * Login handed off to the worker owning the subscriber, along with its socket.
+ */
+typedef struct {
+    int32_t len;  // bytes of the login request received
+    connect_packet request;
+} shard_login;
+
+extern int shard_count;  // workers, 0 - a single server process
+extern int shard_index;  // shard of the calling worker
+
+int shard_run(int, int);
+int shard_owner(char *);
+
+int shard_feed_fd(void);
+int shard_feed_pending(void);
+int shard_feed_drain(void (*)(udp_packet, struct sockaddr_in));
+
+int shard_handoff_fd(void);
+int shard_handoff(int, int, connect_packet *, int);
+int shard_accept(connect_packet *, int *);
+
+void shard_stats(FILE *);
+void shard_close(void);
+
+#endif
@@ -0,0 +1,296 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "shmring.h"
+
+
+/*
+ * Function mapping a ring's memory: the header page, followed by the data area mapped twice.
+ */
+static int map_ring(shm_ring *r, uint32_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    if (!size || size % page) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // reserve the whole address range first, then map the file over it
+    char *base = mmap(NULL, page + 2 * (size_t)size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+    if (mmap(base, page, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, r->mem_fd, 0) == MAP_FAILED ||
+        mmap(base + page, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, r->mem_fd, page) == MAP_FAILED ||
+        mmap(base + page + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, r->mem_fd, page)
+            == MAP_FAILED) {
+        int err = errno;
+        munmap(base, page + 2 * (size_t)size);
+        errno = err;
+        return -1;
+    }
+
+    r->hdr = (shm_ring_header *)base;
+    r->data = base + page;
+    r->size = size;
+
+    return 0;
+}
+
+/*
+ * Function creating a ring with a data area of (at least) "size" bytes, on the producer's side.
+ */
+int shm_ring_create(shm_ring *r, size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size = (size + page - 1) / page * page;
+
+    r->hdr = NULL;
+    r->written = 0;
+    r->data_fd = r->space_fd = -1;
+    r->mem_fd = memfd_create("subscriber-ring", MFD_CLOEXEC);
+    if (r->mem_fd < 0) {
+        return -1;
+    }
+
+    if (ftruncate(r->mem_fd, page + size) < 0 || map_ring(r, size) < 0) {
+        shm_ring_close(r);
+        return -1;
+    }
+    r->hdr->magic = SHM_RING_MAGIC;
+    r->hdr->size = size;
+
+    r->data_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    r->space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->data_fd < 0 || r->space_fd < 0) {
+        shm_ring_close(r);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Function mapping a ring received from the producer, on the consumer's side.
+ */
+int shm_ring_attach(shm_ring *r, int mem_fd, int data_fd, int space_fd) {
+    struct stat st;
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    r->hdr = NULL;
+    r->mem_fd = mem_fd;
+    r->data_fd = data_fd;
+    r->space_fd = space_fd;
+
+    // the size of the data area follows from the size of the memfd
+    if (fstat(mem_fd, &st) < 0 || map_ring(r, st.st_size > page ? st.st_size - page : 0) < 0) {
+        shm_ring_close(r);
+        return -1;
+    }
+    if (r->hdr->magic != SHM_RING_MAGIC || r->hdr->size != r->size) {
+        shm_ring_close(r);
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Function unmapping a ring and closing its descriptors.
+ */
+void shm_ring_close(shm_ring *r) {
+    if (r->hdr) {
+        munmap(r->hdr, sysconf(_SC_PAGESIZE) + 2 * (size_t)r->size);
+        r->hdr = NULL;
+    }
+    if (r->mem_fd >= 0) {
+        close(r->mem_fd);
+    }
+    if (r->data_fd >= 0) {
+        close(r->data_fd);
+    }
+    if (r->space_fd >= 0) {
+        close(r->space_fd);
+    }
+    r->mem_fd = r->data_fd = r->space_fd = -1;
+}
+
+/*
+ * Function passing the descriptors of a ring to the consumer, through a Unix domain socket.
+ */
+int shm_ring_send_fds(int sockfd, shm_ring *r) {
+    int fds[3] = { r->mem_fd, r->data_fd, r->space_fd };
+    char control[CMSG_SPACE(sizeof(fds))];
+    uint32_t size = r->size;
+    struct iovec iov = { .iov_base = &size, .iov_len = sizeof(size) };
+    struct msghdr msg = {0};
+
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    return sendmsg(sockfd, &msg, MSG_NOSIGNAL) == sizeof(size) ? 0 : -1;
+}
+
+/*
+ * Function receiving the descriptors of a ring (memfd, data eventfd, space eventfd) without blocking;
+ * returns 1 if they were received, 0 if they did not arrive yet, -1 on failure (or if the producer
+ * closed the socket).
+ */
+int shm_ring_recv_fds(int sockfd, int *fds) {
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    uint32_t size;
+    struct iovec iov = { .iov_base = &size, .iov_len = sizeof(size) };
+    struct msghdr msg = {0};
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t rc = recvmsg(sockfd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (rc < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    }
+    if (rc == 0) {
+        errno = ECONNRESET;
+        return -1;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (rc != sizeof(size) || !cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+
+    return 1;
+}
+
+/*
+ * Function returning the number of bytes of a ring not consumed yet, on the producer's side; the
+ * consumer's position is read from memory the consumer can write to, so a value it could not have
+ * reached (behind what it was given, or ahead of what was written) is reported as more than the size of
+ * the ring, and the ring should be given up.
+ */
+uint64_t shm_ring_used(shm_ring *r) {
+    uint64_t tail = atomic_load_explicit(&r->hdr->tail, memory_order_acquire);
+    uint64_t used = r->written - tail;
+
+    return used <= r->size ? used : UINT64_MAX;
+}
+
+/*
+ * Function appending bytes to a ring, as many as fit (like a send() on a non-blocking socket); returns
+ * the number of bytes written, or -1 with errno EAGAIN if the ring is full, EPROTO if the consumer
+ * corrupted its position. Whenever the ring fills up, the producer announces that it waits for space,
+ * and the consumer signals the space eventfd once it frees some.
+ */
+ssize_t shm_ring_writev(shm_ring *r, const struct iovec *iov, int n) {
+    shm_ring_header *h = r->hdr;
+    uint64_t head = r->written;
+    uint64_t used = shm_ring_used(r);
+    if (used == UINT64_MAX) {
+        errno = EPROTO;
+        return -1;
+    }
+    uint64_t tail = head - used;
+    size_t space = r->size - used;
+
+    if (!space) {
+        errno = EAGAIN;
+        return -1;  // the wait was announced when the ring filled up
+    }
+
+    // the second mapping makes the free space contiguous from the current position
+    char *dst = r->data + head % r->size;
+    size_t written = 0, wanted = 0;
+    for (int i = 0; i < n; i++) {
+        wanted += iov[i].iov_len;
+        if (written < space) {
+            size_t len = iov[i].iov_len < space - written ? iov[i].iov_len : space - written;
+            memcpy(dst + written, iov[i].iov_base, len);
+            written += len;
+        }
+    }
+    r->written = head + written;
+    atomic_store_explicit(&h->head, r->written, memory_order_release);
+
+    if (written < wanted) {
+        // announce the wait, then check whether the consumer freed space meanwhile (it may already sleep
+        // and not release anything else); if so, signal ourselves to try again
+        atomic_store_explicit(&h->producer_waiting, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&h->tail, memory_order_acquire) != tail &&
+            atomic_exchange_explicit(&h->producer_waiting, 0, memory_order_relaxed)) {
+            uint64_t one = 1;
+            if (write(r->space_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+                return -1;
+            }
+        }
+    }
+
+    // wake the consumer only if it announced it sleeps
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&h->consumer_waiting, memory_order_relaxed) &&
+        atomic_exchange_explicit(&h->consumer_waiting, 0, memory_order_relaxed)) {
+        uint64_t one = 1;
+        if (write(r->data_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            return -1;
+        }
+    }
+
+    return written;
+}
+
+/*
+ * Function marking the bytes of a ring before position "pos" as consumed, waking the producer if it
+ * waits for space.
+ */
+int shm_ring_release(shm_ring *r, uint64_t pos) {
+    shm_ring_header *h = r->hdr;
+
+    if (atomic_load_explicit(&h->tail, memory_order_relaxed) == pos) {
+        return 0;
+    }
+    atomic_store_explicit(&h->tail, pos, memory_order_release);
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&h->producer_waiting, memory_order_relaxed) &&
+        atomic_exchange_explicit(&h->producer_waiting, 0, memory_order_relaxed)) {
+        uint64_t one = 1;
+        if (write(r->space_fd, &one, sizeof(one)) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Function announcing that the consumer, having last seen the producer at position "head", is about to
+ * wait on the data eventfd; returns 1 if data arrived meanwhile (and the consumer should not wait).
+ */
+int shm_ring_wait(shm_ring *r, uint64_t head) {
+    shm_ring_header *h = r->hdr;
+
+    atomic_store_explicit(&h->consumer_waiting, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    return atomic_load_explicit(&h->head, memory_order_acquire) != head;
+}
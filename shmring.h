@@ -0,0 +1,53 @@
+#ifndef _SHMRING_H
+#define _SHMRING_H 1
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define SHM_RING_MAGIC 0x52534e53  // identifies the header of a ring
+
+/*
+ * Control block at the beginning of a ring's shared memory; producer and consumer positions are kept
+ * in separate cache lines, so that each side only writes to its own.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t size;  // size of the data area (a multiple of the page size)
+    _Alignas(64) _Atomic uint64_t head;  // number of bytes written by the producer (the server)
+    _Atomic uint32_t producer_waiting;  // 1 - the producer found the ring full and waits for space
+    _Alignas(64) _Atomic uint64_t tail;  // number of bytes consumed by the consumer (the subscriber)
+    _Atomic uint32_t consumer_waiting;  // 1 - the consumer found the ring empty and waits for data
+} shm_ring_header;
+
+/*
+ * Single-producer / single-consumer byte ring in memory shared by the server and a local subscriber,
+ * carrying the same frames as a TCP connection. The data area is mapped twice, back to back, so that
+ * any frame can be written and read in place, even when it wraps around the end of the ring. Each side
+ * only wakes the other (through an eventfd) when the other announced it is about to sleep.
+ */
+typedef struct {
+    shm_ring_header *hdr;
+    char *data;  // data area, followed by its second mapping
+    uint32_t size;
+    uint64_t written;  // bytes written, kept by the producer (the consumer can write to the header too)
+    int mem_fd;  // memfd holding the header and the data area
+    int data_fd;  // eventfd signalled by the producer when data is written for a waiting consumer
+    int space_fd;  // eventfd signalled by the consumer when space is freed for a waiting producer
+} shm_ring;
+
+int shm_ring_create(shm_ring *, size_t);
+int shm_ring_attach(shm_ring *, int, int, int);
+void shm_ring_close(shm_ring *);
+
+int shm_ring_send_fds(int, shm_ring *);
+int shm_ring_recv_fds(int, int *);
+
+uint64_t shm_ring_used(shm_ring *);
+ssize_t shm_ring_writev(shm_ring *, const struct iovec *, int);
+int shm_ring_release(shm_ring *, uint64_t);
+int shm_ring_wait(shm_ring *, uint64_t);
+
+#endif
@@ -0,0 +1,746 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "database.h"
+#include "outq.h"
+#include "snapshot.h"
+#include "wire.h"
+
+#define SNAPSHOT_MAGIC 0x4e535343  // "CSSN"
+#define JOURNAL_MAGIC 0x4e4a5343  // "CSJN"
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_CHUNK (1 << 20)  // bytes of a snapshot encoded before they are written out
+#define SNAPSHOT_POLL 100  // ms between two checks on the process writing a snapshot
+
+/*
+ * Growable byte buffer in which snapshots and journal records are encoded before being written.
+ */
+typedef struct {
+    char *data;
+    size_t len, cap;
+} buffer;
+
+/*
+ * Cursor over an encoded snapshot or journal; "ok" is cleared as soon as a read goes past the end.
+ */
+typedef struct {
+    const char *p, *end;
+    int ok;
+} reader;
+
+static int enabled;  // 0 - no state directory given, persistence is disabled
+static char snapshot_path[PATH_MAX], tmp_path[PATH_MAX], journal_path[PATH_MAX], old_journal_path[PATH_MAX];
+static int journal_fd = -1;
+static pid_t writer;  // child process writing a snapshot, 0 if none
+static uint32_t generation;  // generation of the current journal; a snapshot covers all journals up to its own
+static buffer journal;  // records not yet written to the journal file
+static int dirty;  // 1 - state changed since the last snapshot
+static int interval_ms;
+static long long next_snapshot;  // moment (ms) at which the next snapshot is due
+
+
+/*
+ * Function returning the current value of the monotonic clock, in milliseconds.
+ */
+static long long now_ms(void) {
+    return now_ns() / 1000000;
+}
+
+static void put(buffer *b, const void *src, size_t len) {
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < b->len + len) {
+            cap <<= 1;
+        }
+        b->data = (char *)realloc(b->data, cap);
+        DIE(b->data == NULL, "bad alloc");
+        b->cap = cap;
+    }
+
+    memcpy(b->data + b->len, src, len);
+    b->len += len;
+}
+
+static void put_u8(buffer *b, uint8_t value) {
+    put(b, &value, sizeof(value));
+}
+
+static void put_u32(buffer *b, uint32_t value) {
+    put(b, &value, sizeof(value));
+}
+
+static void put_string(buffer *b, char *s) {
+    uint8_t len = strlen(s);
+    put_u8(b, len);
+    put(b, s, len);
+}
+
+/*
+ * Function encoding a stored message as its header (as sent to the clients) and priority class, followed
+ * by the relevant bytes of topic and payload.
+ */
+static void put_message(buffer *b, stored_message *m) {
+    content_header hdr;
+    encode_content_header(&hdr, &m->hdr);
+    put(b, &hdr, sizeof(hdr));
+    put_u8(b, m->priority);
+    put(b, m->topic, m->hdr.topic_len);
+    put(b, m->payload, m->hdr.data_len);
+}
+
+static void get(reader *r, void *dst, size_t len) {
+    if (!r->ok || (size_t)(r->end - r->p) < len) {
+        r->ok = 0;
+        memset(dst, 0, len);
+        return;
+    }
+
+    memcpy(dst, r->p, len);
+    r->p += len;
+}
+
+static uint8_t get_u8(reader *r) {
+    uint8_t value;
+    get(r, &value, sizeof(value));
+    return value;
+}
+
+static uint32_t get_u32(reader *r) {
+    uint32_t value;
+    get(r, &value, sizeof(value));
+    return value;
+}
+
+/*
+ * Function decoding a length prefixed string into dst (of capacity cap, terminator included).
+ */
+static void get_string(reader *r, char *dst, size_t cap) {
+    uint8_t len = get_u8(r);
+    if (len >= cap) {
+        r->ok = 0;
+    }
+    get(r, dst, r->ok ? len : 0);
+    dst[r->ok ? len : 0] = '\0';
+}
+
+/*
+ * Function decoding a stored message; returns a newly allocated structure, NULL if the data is invalid.
+ */
+static stored_message *get_message(reader *r) {
+    stored_message *m = (stored_message *)calloc(1, sizeof(stored_message));
+    DIE(m == NULL, "bad alloc");
+
+    content_header hdr;
+    get(r, &hdr, sizeof(hdr));
+    decode_content_header(&m->hdr, &hdr);
+    m->priority = get_u8(r);
+    if (m->priority >= NUM_PRIORITIES || m->hdr.topic_len < 0 || m->hdr.topic_len > (int)sizeof(m->topic) ||
+        m->hdr.data_len < 0 || m->hdr.data_len > (int)sizeof(m->payload)) {
+        r->ok = 0;
+    }
+    if (r->ok) {
+        get(r, m->topic, m->hdr.topic_len);
+        get(r, m->payload, m->hdr.data_len);
+    }
+    if (!r->ok) {
+        free(m);
+        return NULL;
+    }
+
+    return m;
+}
+
+/*
+ * Function writing a whole buffer to a file descriptor; returns 0 on success, -1 on failure.
+ */
+static int write_buffer(int fd, char *data, size_t len) {
+    while (len) {
+        ssize_t rc = write(fd, data, len);
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rc < 0) {
+            return -1;
+        }
+        data += rc;
+        len -= rc;
+    }
+
+    return 0;
+}
+
+static void corrupt(char *path) {
+    fprintf(stderr, "State file %s is corrupt or of an unsupported version.\n", path);
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Function rebuilding the subscribers, topics, subscriptions and stored messages from the snapshot file,
+ * mapped in memory; returns the generation of the snapshot, 0 if there is none.
+ */
+static uint32_t load_snapshot(void) {
+    int fd = open(snapshot_path, O_RDONLY);
+    if (fd < 0) {
+        DIE(errno != ENOENT, "open snapshot");
+        return 0;
+    }
+
+    struct stat st;
+    DIE(fstat(fd, &st) < 0, "fstat");
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    DIE(data == MAP_FAILED, "mmap");
+    close(fd);
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    reader r = {data, data + st.st_size, 1};
+    if (get_u32(&r) != SNAPSHOT_MAGIC || get_u32(&r) != SNAPSHOT_VERSION) {
+        corrupt(snapshot_path);
+    }
+    uint32_t gen = get_u32(&r);
+    uint32_t n_subscribers = get_u32(&r);
+    uint32_t n_topics = get_u32(&r);
+    if (!r.ok) {
+        corrupt(snapshot_path);
+    }
+
+    // size the indexes up front so that they never grow while loading
+    hashmap_free(&subscriber_index);
+    hashmap_init(&subscriber_index, n_subscribers);
+    hashmap_free(&topic_index);
+    hashmap_init(&topic_index, n_topics);
+
+    subscriber **by_ordinal = (subscriber **)malloc((n_subscribers + 1) * sizeof(subscriber *));
+    DIE(by_ordinal == NULL, "bad alloc");
+
+    char id[sizeof(((subscriber *)0)->id)];
+    for (uint32_t i = 0; i < n_subscribers && r.ok; i++) {
+        get_string(&r, id, sizeof(id));
+        subscriber *s = add_offline_subscriber(id);
+        by_ordinal[i] = s;
+
+        uint32_t n_stored = get_u32(&r);
+        for (uint32_t j = 0; j < n_stored && r.ok; j++) {
+            stored_message *m = get_message(&r);
+            if (m) {
+                store_message(s, m);
+            }
+        }
+    }
+
+    char title[sizeof(((topic *)0)->title)];
+    for (uint32_t i = 0; i < n_topics && r.ok; i++) {
+        get_string(&r, title, sizeof(title));
+        topic *t = find_topic(title);  // a derived topic loaded before adds its base topic
+        if (!t) {
+            t = add_topic(title);
+        }
+
+        uint32_t n_subs = get_u32(&r);
+        for (uint32_t j = 0; j < n_subs && r.ok; j++) {
+            uint32_t ordinal = get_u32(&r);
+            uint8_t sf = get_u8(&r);
+            uint8_t priority = get_u8(&r);
+            uint32_t interval = get_u32(&r);
+            if (ordinal >= n_subscribers || priority > NUM_PRIORITIES) {
+                r.ok = 0;
+                break;
+            }
+            add_subscription(t, by_ordinal[ordinal], sf, priority, interval);
+        }
+    }
+
+    if (!r.ok) {
+        corrupt(snapshot_path);
+    }
+
+    free(by_ordinal);
+    munmap(data, st.st_size);
+
+    return gen;
+}
+
+/*
+ * Function returning the subscriber with a given id, registering it if needed (journal replay).
+ */
+static subscriber *replay_subscriber(char *id) {
+    subscriber *s = find_subscriber(id);
+    return s ? s : add_offline_subscriber(id);
+}
+
+/*
+ * Function applying one journal record on top of the restored state; returns 0 if the record is
+ * incomplete (the journal was cut while being written).
+ */
+static int replay_record(reader *r) {
+    char id[sizeof(((subscriber *)0)->id)];
+    char title[sizeof(((topic *)0)->title)];
+
+    uint8_t type = get_u8(r);
+    get_string(r, id, sizeof(id));
+    if (!r->ok) {
+        return 0;
+    }
+
+    switch (type) {
+        case JOURNAL_SUBSCRIBER:
+            replay_subscriber(id);
+            break;
+        case JOURNAL_SUBSCRIBE: {
+            get_string(r, title, sizeof(title));
+            uint8_t sf = get_u8(r);
+            uint8_t priority = get_u8(r);
+            uint32_t interval = get_u32(r);
+            if (!r->ok || priority > NUM_PRIORITIES) {
+                return 0;
+            }
+
+            subscriber *s = replay_subscriber(id);
+            topic *t = find_topic(title);
+            if (!t) {
+                t = add_topic(title);
+            }
+            subscription *existing = find_subscription(s, t);
+            if (existing) {
+                update_subscription(existing, sf, priority, interval);
+            } else {
+                add_subscription(t, s, sf, priority, interval);
+            }
+            break;
+        }
+        case JOURNAL_UNSUBSCRIBE: {
+            get_string(r, title, sizeof(title));
+            if (!r->ok) {
+                return 0;
+            }
+
+            topic *t = find_topic(title);
+            subscriber *s = find_subscriber(id);
+            subscription *sub = t && s ? find_subscription(s, t) : NULL;
+            if (sub) {
+                remove_subscription(sub);
+            }
+            break;
+        }
+        case JOURNAL_STORE: {
+            stored_message *m = get_message(r);
+            if (!m) {
+                return 0;
+            }
+            store_message(replay_subscriber(id), m);
+            break;
+        }
+        case JOURNAL_FLUSH:
+            free_stored_messages(replay_subscriber(id));
+            break;
+        default:
+            return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Function creating an empty journal for the current generation.
+ */
+static void reset_journal(void) {
+    if (journal_fd >= 0) {
+        close(journal_fd);
+    }
+
+    journal_fd = open(journal_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    DIE(journal_fd < 0, "open journal");
+
+    uint32_t header[3] = {JOURNAL_MAGIC, SNAPSHOT_VERSION, generation};
+    DIE(write_buffer(journal_fd, (char *)header, sizeof(header)) < 0, "write journal");
+    journal.len = 0;
+}
+
+/*
+ * Function writing all the pending journal records to the journal file.
+ */
+static void flush_journal(void) {
+    if (journal.len) {
+        DIE(write_buffer(journal_fd, journal.data, journal.len) < 0, "write journal");
+        journal.len = 0;
+    }
+}
+
+/*
+ * Function writing a complete snapshot of the registered subscribers (with their stored messages) and of
+ * all subscriptions to a temporary file, a chunk at a time, then atomically replacing the previous
+ * snapshot with it; returns 0 on success, -1 on failure.
+ */
+static int write_snapshot(void) {
+    buffer b = {NULL, 0, 0};
+    hashmap ordinals;
+    uint32_t n_subscribers = 0, n_topics = 0;
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    for (list p = subscribers; p != NULL; p = p->next) {
+        n_subscribers += ((subscriber *)p->info)->id[0] != '\0';
+    }
+    for (list p = topics; p != NULL; p = p->next) {
+        n_topics += ((topic *)p->info)->subs != NULL;
+    }
+    hashmap_init(&ordinals, n_subscribers);
+
+    put_u32(&b, SNAPSHOT_MAGIC);
+    put_u32(&b, SNAPSHOT_VERSION);
+    put_u32(&b, generation);
+    put_u32(&b, n_subscribers);
+    put_u32(&b, n_topics);
+
+    // the counts of each entry are filled in once it is encoded, so chunks are only written between entries
+    int rc = 0;
+    uintptr_t ordinal = 0;
+    for (list p = subscribers; p != NULL && !rc; p = p->next) {
+        subscriber *s = (subscriber *)p->info;
+        if (s->id[0] == '\0') {  // "shell" subscriber that did not log in yet
+            continue;
+        }
+        hashmap_put(&ordinals, s->id, (void *)++ordinal);
+        put_string(&b, s->id);
+
+        size_t n_stored_offset = b.len;
+        uint32_t n_stored = 0;
+        put_u32(&b, 0);
+        for (list q = s->stored_messages; q != NULL; q = q->next) {
+            put_message(&b, (stored_message *)q->info);
+            n_stored++;
+        }
+        memcpy(b.data + n_stored_offset, &n_stored, sizeof(n_stored));
+
+        if (b.len >= SNAPSHOT_CHUNK) {
+            rc = write_buffer(fd, b.data, b.len);
+            b.len = 0;
+        }
+    }
+
+    for (list p = topics; p != NULL && !rc; p = p->next) {
+        topic *t = (topic *)p->info;
+        if (!t->subs) {
+            continue;
+        }
+        put_string(&b, t->title);
+
+        size_t n_subs_offset = b.len;
+        uint32_t n_subs = 0;
+        put_u32(&b, 0);
+        for (list q = t->subs; q != NULL; q = q->next) {
+            subscription *sub = (subscription *)q->info;
+            uintptr_t o = (uintptr_t)hashmap_get(&ordinals, sub->sub->id);
+            if (sub->sub->id[0] == '\0' || !o) {
+                continue;
+            }
+            put_u32(&b, o - 1);
+            put_u8(&b, sub->sf);
+            put_u8(&b, sub->priority);
+            put_u32(&b, sub->interval);
+            n_subs++;
+        }
+        memcpy(b.data + n_subs_offset, &n_subs, sizeof(n_subs));
+
+        if (b.len >= SNAPSHOT_CHUNK) {
+            rc = write_buffer(fd, b.data, b.len);
+            b.len = 0;
+        }
+    }
+
+    if (!rc) {
+        rc = write_buffer(fd, b.data, b.len);
+    }
+    if (!rc) {
+        rc = fsync(fd);
+    }
+    close(fd);
+    if (!rc) {
+        rc = rename(tmp_path, snapshot_path);
+    }
+
+    free(b.data);
+    hashmap_free(&ordinals);
+    return rc;
+}
+
+/*
+ * Function taking a snapshot on the event loop, waiting for it to be written (at startup and exit).
+ */
+static void take_snapshot(void) {
+    flush_journal();
+    DIE(write_snapshot() < 0, "write snapshot");
+
+    // everything up to the current generation is now in the snapshot
+    generation++;
+    reset_journal();
+    dirty = 0;
+}
+
+/*
+ * Function replaying the records of a journal file written after the snapshot of a given generation;
+ * returns the generation of the journal, 0 if it has nothing to replay (missing, already folded into the
+ * snapshot, or of an older format that cannot be read). A partially written last record is cut off, so
+ * that new records are appended after a valid one.
+ */
+static uint32_t replay_journal(char *path, uint32_t snapshot_generation) {
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        DIE(errno != ENOENT, "open journal");
+        return 0;
+    }
+
+    struct stat st;
+    DIE(fstat(fd, &st) < 0, "fstat");
+
+    char *data = NULL;
+    if (st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        DIE(data == MAP_FAILED, "mmap");
+    }
+
+    reader r = {data, data + st.st_size, 1};
+    uint32_t magic = get_u32(&r);
+    uint32_t version = get_u32(&r);
+    uint32_t gen = get_u32(&r);
+    if (!r.ok || magic != JOURNAL_MAGIC || version != SNAPSHOT_VERSION || gen <= snapshot_generation) {
+        if (data) {
+            munmap(data, st.st_size);
+        }
+        close(fd);
+        return 0;
+    }
+
+    const char *good = r.p;
+    while (r.p < r.end && replay_record(&r)) {
+        good = r.p;
+    }
+
+    DIE(ftruncate(fd, good - data) < 0, "ftruncate");
+    munmap(data, st.st_size);
+    close(fd);
+
+    dirty |= good - data > (long)(3 * sizeof(uint32_t));
+    return gen;
+}
+
+/*
+ * Function replaying the journals written after the last snapshot, if any, and opening the current one
+ * for appending. The previous journal is only left when the server stopped while a snapshot covering it
+ * was being written: its records come first, and a snapshot is taken right away so that it can go.
+ */
+static void load_journal(uint32_t snapshot_generation) {
+    int pending = replay_journal(old_journal_path, snapshot_generation) != 0;
+    uint32_t gen = replay_journal(journal_path, snapshot_generation);
+
+    if (gen) {
+        generation = gen;
+        journal_fd = open(journal_path, O_WRONLY | O_APPEND);
+        DIE(journal_fd < 0, "open journal");
+    } else {
+        generation = snapshot_generation + 1;
+        reset_journal();
+    }
+
+    if (pending) {
+        take_snapshot();
+    }
+    if (unlink(old_journal_path) < 0) {
+        DIE(errno != ENOENT, "unlink journal");
+    }
+}
+
+/*
+ * Function starting a snapshot in the background: a child process writes the state as it is at the
+ * fork (the pages the event loop changes afterwards are copied on write), while the event loop goes on
+ * with a new journal. The current journal is kept aside until the snapshot covering it is in place.
+ */
+static void start_snapshot(void) {
+    flush_journal();
+    DIE(rename(journal_path, old_journal_path) < 0, "rename journal");
+
+    pid_t pid = fork();
+    DIE(pid < 0, "fork");
+    if (pid == 0) {
+        // the child only writes the snapshot: it holds none of the server's sockets and files meanwhile,
+        // and leaves without the exit handlers of the server (whose threads it does not have)
+        syscall(SYS_close_range, 3, ~0U, 0);
+        if (write_snapshot() < 0) {
+            perror("write snapshot");
+            _exit(EXIT_FAILURE);
+        }
+        _exit(0);
+    }
+
+    writer = pid;
+    generation++;
+    reset_journal();
+    dirty = 0;
+}
+
+/*
+ * Function collecting the process writing a snapshot, once it is done (or waiting for it, if "wait" is
+ * set); the journal it covers is then removed. A snapshot that could not be written is fatal, as on the
+ * event loop.
+ */
+static void finish_snapshot(int wait) {
+    if (!writer) {
+        return;
+    }
+
+    int status;
+    pid_t rc = waitpid(writer, &status, wait ? 0 : WNOHANG);
+    if (rc == 0) {
+        return;
+    }
+    DIE(rc < 0, "waitpid");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Snapshot of the server's state failed, the journals are kept.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    writer = 0;
+    DIE(unlink(old_journal_path) < 0, "unlink journal");
+}
+
+/*
+ * Function enabling persistence of the server's state in a given directory: restores the state saved
+ * by a previous run (snapshot and journal) and prepares the journal for new changes.
+ */
+void snapshot_init(char *dir, int interval) {
+    if (mkdir(dir, 0755) < 0) {
+        DIE(errno != EEXIST, "mkdir");
+    }
+
+    snprintf(snapshot_path, sizeof(snapshot_path), "%s/snapshot", dir);
+    snprintf(tmp_path, sizeof(tmp_path), "%s/snapshot.tmp", dir);
+    snprintf(journal_path, sizeof(journal_path), "%s/journal", dir);
+    snprintf(old_journal_path, sizeof(old_journal_path), "%s/journal.old", dir);
+
+    long long start = now_ms();
+    load_journal(load_snapshot());
+    fprintf(stderr, "Restored %zu subscribers and %zu topics in %lld ms.\n",
+            subscriber_index.size, topic_index.size, now_ms() - start);
+
+    enabled = 1;
+    interval_ms = interval * 1000;
+    next_snapshot = now_ms() + interval_ms;
+}
+
+/*
+ * Function returning the number of milliseconds until the next snapshot is due, -1 if none is needed.
+ */
+int snapshot_timeout(void) {
+    if (!enabled || (!dirty && !writer)) {
+        return -1;
+    }
+
+    long long left = next_snapshot - now_ms();
+    if (writer && left > SNAPSHOT_POLL) {  // checking on the snapshot being written
+        left = SNAPSHOT_POLL;
+    }
+    return left > 0 ? left : 0;
+}
+
+/*
+ * Function called after each batch of events: writes the new journal records and starts a snapshot in
+ * the background when one is due (and the previous one is written).
+ */
+void snapshot_tick(void) {
+    if (!enabled) {
+        return;
+    }
+
+    flush_journal();
+    finish_snapshot(0);
+    long long now = now_ms();
+    if (now >= next_snapshot && !writer) {
+        if (dirty) {
+            start_snapshot();
+        }
+        next_snapshot = now + interval_ms;
+    }
+}
+
+/*
+ * Function saving the final state of the server when it shuts down.
+ */
+void snapshot_close(void) {
+    if (!enabled) {
+        return;
+    }
+
+    finish_snapshot(1);
+    if (dirty) {
+        take_snapshot();
+    }
+    flush_journal();
+    close(journal_fd);
+    journal_fd = -1;
+    free(journal.data);
+    journal = (buffer){NULL, 0, 0};
+    enabled = 0;
+}
+
+/*
+ * Functions appending records describing changes of the server's state to the journal.
+ */
+static int journal_start(uint8_t type, subscriber *s) {
+    if (!enabled || s->id[0] == '\0') {
+        return 0;
+    }
+
+    dirty = 1;
+    put_u8(&journal, type);
+    put_string(&journal, s->id);
+    return 1;
+}
+
+void journal_subscriber(subscriber *s) {
+    journal_start(JOURNAL_SUBSCRIBER, s);
+}
+
+void journal_subscribe(subscriber *s, char *title, uint8_t sf, uint8_t priority, uint32_t interval) {
+    if (journal_start(JOURNAL_SUBSCRIBE, s)) {
+        put_string(&journal, title);
+        put_u8(&journal, sf);
+        put_u8(&journal, priority);
+        put_u32(&journal, interval);
+    }
+}
+
+void journal_unsubscribe(subscriber *s, char *title) {
+    if (journal_start(JOURNAL_UNSUBSCRIBE, s)) {
+        put_string(&journal, title);
+    }
+}
+
+void journal_store(subscriber *s, stored_message *m) {
+    if (journal_start(JOURNAL_STORE, s)) {
+        put_message(&journal, m);
+    }
+}
+
+void journal_flush(subscriber *s) {
+    if (s->stored_messages) {  // no need for a record if nothing was stored
+        journal_start(JOURNAL_FLUSH, s);
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H 1
+
+#include "common.h"
+
+#define SNAPSHOT_INTERVAL 60  // default number of seconds between two snapshots of the server's state
+
+/*
+ * Types of the records appended to the journal kept between two snapshots.
+ */
+enum {
+    JOURNAL_SUBSCRIBER = 1,  // new subscriber id registered
+    JOURNAL_SUBSCRIBE,  // subscription added or its sf option / priority class / interval changed
+    JOURNAL_UNSUBSCRIBE,  // subscription removed
+    JOURNAL_STORE,  // message stored for a disconnected subscriber
+    JOURNAL_FLUSH,  // stored messages of a subscriber delivered
+};
+
+void snapshot_init(char *, int);
+int snapshot_timeout(void);
+void snapshot_tick(void);
+void snapshot_close(void);
+
+void journal_subscriber(subscriber *);
+void journal_subscribe(subscriber *, char *, uint8_t, uint8_t, uint32_t);
+void journal_unsubscribe(subscriber *, char *);
+void journal_store(subscriber *, stored_message *);
+void journal_flush(subscriber *);
+
+#endif
@@ -14,54 +14,10 @@
 #include <math.h>
 
 #include "common.h"
+#include "libsubscriber.h"
 
-/*
- * Function building and sending meta data and content for a login request to the server.
- */ 
-void send_id(int sockfd, char *id) {
-    request_header connect;
-    connect.type = 0;
-    connect.len = strlen(id) + 1;
-    
-    send_all(sockfd, &connect, sizeof(connect));
-
-    connect_packet data;
-    memcpy(data.id, id, strlen(id) + 1);
-    send_all(sockfd, &data, connect.len);
-}
-
-/*
- * Function building and sending meta data and content for a subscribe request to the server.
- */ 
-void subscribe(int sockfd, char *topic, uint8_t sf) {
-    request_header subscribe;
-    subscribe.type = 1;
-    subscribe.len = strlen(topic) + 2;
-
-    send_all(sockfd, &subscribe, sizeof(subscribe));
-
-    subscribe_packet data;
-    memcpy(data.topic, topic, strlen(topic) + 1);
-    data.sf = sf;
-
-    send_all(sockfd, &data, subscribe.len);
-}
-
-/*
- * Function building and sending meta data and content for a unsubscribe request to the server.
- */ 
-void unsubscribe(int sockfd, char *topic) {
-    request_header unsubscribe;
-    unsubscribe.type = 2;
-    unsubscribe.len = strlen(topic) + 1;
-
-    send_all(sockfd, &unsubscribe, sizeof(unsubscribe));
-
-    unsubscribe_packet data;
-    memcpy(data.topic, topic, strlen(topic) + 1);
-
-    send_all(sockfd, &data, unsubscribe.len);
-}
+#define MAX_BATCH 64  // maximum number of messages handed over by one call to the library
+#define MAX_BULK 64  // maximum number of topics of a bulk command
 
 /*
  * Function returning the corresponding human-readable string representation of a data type received. 
@@ -84,7 +40,7 @@ char *get_type(uint8_t type) {
 /*
  * Function parsing and formatting an "INT" type message payload. 
  */
-void print_int(char *payload) {
+void print_int(const char *payload) {
     uint8_t sign;
     uint32_t value;
 
@@ -101,7 +57,7 @@ void print_int(char *payload) {
 /*
  * Function parsing and formatting a "SHORT_REAL" type message payload. 
  */
-void print_short_real(char *payload) {
+void print_short_real(const char *payload) {
     uint16_t value;
 
     memcpy(&value, payload, sizeof(value));
@@ -123,7 +79,7 @@ void print_short_real(char *payload) {
 /*
  * Function parsing and formatting a "FLOAT" type message payload. 
  */
-void print_float(char *payload) {
+void print_float(const char *payload) {
     uint8_t sign;
     uint32_t value;
     uint8_t power;
@@ -160,7 +116,7 @@ void print_float(char *payload) {
 /*
  * Function deciding the appropiate way (function) to interpret the given message payload.
  */
-void print_data(int type, char *payload) {
+void print_data(int type, const char *payload, int len) {
     switch (type) {
         case 0:
             print_int(payload);
@@ -172,59 +128,60 @@ void print_data(int type, char *payload) {
             print_float(payload);
             break;
         case 3:
-            printf("%s\n", payload);
+            printf("%.*s\n", len, payload);  // the payload may contain the maximum number of characters
+                                              // and no terminator
             break;
     }
 }
 
 /*
- * Function that receives the bytes corresponding to a message from the server over the TCP connection
- * made through "sockfd". 
+ * Callback printing a message received from the server; topic and payload point into the library's
+ * receive buffer and are not terminated.
  */
-int recv_content(int sockfd) {
-    content_header info;
-
-    int rc = recv_all(sockfd, &info, sizeof(info));  // receive meta data first
-    DIE(rc < 0, "bad recv");
-
-    if (rc == 0)
-        return 0;
-
-    // receive the indicated number of bytes for each part of the message (title and content)
-    char topic[info.topic_len + 1], payload[info.data_len + 1];
-    rc = recv_all(sockfd, topic, info.topic_len);
-    DIE(rc < 0, "bad recv");
-    rc = recv_all(sockfd, payload, info.data_len);
-    DIE(rc < 0, "bad recv");
-
-    // adding string terminator in case the topic or the payload contained the maximum allowed number
-    // of characters and don't include it already
-    topic[info.topic_len] = '\0';
-    payload[info.data_len] = '\0';
-    printf("%s:%hu - %s - %s - ", info.ip, info.port, topic, get_type(info.data_type));
-    print_data(info.data_type, payload);
-
-    return 1;
+void print_message(void *context, const sub_message *m) {
+    if (m->data_type == SUB_ACK) {  // answer to a bulk command or to the profile applied at login
+        if (m->payload[0] == 6) {
+            printf("Unsubscribed from %ld topics.\n", (long)m->value.i);
+        } else if (m->topic_len) {
+            printf("Subscribed to %ld topics of profile %.*s.\n", (long)m->value.i, m->topic_len, m->topic);
+        } else {
+            printf("Subscribed to %ld topics.\n", (long)m->value.i);
+        }
+        return;
+    }
+    if (m->data_type == SUB_HISTORY) {  // answer to a history command, the messages follow
+        sub_history h;
+        memcpy(&h, m->payload, sizeof(h));
+        if (h.next) {
+            printf("History of %.*s: %u messages from %u on, next %u.\n", m->topic_len, m->topic, h.count,
+                   h.first, h.next);
+        } else {
+            printf("No history of %.*s.\n", m->topic_len, m->topic);
+        }
+        return;
+    }
+
+    printf("%s:%hu - %.*s - %s - ", m->ip, m->port, m->topic_len, m->topic, get_type(m->data_type));
+    print_data(m->data_type, m->payload, m->data_len);
 }
 
 
 /*
- * Function multiplexing a subscriber's connections to the server and stdin. 
+ * Function multiplexing a subscriber's connection to the server and stdin. 
  */
-void run_subscriber(int sockfd, char *id) {
+void run_subscriber(sub_client *client) {
     struct pollfd poll_fds[2];
     int rc;
-    send_id(sockfd, id);  // first send login request to the server
 
     // initialising 2 poll structures waiting for events at stdin or the TCP socket
     poll_fds[0].fd = 0;
     poll_fds[0].events = POLLIN;
 
-    poll_fds[1].fd = sockfd;
-    poll_fds[1].events = POLLIN;
+    poll_fds[1].fd = sub_client_fd(client);
 
     char buff[256];
     while (1) {
+        poll_fds[1].events = sub_client_events(client);
         rc = poll(poll_fds, 2, -1);
         DIE(rc < 0, "bad poll");
 
@@ -241,33 +198,105 @@ void run_subscriber(int sockfd, char *id) {
                 if (strcmp(command, "subscribe") == 0) {
                     char *topic = strtok(NULL, " \n");
                     char *sf = strtok(NULL, " \n");
+                    char *priority = strtok(NULL, " \n");  // optional priority class ("-" for the topic's)
+                    char *limit = strtok(NULL, " \n");  // optional <min interval ms> or <max rate>/s
                     
                     if (topic && sf) {  // check if the correct arguments exist
                         if (atoi(sf) != 0 && atoi(sf) != 1) {
                             fprintf(stderr, "SF argument needs to be 0 or 1.\n");
                         }
-                        subscribe(sockfd, topic, atoi(sf));
+                        uint32_t interval = 0;
+                        if (limit) {
+                            int rate = atoi(limit);
+                            if (strstr(limit, "/s")) {
+                                interval = rate > 0 ? (1000 + rate - 1) / rate : 0;
+                            } else {
+                                interval = rate > 0 ? rate : 0;
+                            }
+                        }
+                        int class = -1;
+                        if (priority && strcmp(priority, "-") != 0) {
+                            if (atoi(priority) >= 0 && atoi(priority) < NUM_PRIORITIES) {
+                                class = atoi(priority);
+                            } else {
+                                fprintf(stderr, "Priority class needs to be between 0 and %d.\n",
+                                        NUM_PRIORITIES - 1);
+                            }
+                        }
+                        rc = sub_client_subscribe_sampled(client, topic, atoi(sf), class, interval);
+                        DIE(rc < 0, "subscribe");
                         printf("Subscribed to topic.\n");
                     }
                 }
 
+                if (strcmp(command, "bulk_subscribe") == 0) {  // bulk_subscribe <sf> <topic>...
+                    char *sf = strtok(NULL, " \n");
+                    sub_topic topics[MAX_BULK];
+                    int count = 0;
+
+                    char *topic;
+                    while (sf && count < MAX_BULK && (topic = strtok(NULL, " \n"))) {
+                        topics[count].topic = topic;
+                        topics[count].sf = atoi(sf);
+                        topics[count].priority = -1;
+                        count++;
+                    }
+                    if (count) {
+                        rc = sub_client_subscribe_bulk(client, topics, count);
+                        DIE(rc < 0, "subscribe");
+                    }
+                }
+
+                if (strcmp(command, "bulk_unsubscribe") == 0) {  // bulk_unsubscribe <topic>...
+                    const char *titles[MAX_BULK];
+                    int count = 0;
+
+                    char *topic;
+                    while (count < MAX_BULK && (topic = strtok(NULL, " \n"))) {
+                        titles[count++] = topic;
+                    }
+                    if (count) {
+                        rc = sub_client_unsubscribe_bulk(client, titles, count);
+                        DIE(rc < 0, "unsubscribe");
+                    }
+                }
+
+                if (strcmp(command, "history") == 0) {  // history <topic> <count> | since <seq>
+                    char *topic = strtok(NULL, " \n");
+                    char *arg = strtok(NULL, " \n");
+                    char *seq = arg && strcmp(arg, "since") == 0 ? strtok(NULL, " \n") : NULL;
+
+                    if (topic && seq) {
+                        rc = sub_client_history_since(client, topic, strtoul(seq, NULL, 10));
+                        DIE(rc < 0, "history");
+                    } else if (topic && arg && strcmp(arg, "since") != 0) {
+                        rc = sub_client_history(client, topic, strtoul(arg, NULL, 10));
+                        DIE(rc < 0, "history");
+                    }
+                }
+
                 if (strcmp(command, "unsubscribe") == 0) {
                     char *topic = strtok(NULL, " \n");
 
                     if (topic) {
-                        unsubscribe(sockfd, topic);
+                        rc = sub_client_unsubscribe(client, topic);
+                        DIE(rc < 0, "unsubscribe");
                         printf("Unsubscribed from topic.\n");
                     }
                 }   
             }
         }
 
-        if (poll_fds[1].revents & POLLIN) {  // event came from TCP connection
-            rc = recv_content(sockfd);  // receive message
-            DIE(rc < 0, "bad recv");
+        if (poll_fds[1].revents) {  // event came from TCP connection
+            int connected = sub_client_connected(client);
+            do {  // print received messages, in batches
+                rc = sub_client_process(client, MAX_BATCH);
+            } while (rc == MAX_BATCH);
 
-            if (rc == 0) {  // connection closes when the server is down
-                return;
+            if (rc < 0) {
+                DIE(!connected && errno, "connect");
+                DIE(errno, "bad recv");
+                return;  // connection closes when the server is down
             }
         }
     }
@@ -277,9 +306,24 @@ void run_subscriber(int sockfd, char *id) {
 int main(int argc, char *argv[]) {
     setvbuf(stdout, NULL, _IONBF, BUFSIZ);
 
-    // check given arguments
-    if (argc != 4) {
-        fprintf(stderr, "\n Usage: ./subscriber <id> <ip> <port>\n");
+    // parse options: subscription profile stored on the server, applied at login
+    char *profile = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:")) != -1) {
+        if (opt == 'p') {
+            profile = optarg;
+        } else {
+            argc = 0;  // print the usage
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    // check given arguments: a server on the same host can also be reached through its Unix domain socket,
+    // and topics can be received from multicast groups joined on a given interface (0.0.0.0 for the default)
+    if (argc < 3 || argc > 5) {
+        fprintf(stderr, "\n Usage: ./subscriber [-p <profile>] <id> <ip> <port> [<multicast interface ip>]\n"
+                        "        ./subscriber [-p <profile>] <id> <local socket path>\n");
         return 1;
     }
 
@@ -289,42 +333,38 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    // parse port as a number
-    uint16_t port;
-    int rc = sscanf(argv[3], "%hu", &port);
-    DIE(rc != 1, "Given port is invalid");
+    sub_client *client = sub_client_new(print_message, NULL);
+    DIE(client == NULL, "bad alloc");
+    if (profile && sub_client_profile(client, profile) < 0) {
+        fprintf(stderr, "Profile names can have at most 50 characters\n");
+        return 1;
+    }
 
-    // create TCP socket
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    DIE(sockfd < 0, "socket");
+    int rc;
+    if (argc == 3) {  // local subscriber, messages are received through shared memory
+        rc = sub_client_connect_local(client, argv[2], id);
+        DIE(rc < 0, "connect");
+    } else {
+        // parse port as a number
+        uint16_t port;
+        rc = sscanf(argv[3], "%hu", &port);
+        DIE(rc != 1, "Given port is invalid");
+
+        if (argc == 5) {  // must be enabled before subscribing
+            rc = sub_client_multicast(client, argv[4]);
+            DIE(rc < 0, "multicast");
+        }
 
-    
-    struct sockaddr_in serv_addr;
-    socklen_t socket_len = sizeof(struct sockaddr_in);
-
-    // enable reuse and deactivate Nagle algorithm
-    int enable = 1;
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0)
-        perror("setsockopt(SO_REUSEADDR) failed");
-    if (setsockopt(sockfd, SOL_TCP, TCP_NODELAY, &enable, sizeof(int)) < 0)
-            perror("setsockopt(TCP_NODELAY) failed");
-
-    // fill in server information
-    memset(&serv_addr, 0, socket_len);
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(port);
-    rc = inet_pton(AF_INET, argv[2], &serv_addr.sin_addr.s_addr);
-    DIE(rc <= 0, "inet_pton");
-
-    // connect to server
-    rc = connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
-    DIE(rc < 0, "connect");
+        // connect to server, the login request is sent as soon as the connection is established
+        rc = sub_client_connect(client, argv[2], port, id);
+        DIE(rc < 0, "connect");
+    }
 
     // run subscriber and begin waiting for events
-    run_subscriber(sockfd, id);
+    run_subscriber(client);
 
-    // close socket
-    close(sockfd);
+    // close connection
+    sub_client_free(client);
 
     return 0;
-}
\ No newline at end of file
+}
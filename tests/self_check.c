@@ -0,0 +1,567 @@
+#include <arpa/inet.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../aggregate.h"
+#include "../common.h"
+#include "../connection.h"
+#include "../database.h"
+#include "../fanout.h"
+#include "../publisher.h"
+#include "../ratelimit.h"
+#include "../snapshot.h"
+#include "../wire.h"
+
+#define MAX_FRAMES 16  // frames read back from a subscriber's socket at once
+
+/*
+ * Deterministic self-checks of the server's parsers and of its saved state, run in a single process on
+ * the server's own functions (server.c linked without its main()): the subscribers and publishers are
+ * connected through socket pairs, whose other ends the checks write requests to and read frames from.
+ */
+
+// server functions (server.c)
+int register_subscriber(int, char *);
+void disconnect_subscriber(int);
+void add_subscriber_structure(int, struct sockaddr_in);
+void register_subscription(int, char *, uint8_t, uint32_t);
+void subscribe_topic(subscriber *, char *, uint8_t, uint32_t);
+int unsubscribe_topic(subscriber *, char *);
+int register_bulk(int, uint8_t, char *, int);
+void apply_profile(subscriber *, char *, uint8_t);
+void send_messages(udp_packet, struct sockaddr_in);
+int receive_publisher(publisher *);
+
+/*
+ * Frame received by a subscriber: header, topic title (terminated) and payload.
+ */
+typedef struct {
+    message_info info;
+    char topic[51];
+    char payload[1500];
+} frame;
+
+static int checks, failures;
+static struct sockaddr_in source;  // address the checks' datagrams and connections come from
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+static void check(int ok, const char *what, int line) {
+    checks++;
+    if (!ok) {
+        failures++;
+        fprintf(stderr, "self_check.c:%d: check failed: %s\n", line, what);
+    }
+}
+
+
+/*
+ * Function connecting a subscriber through a socket pair and logging it in with a given id; returns the
+ * server's end, and the subscriber's end in "peer".
+ */
+static int connect_client(char *id, int *peer) {
+    int fds[2];
+    DIE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0, "socketpair");
+    DIE(fcntl(fds[1], F_SETFL, O_NONBLOCK) < 0, "fcntl");
+
+    add_subscriber_structure(fds[0], source);
+    DIE(register_subscriber(fds[0], id) != 1, "register_subscriber");
+    *peer = fds[1];
+
+    return fds[0];
+}
+
+/*
+ * Function reading the frames waiting on the subscriber's end of a connection; returns their number.
+ */
+static int read_frames(int peer, frame *frames) {
+    static char data[1 << 16];
+    ssize_t len = 0, rc;
+    while ((rc = read(peer, data + len, sizeof(data) - len)) > 0) {
+        len += rc;
+    }
+
+    int n = 0;
+    char *pos = data, *end = data + len;
+    while (n < MAX_FRAMES && end - pos >= (long)sizeof(content_header)) {
+        frame *f = &frames[n++];
+        decode_content_header(&f->info, pos);
+        pos += sizeof(content_header);
+        DIE(end - pos < f->info.topic_len + f->info.data_len, "truncated frame");
+
+        memcpy(f->topic, pos, f->info.topic_len);
+        f->topic[f->info.topic_len] = '\0';
+        memcpy(f->payload, pos + f->info.topic_len, f->info.data_len);
+        pos += f->info.topic_len + f->info.data_len;
+    }
+
+    return n;
+}
+
+/*
+ * Function returning the value of an INT payload (sign byte, then the value in network order).
+ */
+static long int_value(const char *payload) {
+    uint32_t value;
+    memcpy(&value, payload + 1, sizeof(value));
+
+    return payload[0] ? -(long)ntohl(value) : (long)ntohl(value);
+}
+
+/*
+ * Function returning the count of an acknowledgement frame, -1 if the frame is not one.
+ */
+static long ack_count(frame *f) {
+    if (f->info.data_type != CONTROL_ACK || f->info.data_len != sizeof(bulk_ack)) {
+        return -1;
+    }
+
+    bulk_ack ack;
+    memcpy(&ack, f->payload, sizeof(ack));
+    decode_bulk_ack(&ack);
+    return ack.count;
+}
+
+/*
+ * Function publishing an INT datagram on a topic, as received on the UDP socket.
+ */
+static void publish_int(char *title, uint32_t value) {
+    udp_packet p;
+    memset(&p, 0, sizeof(p));
+    strncpy(p.topic, title, sizeof(p.topic));
+    value = htonl(value);
+    memcpy(p.payload + 1, &value, sizeof(value));
+
+    send_messages(p, source);
+}
+
+/*
+ * Function dropping the database and the connections between two groups of checks.
+ */
+static void reset_server(void) {
+    free_connections();
+    free_publishers();
+    free_database();
+    init_database();
+}
+
+
+/*
+ * Batches of a TCP publisher: records with and without their topic, a batch arriving in pieces, and the
+ * malformed batches that close the publisher's connection (the records before the malformed one are
+ * published).
+ */
+typedef struct {
+    char data[256];
+    int len;
+} batch;
+
+static void add_record(batch *b, char *title, uint8_t type, uint16_t data_len, uint32_t value) {
+    publish_record rec = { strlen(title), type, htole16(data_len) };
+    memcpy(b->data + b->len, &rec, sizeof(rec));
+    b->len += sizeof(rec);
+    memcpy(b->data + b->len, title, rec.topic_len);
+    b->len += rec.topic_len;
+
+    char payload[5] = { 0 };
+    value = htonl(value);
+    memcpy(payload + 1, &value, sizeof(value));
+    memcpy(b->data + b->len, payload, data_len < sizeof(payload) ? data_len : sizeof(payload));
+    b->len += data_len;
+}
+
+/*
+ * Function framing the records of a batch: returns the bytes to send in "out" (header, then records).
+ */
+static int frame_batch(batch *b, uint16_t count, uint32_t len, char *out) {
+    publish_batch hdr = { htole32(len), htole16(count) };
+    memcpy(out, &hdr, sizeof(hdr));
+    memcpy(out + sizeof(hdr), b->data, b->len);
+
+    return sizeof(hdr) + b->len;
+}
+
+/*
+ * Function sending bytes from a new publisher connection; returns what receive_publisher() returns.
+ */
+static int publish_bytes(char *data, int len) {
+    int fds[2];
+    DIE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0, "socketpair");
+    publisher *p = open_publisher(fds[0], &source);
+    DIE(write(fds[1], data, len) != len, "write");
+
+    int rc = receive_publisher(p);
+    close_publisher(fds[0]);
+    close(fds[0]);
+    close(fds[1]);
+    return rc;
+}
+
+static void check_batches(void) {
+    frame frames[MAX_FRAMES];
+    char out[512];
+    int peer, n;
+
+    int fd = connect_client("pub", &peer);
+    register_subscription(fd, "batch/a", 0, 0);
+    register_subscription(fd, "batch/b", 0, 0);
+    fanout_publish();
+
+    // the second record repeats the topic of the first
+    batch b = { .len = 0 };
+    add_record(&b, "batch/a", 0, 5, 1);
+    add_record(&b, "", 0, 5, 2);
+    add_record(&b, "batch/b", 0, 5, 3);
+    add_record(&b, "batch/none", 0, 5, 4);  // no such topic, dropped
+    int len = frame_batch(&b, 4, b.len, out);
+    CHECK(publish_bytes(out, len) == 1);
+    n = read_frames(peer, frames);
+    CHECK(n == 3);
+    CHECK(n == 3 && !strcmp(frames[0].topic, "batch/a") && int_value(frames[0].payload) == 1);
+    CHECK(n == 3 && !strcmp(frames[1].topic, "batch/a") && int_value(frames[1].payload) == 2);
+    CHECK(n == 3 && !strcmp(frames[2].topic, "batch/b") && int_value(frames[2].payload) == 3);
+    CHECK(n == 3 && !strcmp(frames[0].info.ip, "127.0.0.1") && frames[0].info.port == ntohs(source.sin_port));
+
+    // a batch received in two pieces is published once complete
+    int fds[2];
+    DIE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0, "socketpair");
+    publisher *p = open_publisher(fds[0], &source);
+    DIE(write(fds[1], out, 9) != 9, "write");
+    CHECK(receive_publisher(p) == 1);
+    CHECK(read_frames(peer, frames) == 0);
+    DIE(write(fds[1], out + 9, len - 9) != len - 9, "write");
+    CHECK(receive_publisher(p) == 1);
+    CHECK(read_frames(peer, frames) == 3);
+    close(fds[1]);
+    CHECK(receive_publisher(p) == 0);  // closed by the publisher
+    close_publisher(fds[0]);
+    close(fds[0]);
+
+    // the first record leaves its topic out
+    b.len = 0;
+    add_record(&b, "", 0, 5, 1);
+    CHECK(publish_bytes(out, frame_batch(&b, 1, b.len, out)) == 0);
+
+    // an INT record of the wrong length, after a valid one
+    b.len = 0;
+    add_record(&b, "batch/a", 0, 5, 5);
+    add_record(&b, "", 0, 3, 6);
+    CHECK(publish_bytes(out, frame_batch(&b, 2, b.len, out)) == 0);
+    n = read_frames(peer, frames);
+    CHECK(n == 1 && int_value(frames[0].payload) == 5);
+
+    // more records announced than the batch holds, an unknown data type, a batch over the maximum length
+    b.len = 0;
+    add_record(&b, "batch/a", 0, 5, 7);
+    CHECK(publish_bytes(out, frame_batch(&b, 2, b.len, out)) == 0);
+    b.len = 0;
+    add_record(&b, "batch/a", 4, 5, 8);
+    CHECK(publish_bytes(out, frame_batch(&b, 1, b.len, out)) == 0);
+    b.len = 0;
+    CHECK(publish_bytes(out, frame_batch(&b, 0, MAX_BATCH_LEN + 1, out)) == 0);
+    CHECK(read_frames(peer, frames) == 1);  // the record of the batch announcing two
+
+    close(peer);
+    reset_server();
+}
+
+
+/*
+ * Bulk subscribe and unsubscribe requests: the entries applied and acknowledged at once, and the
+ * malformed lists (the entries before the malformed one are applied, and nothing is acknowledged).
+ */
+static int add_entry(char *entries, int len, uint8_t sf, char *title) {
+    bulk_entry e = { sf, strlen(title) };
+    memcpy(entries + len, &e, sizeof(e));
+    memcpy(entries + len + sizeof(e), title, e.topic_len);
+
+    return len + sizeof(e) + e.topic_len;
+}
+
+static void check_bulk(void) {
+    frame frames[MAX_FRAMES];
+    char entries[256];
+    int peer, len;
+
+    int fd = connect_client("bulk", &peer);
+    subscriber *s = find_subscriber("bulk");
+
+    len = add_entry(entries, 0, SF_MASK, "bulk/a");
+    len = add_entry(entries, len, (2 + 1) << PRIORITY_SHIFT, "bulk/b");
+    CHECK(register_bulk(fd, 5, entries, len) == 1);
+    CHECK(read_frames(peer, frames) == 1 && frames[0].payload[0] == 5 && ack_count(&frames[0]) == 2);
+    subscription *a = find_subscription(s, find_topic("bulk/a"));
+    subscription *b = find_subscription(s, find_topic("bulk/b"));
+    CHECK(a && a->sf == SF_MASK && a->priority == 0);
+    CHECK(b && b->sf == 0 && b->priority == 3);
+
+    // an unknown topic, or one the client is not subscribed to, is not counted
+    int other_peer;
+    connect_client("other", &other_peer);
+    subscribe_topic(find_subscriber("other"), "bulk/x", 0, 0);
+    len = add_entry(entries, 0, 0, "bulk/a");
+    len = add_entry(entries, len, 0, "bulk/none");
+    len = add_entry(entries, len, 0, "bulk/x");
+    CHECK(register_bulk(fd, 6, entries, len) == 1);
+    CHECK(read_frames(peer, frames) == 1 && frames[0].payload[0] == 6 && ack_count(&frames[0]) == 1);
+    CHECK(!find_subscription(s, find_topic("bulk/a")));
+    CHECK(find_subscription(find_subscriber("other"), find_topic("bulk/x")) != NULL);
+
+    // an empty title, after a valid entry
+    len = add_entry(entries, 0, 0, "bulk/c");
+    len = add_entry(entries, len, 0, "");
+    CHECK(register_bulk(fd, 5, entries, len) == 0);
+    CHECK(find_subscription(s, find_topic("bulk/c")) != NULL);
+
+    // an entry cut in its title, and one cut in its header
+    len = add_entry(entries, 0, 0, "bulk/d");
+    CHECK(register_bulk(fd, 5, entries, len - 1) == 0);
+    CHECK(register_bulk(fd, 5, entries, 1) == 0);
+    CHECK(!find_topic("bulk/d") || !find_subscription(s, find_topic("bulk/d")));
+    CHECK(read_frames(peer, frames) == 0);
+
+    close(peer);
+    close(other_peer);
+    reset_server();
+}
+
+
+/*
+ * Subscription profiles: the file format (comments, optional class and interval) and the invalid entries
+ * rejecting a file, and a profile applied at login.
+ */
+static int load_text(char *dir, char *text) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/profiles", dir);
+
+    FILE *f = fopen(path, "w");
+    DIE(f == NULL, "fopen");
+    fputs(text, f);
+    fclose(f);
+
+    return load_profiles(path);
+}
+
+static void check_profiles(char *dir) {
+    frame frames[MAX_FRAMES];
+    int peer;
+
+    CHECK(load_text(dir, "# desk profile\n\n  desk prof/a 1\ndesk prof/b 0 0 250\n\tdesk prof/c 0 -1\n") == 1);
+    profile *p = find_profile("desk");
+    CHECK(p && p->count == 3);
+    CHECK(p && p->count == 3 && !strcmp(p->entries[0].topic, "prof/a") && p->entries[0].sf == SF_MASK);
+    CHECK(p && p->count == 3 && p->entries[1].sf == 1 << PRIORITY_SHIFT && p->entries[1].interval == 250);
+    CHECK(p && p->count == 3 && p->entries[2].sf == 0);
+
+    CHECK(load_text(dir, "bad1 prof/a 2\n") == 0);  // sf is 0 or 1
+    CHECK(load_text(dir, "bad2 prof/a\n") == 0);  // sf missing
+    CHECK(load_text(dir, "bad3 prof/a 0 3\n") == 0);  // no such class
+    CHECK(load_text(dir, "bad4 prof/a 0 0 -5\n") == 0);  // negative interval
+
+    connect_client("prof", &peer);
+    subscriber *s = find_subscriber("prof");
+    apply_profile(s, "desk", MULTICAST_FLAG);
+    CHECK(read_frames(peer, frames) == 1 && !strcmp(frames[0].topic, "desk") && ack_count(&frames[0]) == 3);
+    subscription *a = find_subscription(s, find_topic("prof/a"));
+    subscription *b = find_subscription(s, find_topic("prof/b"));
+    CHECK(a && a->sf == (SF_MASK | MULTICAST_FLAG));
+    CHECK(b && b->priority == 1 && b->interval == 250 && !(b->sf & MULTICAST_FLAG));  // sampled: unicast
+
+    apply_profile(s, "none", 0);
+    CHECK(read_frames(peer, frames) == 1 && !strcmp(frames[0].topic, "none") && ack_count(&frames[0]) == 0);
+
+    close(peer);
+    reset_server();
+}
+
+
+/*
+ * State directory: the state saved at exit restored as it was (snapshot round trip), the changes made
+ * since restored after a crash (journal replay, a record cut while being written dropped), and corrupt
+ * snapshots refused. Each run of the server is a child process, the checks restore its state in this one.
+ */
+static int run_child(void (*body)(char *), char *dir) {
+    fflush(NULL);
+    pid_t pid = fork();
+    DIE(pid < 0, "fork");
+    if (pid == 0) {
+        reset_server();
+        body(dir);
+        _exit(0);
+    }
+
+    int status;
+    DIE(waitpid(pid, &status, 0) < 0, "waitpid");
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/*
+ * Function returning the number of messages stored for a subscriber, and whether they hold the INT
+ * values first, first + 1, ... in order.
+ */
+static int stored_in_order(subscriber *s, long first) {
+    int n = 0;
+    for (list p = s->stored_messages; p != NULL; p = p->next, n++) {
+        stored_message *m = (stored_message *)p->info;
+        if (int_value(m->payload) != first + n) {
+            return -1;
+        }
+    }
+
+    return n;
+}
+
+/*
+ * Function returning the number of topics with the given title in the topic list.
+ */
+static int count_topics(char *title) {
+    int n = 0;
+    for (list p = topics; p != NULL; p = p->next) {
+        n += !strcmp(((topic *)p->info)->title, title);
+    }
+
+    return n;
+}
+
+static void first_run(char *dir) {
+    int peer;
+    snapshot_init(dir, 3600);
+
+    int fd = connect_client("S1", &peer);
+    subscriber *s1 = find_subscriber("S1");
+    subscribe_topic(s1, "state/a", SF_MASK, 0);
+    subscribe_topic(s1, "state/b", (2 + 1) << PRIORITY_SHIFT, 0);
+    subscribe_topic(s1, "state/c", 0, 50);
+    connect_client("S2", &peer);
+    subscribe_topic(find_subscriber("S2"), "state/a", 0, 0);
+    subscribe_topic(find_subscriber("S2"), "state/a@avg:10s", 0, 0);  // saved before its base topic
+
+    disconnect_subscriber(fd);
+    fanout_publish();
+    publish_int("state/a", 1);  // stored for S1
+    publish_int("state/a", 2);
+
+    snapshot_close();
+}
+
+static void second_run(char *dir) {
+    int peer;
+    snapshot_init(dir, 3600);
+
+    connect_client("S3", &peer);
+    subscribe_topic(find_subscriber("S3"), "state/d", SF_MASK, 0);
+    unsubscribe_topic(find_subscriber("S2"), "state/a");
+    fanout_publish();
+    publish_int("state/a", 3);
+    snapshot_tick();  // the journal records are written, no snapshot is due yet
+
+    // the server dies while writing a record
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/journal", dir);
+    int fd = open(path, O_WRONLY | O_APPEND);
+    DIE(fd < 0, "open journal");
+    char partial[] = { JOURNAL_SUBSCRIBER, 10, 'S', '4' };
+    DIE(write(fd, partial, sizeof(partial)) != sizeof(partial), "write");
+    _exit(0);
+}
+
+static void restore(char *dir) {
+    snapshot_init(dir, 3600);
+    snapshot_close();
+}
+
+static void corrupt_snapshot(char *dir, off_t keep) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/snapshot", dir);
+    DIE(truncate(path, keep) < 0, "truncate");
+}
+
+static void check_state(char *dir) {
+    CHECK(run_child(first_run, dir) == 0);
+
+    snapshot_init(dir, 3600);
+    subscriber *s1 = find_subscriber("S1"), *s2 = find_subscriber("S2");
+    CHECK(s1 && s2 && !s1->connected && subscriber_index.size == 2 && topic_index.size == 4);
+    CHECK(count_topics("state/a") == 1);
+    topic *derived = find_topic("state/a@avg:10s");
+    CHECK(derived && derived->aggregate && derived->aggregate->base == find_topic("state/a") &&
+          find_topic("state/a")->aggregates == derived->aggregate);
+    if (s1 && s2) {
+        subscription *a = find_subscription(s1, find_topic("state/a"));
+        subscription *b = find_subscription(s1, find_topic("state/b"));
+        subscription *c = find_subscription(s1, find_topic("state/c"));
+        CHECK(a && a->sf == SF_MASK && b && b->priority == 3 && c && c->interval == 50);
+        CHECK(find_subscription(s2, find_topic("state/a")) != NULL);
+        CHECK(stored_in_order(s1, 1) == 2);
+    }
+    snapshot_close();
+    reset_server();
+
+    CHECK(run_child(second_run, dir) == 0);
+
+    snapshot_init(dir, 3600);
+    s1 = find_subscriber("S1");
+    s2 = find_subscriber("S2");
+    subscriber *s3 = find_subscriber("S3");
+    CHECK(s1 && s2 && s3 && !find_subscriber("S4") && subscriber_index.size == 3);
+    if (s1 && s2 && s3) {
+        CHECK(find_subscription(s3, find_topic("state/d")) != NULL);
+        CHECK(!find_subscription(s2, find_topic("state/a")));
+        CHECK(stored_in_order(s1, 1) == 3);
+    }
+
+    // new records go after the last complete one
+    subscribe_topic(s2, "state/e", 0, 0);
+    snapshot_tick();
+    reset_server();
+    snapshot_init(dir, 3600);
+    CHECK(find_subscriber("S2") && find_subscription(find_subscriber("S2"), find_topic("state/e")));
+    snapshot_close();
+    reset_server();
+
+    // a snapshot cut short, or with a header of another format, is refused
+    CHECK(run_child(restore, dir) == 0);
+    corrupt_snapshot(dir, 40);
+    CHECK(run_child(restore, dir) == EXIT_FAILURE);
+    corrupt_snapshot(dir, 6);
+    CHECK(run_child(restore, dir) == EXIT_FAILURE);
+}
+
+
+int main(int argc, char *argv[]) {
+    char dir[] = "/tmp/self_check.XXXXXX";
+    DIE(mkdtemp(dir) == NULL, "mkdtemp");
+
+    init_database();
+    ratelimit_init(MAX_SOURCES);
+    set_overload_watermarks(SOFT_WATERMARK, HARD_WATERMARK);
+    source.sin_family = AF_INET;
+    source.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    source.sin_port = htons(4242);
+
+    check_batches();
+    check_bulk();
+    check_profiles(dir);
+    check_state(dir);
+
+    free_connections();
+    free_database();
+
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    if (system(cmd) != 0) {
+        fprintf(stderr, "cannot remove %s\n", dir);
+    }
+
+    printf("%d checks, %d failed.\n", checks, failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
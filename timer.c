@@ -0,0 +1,204 @@
+#include "common.h"
+#include "timer.h"
+
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_MASK (TIMER_SLOTS - 1)
+// longest delay, short of a full turn of the last wheel (so never in its current slot)
+#define TIMER_MAX_DELAY ((uint64_t)TIMER_MASK << (TIMER_BITS * (TIMER_LEVELS - 1)))
+
+// hierarchical timing wheels: a timer due within 2^8 ticks is kept in the first wheel, in the slot of its
+// tick; a later one in the slot of its 2^8 (2^16, 2^24) ticks long period in the next wheels, and moved
+// down to the previous wheel when its period comes (so every timer is moved at most TIMER_LEVELS - 1
+// times); each slot is a circular list behind a sentinel
+static timer wheels[TIMER_LEVELS][TIMER_SLOTS];
+static uint64_t current;  // next tick to be processed
+static long pending;  // number of timers in the wheels
+static int ready;
+
+
+/*
+ * Function returning the current tick (ms of the monotonic clock).
+ */
+static uint64_t now_tick(void) {
+    return now_ns() / 1000000;
+}
+
+/*
+ * Function linking the slots' sentinels to themselves, once.
+ */
+static void init_wheels(void) {
+    for (int i = 0; i < TIMER_LEVELS; i++) {
+        for (int j = 0; j < TIMER_SLOTS; j++) {
+            wheels[i][j].next = wheels[i][j].prev = &wheels[i][j];
+        }
+    }
+
+    current = now_tick();
+    ready = 1;
+}
+
+/*
+ * Function initialising a timer (not pending), calling "fire" with "data" when it expires.
+ */
+void timer_init(timer *t, void (*fire)(void *), void *data) {
+    t->next = t->prev = NULL;
+    t->expires = 0;
+    t->fire = fire;
+    t->data = data;
+}
+
+/*
+ * Function linking a timer at the end of a slot.
+ */
+static void link_timer(timer *slot, timer *t) {
+    t->prev = slot->prev;
+    t->next = slot;
+    slot->prev->next = t;
+    slot->prev = t;
+}
+
+/*
+ * Function unlinking a timer from its slot.
+ */
+static void unlink_timer(timer *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+/*
+ * Function placing a timer in the slot of the wheel its expiry tick falls in, relative to the current tick.
+ */
+static void place_timer(timer *t) {
+    if (t->expires < current) {  // already due, fired at the next tick processed
+        t->expires = current;
+    }
+    if (t->expires - current > TIMER_MAX_DELAY) {
+        t->expires = current + TIMER_MAX_DELAY;
+    }
+
+    uint64_t delta = t->expires - current;
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >= 1ULL << (TIMER_BITS * (level + 1))) {
+        level++;
+    }
+
+    link_timer(&wheels[level][(t->expires >> (TIMER_BITS * level)) & TIMER_MASK], t);
+}
+
+/*
+ * Function (re)starting a timer to expire "ms" milliseconds from now.
+ */
+void timer_start(timer *t, uint64_t ms) {
+    if (!ready) {
+        init_wheels();
+    }
+
+    if (t->next) {
+        unlink_timer(t);
+    } else if (!pending++) {
+        current = now_tick();  // nothing was pending, the ticks in between need no processing
+    }
+
+    t->expires = now_tick() + ms;
+    place_timer(t);
+}
+
+/*
+ * Function cancelling a timer, if pending.
+ */
+void timer_cancel(timer *t) {
+    if (t->next) {
+        unlink_timer(t);
+        pending--;
+    }
+}
+
+/*
+ * Function checking whether a timer is pending.
+ */
+int timer_pending(timer *t) {
+    return t->next != NULL;
+}
+
+/*
+ * Function returning the number of ms until the wheels next have to be processed (the earliest timer in
+ * the first wheel, or the next move of timers down from the second one), -1 if no timer is pending.
+ */
+int timers_timeout(void) {
+    if (!pending) {
+        return -1;
+    }
+
+    // the next timers of the first wheel are in the slots up to the end of its turn
+    uint64_t next = (current | TIMER_MASK) + 1;
+    for (uint64_t tick = current; tick < next; tick++) {
+        timer *slot = &wheels[0][tick & TIMER_MASK];
+        if (slot->next != slot) {
+            next = tick;
+            break;
+        }
+    }
+
+    uint64_t now = now_tick();
+    return next > now ? (int)(next - now) : 0;
+}
+
+/*
+ * Function moving the timers of the current slot of a wheel down to the previous wheels; returns the
+ * index of the slot.
+ */
+static int cascade(int level) {
+    int index = (current >> (TIMER_BITS * level)) & TIMER_MASK;
+    timer *slot = &wheels[level][index];
+
+    while (slot->next != slot) {
+        timer *t = slot->next;
+        unlink_timer(t);
+        place_timer(t);
+    }
+
+    return index;
+}
+
+/*
+ * Function processing the ticks elapsed since the last call: the expired timers are fired, in the order
+ * of their ticks. A timer may be set or cancelled (itself or any other) from within "fire".
+ */
+void timers_run(void) {
+    uint64_t now = now_tick();
+
+    if (!pending) {
+        current = now;
+        return;
+    }
+
+    while (current <= now && pending) {
+        int index = current & TIMER_MASK;
+        if (!index) {  // a turn of the first wheel was completed, move the timers of the next period down
+            for (int level = 1; level < TIMER_LEVELS && !cascade(level); level++);
+        }
+
+        // detach the slot first: timers set from within "fire" are placed relative to the next tick
+        timer expired, *slot = &wheels[0][index];
+        expired.next = expired.prev = &expired;
+        if (slot->next != slot) {
+            expired.next = slot->next;
+            expired.prev = slot->prev;
+            expired.next->prev = expired.prev->next = &expired;
+            slot->next = slot->prev = slot;
+        }
+        current++;
+
+        while (expired.next != &expired) {
+            timer *t = expired.next;
+            unlink_timer(t);
+            pending--;
+            t->fire(t->data);
+        }
+    }
+
+    if (!pending) {
+        current = now;
+    }
+}
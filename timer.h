@@ -0,0 +1,29 @@
+#ifndef _TIMER_H
+#define _TIMER_H 1
+
+#include <stdint.h>
+
+#define TIMER_BITS 8  // slots of each wheel: 1 << TIMER_BITS
+#define TIMER_LEVELS 4  // wheels, each tick of one is a full turn of the previous one; the first one ticks
+                        // every ms, so timers are set at most 255 * 2^24 ms (~49 days) ahead
+
+/*
+ * Timer kept in a slot of the timing wheels; "fire" is called with "data" once it expires. The structure
+ * is embedded in the state it belongs to, so that setting and cancelling it never allocates.
+ */
+typedef struct timer {
+    struct timer *next, *prev;  // neighbours in the slot, NULL if the timer is not pending
+    uint64_t expires;  // tick (ms of the monotonic clock) at which the timer fires
+    void (*fire)(void *);
+    void *data;
+} timer;
+
+void timer_init(timer *, void (*)(void *), void *);
+void timer_start(timer *, uint64_t);
+void timer_cancel(timer *);
+int timer_pending(timer *);
+
+int timers_timeout(void);
+void timers_run(void);
+
+#endif
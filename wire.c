@@ -0,0 +1,148 @@
+#include <endian.h>
+#include <string.h>
+
+#include "wire.h"
+
+/*
+ * Function writing a 32-bit value in wire order at "p", which need not be aligned.
+ */
+void put_le32(void *p, uint32_t value) {
+    value = htole32(value);
+    memcpy(p, &value, sizeof(value));
+}
+
+/*
+ * Function reading a 32-bit value in wire order at "p", which need not be aligned.
+ */
+uint32_t get_le32(const void *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return le32toh(value);
+}
+
+/*
+ * Functions converting the fields of a request header between host and wire order, in place.
+ */
+void encode_request_header(request_header *h) {
+    h->len = htole32(h->len);
+}
+
+void decode_request_header(request_header *h) {
+    h->len = le32toh(h->len);
+}
+
+/*
+ * Functions converting the fields of a subscription request between host and wire order, in place.
+ */
+void encode_subscribe(subscribe_packet *p) {
+    p->interval = htole32(p->interval);
+}
+
+void decode_subscribe(subscribe_packet *p) {
+    p->interval = le32toh(p->interval);
+}
+
+/*
+ * Functions converting the fields of a history request between host and wire order, in place.
+ */
+void encode_history_request(history_packet *p) {
+    p->value = htole32(p->value);
+}
+
+void decode_history_request(history_packet *p) {
+    p->value = le32toh(p->value);
+}
+
+/*
+ * Functions converting the fields of a repair request between host and wire order, in place.
+ */
+void encode_nack(nack_packet *p) {
+    p->first = htole32(p->first);
+    p->last = htole32(p->last);
+}
+
+void decode_nack(nack_packet *p) {
+    p->first = le32toh(p->first);
+    p->last = le32toh(p->last);
+}
+
+/*
+ * Function encoding the header of a message from its meta information.
+ */
+void encode_content_header(content_header *h, const message_info *info) {
+    h->data_len = htole32(info->data_len);
+    h->topic_len = htole32(info->topic_len);
+    memcpy(h->ip, info->ip, sizeof(h->ip));
+    h->port = htole16(info->port);
+    h->data_type = info->data_type;
+}
+
+/*
+ * Function decoding the header of a message at "frame", which need not be aligned; the source address is
+ * terminated.
+ */
+void decode_content_header(message_info *info, const void *frame) {
+    content_header h;
+    memcpy(&h, frame, sizeof(h));
+
+    info->data_len = le32toh(h.data_len);
+    info->topic_len = le32toh(h.topic_len);
+    memcpy(info->ip, h.ip, sizeof(info->ip));
+    info->ip[sizeof(info->ip) - 1] = '\0';
+    info->port = le16toh(h.port);
+    info->data_type = h.data_type;
+}
+
+/*
+ * Functions converting the fields of the acknowledgement of a bulk request between host and wire order,
+ * in place.
+ */
+void encode_bulk_ack(bulk_ack *a) {
+    a->count = htole32(a->count);
+}
+
+void decode_bulk_ack(bulk_ack *a) {
+    a->count = le32toh(a->count);
+}
+
+/*
+ * Functions converting the fields of the answer to a history request between host and wire order, in
+ * place.
+ */
+void encode_history_reply(history_reply *r) {
+    r->first = htole32(r->first);
+    r->count = htole32(r->count);
+    r->next = htole32(r->next);
+}
+
+void decode_history_reply(history_reply *r) {
+    r->first = le32toh(r->first);
+    r->count = le32toh(r->count);
+    r->next = le32toh(r->next);
+}
+
+/*
+ * Functions converting the fields of a multicast announcement between host and wire order, in place.
+ */
+void encode_announce(multicast_announce *a) {
+    a->port = htole16(a->port);
+    a->seq = htole32(a->seq);
+}
+
+void decode_announce(multicast_announce *a) {
+    a->port = le16toh(a->port);
+    a->seq = le32toh(a->seq);
+}
+
+/*
+ * Functions converting the fields of the header of a publisher's batch, and of one of its records, from
+ * wire to host order, in place.
+ */
+void decode_publish_batch(publish_batch *b) {
+    b->len = le32toh(b->len);
+    b->count = le16toh(b->count);
+}
+
+void decode_publish_record(publish_record *r) {
+    r->data_len = le16toh(r->data_len);
+}
@@ -0,0 +1,40 @@
+#ifndef _WIRE_H
+#define _WIRE_H 1
+
+#include <stdint.h>
+
+#include "common.h"
+
+/*
+ * Encoding of the wire structures (common.h) exchanged between the server and its clients. The structures
+ * are packed, and their multi-byte fields travel in little-endian order whatever the byte order of the
+ * host (the order of the hosts the protocol was first used between, so that their clients keep working):
+ * a structure is encoded right before it is sent and decoded right after it is received, in place, and
+ * never used otherwise. The header of the messages is converted from and to the in-memory message_info.
+ */
+
+void put_le32(void *, uint32_t);
+uint32_t get_le32(const void *);
+
+void encode_request_header(request_header *);
+void decode_request_header(request_header *);
+void encode_subscribe(subscribe_packet *);
+void decode_subscribe(subscribe_packet *);
+void encode_history_request(history_packet *);
+void decode_history_request(history_packet *);
+void encode_nack(nack_packet *);
+void decode_nack(nack_packet *);
+
+void encode_content_header(content_header *, const message_info *);
+void decode_content_header(message_info *, const void *);
+void encode_bulk_ack(bulk_ack *);
+void decode_bulk_ack(bulk_ack *);
+void encode_history_reply(history_reply *);
+void decode_history_reply(history_reply *);
+void encode_announce(multicast_announce *);
+void decode_announce(multicast_announce *);
+
+void decode_publish_batch(publish_batch *);
+void decode_publish_record(publish_record *);
+
+#endif